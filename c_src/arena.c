@@ -0,0 +1,122 @@
+/*
+%%
+%% cairo erlang binding
+%%
+%% Copyright (c) 2014, The University of Queensland
+%% Author: Alex Wilson <alex@uq.edu.au>
+%%
+%% Redistribution and use in source and binary forms, with or without
+%% modification, are permitted provided that the following conditions are met:
+%%
+%%  * Redistributions of source code must retain the above copyright notice,
+%%    this list of conditions and the following disclaimer.
+%%  * Redistributions in binary form must reproduce the above copyright notice,
+%%    this list of conditions and the following disclaimer in the documentation
+%%    and/or other materials provided with the distribution.
+%%
+%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+%% AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+%% IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+%% ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+%% LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+%% CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF
+%% SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR  BUSINESS
+%% INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+%% CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+%% ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+%% POSSIBILITY OF SUCH DAMAGE.
+%%
+*/
+
+
+#include "common.h"
+
+/*
+ * A bump allocator for everything a one-shot draw needs while it runs:
+ * the decoded instrs, the tag table, font face strings and the context
+ * with its tag slots and extents. The first block is inline in the arena
+ * itself (which lives on the C stack of the NIF call), so small draws
+ * never touch the allocator at all; bigger ones chain extra chunks. It
+ * is all released in one go by arena_release.
+ */
+
+#define ARENA_ALIGN	16
+#define ARENA_CHUNK	65536
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+};
+
+#define CHUNK_HDR	((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void
+arena_init(struct arena *a)
+{
+	a->chunks = NULL;
+	a->p = (char *)a->first;
+	a->end = a->p + sizeof(a->first);
+	a->last = NULL;
+}
+
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk *c;
+	size_t csize;
+	char *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (size > (size_t)(a->end - a->p)) {
+		csize = (size > ARENA_CHUNK / 2) ? size : ARENA_CHUNK;
+		c = enif_alloc(CHUNK_HDR + csize);
+		assert(c != NULL);
+		c->size = csize;
+		c->next = a->chunks;
+		a->chunks = c;
+		a->p = (char *)c + CHUNK_HDR;
+		a->end = a->p + csize;
+	}
+
+	p = a->p;
+	a->p += size;
+	a->last = p;
+	return p;
+}
+
+/*
+ * Grows an allocation. The most recent one can often be extended where
+ * it is; anything else gets a new copy, and the old space is simply left
+ * until the arena is released.
+ */
+void *
+arena_realloc(struct arena *a, void *old, size_t old_size, size_t size)
+{
+	size_t asize;
+	void *p;
+
+	if (old == NULL)
+		return arena_alloc(a, size);
+
+	asize = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (old == a->last && asize <= (size_t)(a->end - (char *)old)) {
+		a->p = (char *)old + asize;
+		return old;
+	}
+
+	p = arena_alloc(a, size);
+	memcpy(p, old, old_size);
+	return p;
+}
+
+void
+arena_release(struct arena *a)
+{
+	struct arena_chunk *c;
+
+	while ((c = a->chunks) != NULL) {
+		a->chunks = c->next;
+		enif_free(c);
+	}
+	arena_init(a);
+}
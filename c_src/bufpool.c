@@ -0,0 +1,291 @@
+/*
+%%
+%% cairo erlang binding
+%%
+%% Copyright (c) 2014, The University of Queensland
+%% Author: Alex Wilson <alex@uq.edu.au>
+%%
+%% Redistribution and use in source and binary forms, with or without
+%% modification, are permitted provided that the following conditions are met:
+%%
+%%  * Redistributions of source code must retain the above copyright notice,
+%%    this list of conditions and the following disclaimer.
+%%  * Redistributions in binary form must reproduce the above copyright notice,
+%%    this list of conditions and the following disclaimer in the documentation
+%%    and/or other materials provided with the distribution.
+%%
+%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+%% AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+%% IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+%% ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+%% LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+%% CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF
+%% SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR  BUSINESS
+%% INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+%% CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+%% ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+%% POSSIBILITY OF SUCH DAMAGE.
+%%
+*/
+
+
+#include "common.h"
+
+/*
+ * Draw output buffers, pooled by (width, height, format). Each pixbuf is
+ * one allocation holding the pixel data and the image surface over it;
+ * draw hands the pixels to Erlang as a resource binary, and when that
+ * binary is garbage collected the pixbuf goes back on its bucket's free
+ * list instead of being freed, up to the bucket's cap.
+ *
+ * Buckets are made on first use (up to BUFPOOL_MAX_BUCKETS) with the
+ * default cap, or configured up front with their own caps. Buffers above
+ * max_bytes, or whose size doesn't fit a bucket, are never pooled.
+ *
+ * Binaries handed out can outlive the library's unload, so the pool is
+ * reference counted by every buffer that is out. Once it is closed,
+ * buffers coming back are freed, and the last one frees the pool.
+ */
+
+#define PIXBUF_HDR	((sizeof(struct pixbuf) + 63) & ~(size_t)63)
+
+static struct buf_bucket *
+bucket_find(struct bufpool *bp, int w, int h, cairo_format_t fmt, int create)
+{
+	struct buf_bucket *b;
+	int i;
+
+	for (i = 0; i < bp->n_buckets; ++i) {
+		b = &bp->buckets[i];
+		if (b->w == w && b->h == h && b->fmt == fmt)
+			return b;
+	}
+	if (!create || bp->n_buckets >= BUFPOOL_MAX_BUCKETS)
+		return NULL;
+
+	b = &bp->buckets[bp->n_buckets++];
+	memset(b, 0, sizeof(*b));
+	b->w = w;
+	b->h = h;
+	b->fmt = fmt;
+	b->cap = bp->default_cap;
+	return b;
+}
+
+struct bufpool *
+bufpool_new(int default_cap, size_t max_bytes)
+{
+	struct bufpool *bp;
+
+	if ((bp = enif_alloc(sizeof(*bp))) == NULL)
+		return NULL;
+	memset(bp, 0, sizeof(*bp));
+	bp->refs = 1;
+	bp->default_cap = default_cap;
+	bp->max_bytes = max_bytes;
+	if ((bp->lock = enif_mutex_create("cairerl_bufpool_lock")) == NULL) {
+		enif_free(bp);
+		return NULL;
+	}
+	return bp;
+}
+
+static void
+bufpool_free(struct bufpool *bp)
+{
+	enif_mutex_destroy(bp->lock);
+	enif_free(bp);
+}
+
+static void
+pixbuf_free(struct pixbuf *pb)
+{
+	cairo_surface_destroy(pb->sfc);
+	enif_free(pb);
+}
+
+/* Sets the cap for one size up front, making its bucket if need be. */
+int
+bufpool_set_cap(struct bufpool *bp, int w, int h, cairo_format_t fmt, int cap)
+{
+	struct buf_bucket *b;
+
+	enif_mutex_lock(bp->lock);
+	if ((b = bucket_find(bp, w, h, fmt, 1)) != NULL)
+		b->cap = cap;
+	enif_mutex_unlock(bp->lock);
+
+	return (b != NULL);
+}
+
+struct pixbuf *
+bufpool_get(struct bufpool *bp, int w, int h, cairo_format_t fmt)
+{
+	struct buf_bucket *b = NULL;
+	struct pixbuf *pb = NULL;
+	int stride;
+	size_t size;
+
+	stride = cairo_format_stride_for_width(fmt, w);
+	size = (size_t)h * stride;
+
+	enif_mutex_lock(bp->lock);
+	if (size <= bp->max_bytes)
+		b = bucket_find(bp, w, h, fmt, (bp->default_cap > 0));
+	if (b != NULL && b->free != NULL) {
+		pb = b->free;
+		b->free = pb->next;
+		--b->n_free;
+		++b->hits;
+	} else if (b != NULL) {
+		++b->misses;
+	} else {
+		++bp->unpooled;
+	}
+	++bp->refs;
+	enif_mutex_unlock(bp->lock);
+
+	if (pb != NULL) {
+		pb->next = NULL;
+		return pb;
+	}
+
+	pb = enif_alloc(PIXBUF_HDR + size);
+	assert(pb != NULL);
+	memset(pb, 0, sizeof(*pb));
+	pb->pool = bp;
+	pb->bucket = b;
+	pb->size = size;
+	pb->data = (unsigned char *)pb + PIXBUF_HDR;
+	pb->sfc = cairo_image_surface_create_for_data(pb->data, fmt, w, h, stride);
+	return pb;
+}
+
+void
+bufpool_put(struct bufpool *bp, struct pixbuf *pb)
+{
+	struct buf_bucket *b = pb->bucket;
+	int last;
+
+	enif_mutex_lock(bp->lock);
+	if (b != NULL && !bp->closed && b->n_free < b->cap) {
+		pb->next = b->free;
+		b->free = pb;
+		++b->n_free;
+		pb = NULL;
+	}
+	last = (--bp->refs == 0);
+	enif_mutex_unlock(bp->lock);
+
+	if (pb != NULL)
+		pixbuf_free(pb);
+	if (last)
+		bufpool_free(bp);
+}
+
+/*
+ * Drops the owner's reference at unload. Free buffers go now; the pool
+ * itself goes with the last buffer still out, if any.
+ */
+void
+bufpool_close(struct bufpool *bp)
+{
+	struct pixbuf *pb, *dead = NULL;
+	int i, last;
+
+	enif_mutex_lock(bp->lock);
+	bp->closed = 1;
+	for (i = 0; i < bp->n_buckets; ++i) {
+		while ((pb = bp->buckets[i].free) != NULL) {
+			bp->buckets[i].free = pb->next;
+			pb->next = dead;
+			dead = pb;
+		}
+		bp->buckets[i].n_free = 0;
+	}
+	last = (--bp->refs == 0);
+	enif_mutex_unlock(bp->lock);
+
+	while ((pb = dead) != NULL) {
+		dead = pb->next;
+		pixbuf_free(pb);
+	}
+	if (last)
+		bufpool_free(bp);
+}
+
+/*
+ * Hands a pixbuf's pixels to Erlang as a binary. Once the binary is
+ * garbage collected the pixbuf is returned to the pool.
+ */
+ERL_NIF_TERM
+pixbuf_make_binary(ErlNifEnv *env, struct cairerl_priv *priv, struct pixbuf *pb)
+{
+	struct pixbuf **ref;
+	ERL_NIF_TERM bin;
+
+	cairo_surface_flush(pb->sfc);
+	ref = enif_alloc_resource(priv->pixbuf_rsrc, sizeof(*ref));
+	assert(ref != NULL);
+	*ref = pb;
+	bin = enif_make_resource_binary(env, ref, pb->data, pb->size);
+	enif_release_resource(ref);
+
+	return bin;
+}
+
+void
+pixbuf_rsrc_dtor(ErlNifEnv *env, void *obj)
+{
+	struct pixbuf **ref = obj;
+
+	bufpool_put((*ref)->pool, *ref);
+}
+
+/* [{{W, H, Format}, [{hits, N}, {misses, N}, {free, N}, {cap, N}]}] */
+ERL_NIF_TERM
+bufpool_stats(ErlNifEnv *env, struct cairerl_priv *priv)
+{
+	struct bufpool *bp = priv->bufpool;
+	struct buf_bucket *b;
+	ERL_NIF_TERM list, key, fmt, counters;
+	int i;
+
+	enif_mutex_lock(bp->lock);
+	list = enif_make_list1(env, enif_make_tuple2(env,
+		enif_make_atom(env, "unpooled"),
+		enif_make_uint64(env, bp->unpooled)));
+	for (i = bp->n_buckets - 1; i >= 0; --i) {
+		b = &bp->buckets[i];
+		switch (b->fmt) {
+			case CAIRO_FORMAT_RGB24:
+				fmt = priv->atom_rgb24;
+				break;
+			case CAIRO_FORMAT_ARGB32:
+				fmt = priv->atom_argb32;
+				break;
+			case CAIRO_FORMAT_RGB16_565:
+				fmt = priv->atom_rgb16_565;
+				break;
+			default:
+				fmt = priv->atom_undefined;
+				break;
+		}
+		key = enif_make_tuple3(env, enif_make_int(env, b->w),
+			enif_make_int(env, b->h), fmt);
+		counters = enif_make_list4(env,
+			enif_make_tuple2(env, enif_make_atom(env, "hits"),
+			    enif_make_uint64(env, b->hits)),
+			enif_make_tuple2(env, enif_make_atom(env, "misses"),
+			    enif_make_uint64(env, b->misses)),
+			enif_make_tuple2(env, enif_make_atom(env, "free"),
+			    enif_make_int(env, b->n_free)),
+			enif_make_tuple2(env, enif_make_atom(env, "cap"),
+			    enif_make_int(env, b->cap)));
+		list = enif_make_list_cell(env,
+			enif_make_tuple2(env, key, counters), list);
+	}
+	enif_mutex_unlock(bp->lock);
+
+	return list;
+}
@@ -28,460 +28,3148 @@
 %%
 */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "common.h"
 
-static enum op_return
-handle_op(ErlNifEnv *env, struct context *ctx, ERL_NIF_TERM op)
-{
-	int arity = 16;
-	int namesz = 64;
-	const ERL_NIF_TERM *args;
-	char namebuf[64];
-	int i, idx = 0;
-	struct op_handler *candidates[n_handlers];
-	int ncand = n_handlers;
-
-	if (!enif_get_tuple(env, op, &arity, &args))
-		return ERR_NOT_TUPLE;
-	if (!(namesz = enif_get_atom(env, args[0], namebuf, namesz, ERL_NIF_LATIN1)))
-		return ERR_NOT_ATOM;
-
-	for (i = 0; i < n_handlers; ++i)
-		candidates[i] = &op_handlers[i];
-
-	for (; idx < namesz; ++idx) {
-		for (i = 0; i < n_handlers; ++i) {
-			if (candidates[i] != NULL) {
-				if ((namebuf[idx] != 0 && candidates[i]->name[idx] == 0) ||
-						candidates[i]->name[idx] != namebuf[idx]) {
-					candidates[i] = NULL;
-					--ncand;
-				} else if ((namebuf[idx] == 0 && candidates[i]->name[idx] == 0) || ncand == 1) {
-					return candidates[i]->handler(env, ctx, &args[1], arity - 1);
-				} else if (ncand == 0) {
+static ERL_NIF_TERM
+op_error(ErlNifEnv *env, cairo_t *cairo, enum op_return ret, ERL_NIF_TERM op)
+{
+	cairo_status_t status;
+
+	switch (ret) {
+		case ERR_NOT_TUPLE:
+		case ERR_NOT_ATOM:
+		case ERR_BAD_ARGS:
+			return enif_make_tuple2(env, enif_make_atom(env, "badarg"), op);
+		case ERR_UNKNOWN_OP:
+			return enif_make_tuple2(env, enif_make_atom(env, "unknown"), op);
+		case ERR_FAILURE:
+			status = (cairo != NULL) ? cairo_status(cairo) : CAIRO_STATUS_SUCCESS;
+			return enif_make_tuple3(env,
+				enif_make_atom(env, "cairo_error"),
+				enif_make_string(env, cairo_status_to_string(status), ERL_NIF_LATIN1),
+				op);
+		case ERR_TAG_ALREADY:
+			return enif_make_tuple2(env, enif_make_atom(env, "tag_already_set"), op);
+		case ERR_TAG_NOT_SET:
+			return enif_make_tuple2(env, enif_make_atom(env, "tag_not_set"), op);
+		default:
+			return enif_make_tuple2(env, enif_make_atom(env, "error"), op);
+	}
+}
+
+static int
+tag_slot_cmp(const void *a, const void *b)
+{
+	return enif_compare(((const struct tag_slot *)a)->tag,
+		((const struct tag_slot *)b)->tag);
+}
+
+static void
+context_free(struct context *ctx)
+{
+	struct tag_slot *ts;
+	int i;
+
+	if (ctx == NULL)
+		return;
+
+	for (i = 0; i < ctx->n_slots; ++i) {
+		ts = &ctx->slots[i];
+		switch (ts->type) {
+			case TAG_PATTERN:
+				cairo_pattern_destroy(ts->v_pattern);
+				break;
+			case TAG_PATH:
+				cairo_path_destroy(ts->v_path);
+				break;
+			default:
+				/* nothing to free */
+				break;
+		}
+	}
+
+	if (ctx->cairo != NULL)
+		cairo_destroy(ctx->cairo);
+	if (ctx->sfc != NULL)
+		cairo_surface_destroy(ctx->sfc);
+	if (ctx->buf != NULL)
+		bufpool_put(ctx->buf->pool, ctx->buf);
+	if (ctx->arena == NULL)
+		enif_free(ctx);
+}
+
+/* The pixel formats draw can render into. */
+static int
+get_draw_format(struct cairerl_priv *priv, const ERL_NIF_TERM term, cairo_format_t *fmt)
+{
+	if (enif_is_identical(term, priv->atom_rgb24))
+		*fmt = CAIRO_FORMAT_RGB24;
+	else if (enif_is_identical(term, priv->atom_rgb16_565))
+		*fmt = CAIRO_FORMAT_RGB16_565;
+	else if (enif_is_identical(term, priv->atom_argb32))
+		*fmt = CAIRO_FORMAT_ARGB32;
+	else
+		return 0;
+	return 1;
+}
+
+static int
+check_dimensions(ErlNifEnv *env, int w, int h, ERL_NIF_TERM *err)
+{
+	if (w < 0 || h < 0) {
+		*err = enif_make_atom(env, "negative_dimensions");
+		return 0;
+	}
+	if (w > 32768 || h > 32768) {
+		*err = enif_make_atom(env, "dimensions_too_big");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Copies a filename term into a freshly allocated, NUL-terminated path.
+ * Names with a NUL inside would silently open some other file, so they
+ * are refused.
+ */
+static int
+get_path(ErlNifEnv *env, ERL_NIF_TERM term, char **path)
+{
+	ErlNifBinary fname;
+
+	if (!enif_inspect_binary(env, term, &fname)) {
+		if (!enif_inspect_iolist_as_binary(env, term, &fname))
+			return 0;
+	}
+	if (fname.size == 0 || memchr(fname.data, 0, fname.size) != NULL)
+		return 0;
+
+	*path = enif_alloc(fname.size + 1);
+	assert(*path != NULL);
+	memcpy(*path, fname.data, fname.size);
+	(*path)[fname.size] = 0;
+
+	return 1;
+}
+
+/*
+ * Allocates a context with room for the program's tag slots and extents
+ * structs, and fills in the initial tags. The caller provides the surface
+ * and cairo_t. Returns NULL and sets *err on failure.
+ */
+static struct context *
+context_alloc(ErlNifEnv *env, struct cairerl_priv *priv, const ERL_NIF_TERM init_tags, const struct program *prog, ERL_NIF_TERM *err)
+{
+	struct context *ctx = NULL;
+	ERL_NIF_TERM head, tail;
+	int arity, i, slot;
+	unsigned int n_init;
+	size_t slots_size;
+	double v;
+	const ERL_NIF_TERM *tuple;
+
+	if (!enif_get_list_length(env, init_tags, &n_init)) {
+		*err = enif_make_atom(env, "bad_init_args");
+		goto fail;
+	}
+
+	/*
+	 * The tag slots and extents structs live directly after the context,
+	 * so the whole draw needs just this one allocation. Initial tags that
+	 * the program never mentions get extra slots on the end.
+	 */
+	slots_size = (prog->n_tags + n_init) * sizeof(struct tag_slot) +
+		prog->n_text_exts * sizeof(cairo_text_extents_t) +
+		prog->n_font_exts * sizeof(cairo_font_extents_t);
+	if (prog->arena != NULL) {
+		/* a one-shot program and its context live exactly as long as the draw */
+		ctx = arena_alloc(prog->arena, sizeof(*ctx) + slots_size);
+	} else {
+		ctx = enif_alloc(sizeof(*ctx) + slots_size);
+		assert(ctx != NULL);
+	}
+	memset(ctx, 0, sizeof(*ctx) + slots_size);
+	ctx->priv = priv;
+	ctx->arena = prog->arena;
+	ctx->slots = (struct tag_slot *)(ctx + 1);
+	ctx->text_exts = (cairo_text_extents_t *)(ctx->slots + prog->n_tags + n_init);
+	ctx->font_exts = (cairo_font_extents_t *)(ctx->text_exts + prog->n_text_exts);
+	ctx->n_slots = prog->n_tags;
+	for (i = 0; i < prog->n_tags; ++i)
+		ctx->slots[i].tag = prog->tags[i];
+
+	/* populate the initial tags */
+	tail = init_tags;
+	while (enif_get_list_cell(env, tail, &head, &tail)) {
+		arity = 2;
+		if (!enif_get_tuple(env, head, &arity, &tuple)) {
+			*err = enif_make_atom(env, "bad_init_args");
+			goto fail;
+		}
+		if (arity != 2) {
+			*err = enif_make_atom(env, "bad_init_args");
+			goto fail;
+		}
+		if (!enif_get_double(env, tuple[1], &v)) {
+			*err = enif_make_atom(env, "bad_init_tag_type");
+			goto fail;
+		}
+		slot = program_find_tag(prog, tuple[0]);
+		if (slot == -1) {
+			for (slot = prog->n_tags; slot < ctx->n_slots; ++slot) {
+				if (enif_is_identical(ctx->slots[slot].tag, tuple[0]))
 					break;
-				}
 			}
+			if (slot == ctx->n_slots)
+				ctx->slots[ctx->n_slots++].tag = tuple[0];
+		}
+		if (set_tag_double(ctx, slot, v) != OP_OK) {
+			*err = enif_make_atom(env, "duplicate_tag");
+			goto fail;
 		}
 	}
-	return ERR_UNKNOWN_OP;
+
+	return ctx;
+
+fail:
+	context_free(ctx);
+	return NULL;
 }
 
-/* draw(Pixels :: binary(), InitTags :: tags(), Ops :: [cairerl:op()]) -> {ok, tags(), binary()} | {error, atom()} */
-static ERL_NIF_TERM
-draw(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+/* Creates ctx->cairo over ctx->sfc, setting *err if either is unusable. */
+static int
+context_attach(ErlNifEnv *env, struct context *ctx, ERL_NIF_TERM *err)
+{
+	int status;
+
+	if ((status = cairo_surface_status(ctx->sfc)) != CAIRO_STATUS_SUCCESS) {
+		*err = enif_make_tuple2(env, enif_make_atom(env, "bad_surface_status"), enif_make_int(env, status));
+		return 0;
+	}
+	ctx->cairo = cairo_create(ctx->sfc);
+	if ((status = cairo_status(ctx->cairo)) != CAIRO_STATUS_SUCCESS) {
+		*err = enif_make_tuple2(env, enif_make_atom(env, "bad_cairo_status"), enif_make_int(env, status));
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Sets up a context for running a program against a copy of the image:
+ * allocates the surface, the tag slots and the extents structs, and fills
+ * in the initial tags. Returns NULL and sets *err on failure.
+ */
+static struct context *
+context_new(ErlNifEnv *env, struct cairerl_priv *priv, const ERL_NIF_TERM image, const ERL_NIF_TERM init_tags, const struct program *prog, ERL_NIF_TERM *err)
 {
 	ErlNifBinary pixels;
 	struct context *ctx = NULL;
-	struct tag_node *tn = NULL, *rn, *tn_next;
-	ERL_NIF_TERM head, tail, out_tags, err = 0, ret;
-	int arity, status, stride;
+	int arity, w, h;
 	cairo_format_t fmt;
-	const ERL_NIF_TERM *tuple;
 	const ERL_NIF_TERM *img_tuple;
-	ERL_NIF_TERM out_tuple[5];
 
 	arity = 5;
-	if (!enif_get_tuple(env, argv[0], &arity, &img_tuple)) {
-		err = enif_make_atom(env, "bad_pixels");
+	if (!enif_get_tuple(env, image, &arity, &img_tuple)) {
+		*err = enif_make_atom(env, "bad_pixels");
 		goto fail;
 	}
-	if (arity != 5 || !enif_is_identical(img_tuple[0], enif_make_atom(env, "cairo_image"))) {
-		err = enif_make_atom(env, "bad_record");
+	if (arity != 5 || !enif_is_identical(img_tuple[0], priv->atom_cairo_image)) {
+		*err = enif_make_atom(env, "bad_record");
 		goto fail;
 	}
-	if (enif_is_identical(img_tuple[3], enif_make_atom(env, "rgb24"))) {
-		fmt = CAIRO_FORMAT_RGB24;
-	} else if (enif_is_identical(img_tuple[3], enif_make_atom(env, "rgb16_565"))) {
-		fmt = CAIRO_FORMAT_RGB16_565;
-	} else if (enif_is_identical(img_tuple[3], enif_make_atom(env, "argb32"))) {
-		fmt = CAIRO_FORMAT_ARGB32;
-	} else {
-		err = enif_make_atom(env, "bad_pixel_format");
+	if (!get_draw_format(priv, img_tuple[3], &fmt)) {
+		*err = enif_make_atom(env, "bad_pixel_format");
 		goto fail;
 	}
 	if (!enif_inspect_binary(env, img_tuple[4], &pixels)) {
-		err = enif_make_atom(env, "bad_pixel_data");
+		*err = enif_make_atom(env, "bad_pixel_data");
 		goto fail;
 	}
 
-	ctx = enif_alloc(sizeof(*ctx));
-	assert(ctx != NULL);
-	memset(ctx, 0, sizeof(*ctx));
-	RB_INIT(&ctx->tag_head);
-
 	/* get dimensions from the record */
-	if (!enif_get_int(env, img_tuple[1], &ctx->w)) {
-		err = enif_make_atom(env, "bad_width");
+	if (!enif_get_int(env, img_tuple[1], &w)) {
+		*err = enif_make_atom(env, "bad_width");
 		goto fail;
 	}
-	if (!enif_get_int(env, img_tuple[2], &ctx->h)) {
-		err = enif_make_atom(env, "bad_height");
+	if (!enif_get_int(env, img_tuple[2], &h)) {
+		*err = enif_make_atom(env, "bad_height");
 		goto fail;
 	}
-	if (ctx->w < 0 || ctx->h < 0) {
-		err = enif_make_atom(env, "negative_dimensions");
+	if (!check_dimensions(env, w, h, err))
 		goto fail;
-	}
-	if (ctx->w > 32768 || ctx->h > 32768) {
-		err = enif_make_atom(env, "dimensions_too_big");
+
+	if ((ctx = context_alloc(env, priv, init_tags, prog, err)) == NULL)
 		goto fail;
-	}
+	ctx->fmt = img_tuple[3];
+	ctx->w = w;
+	ctx->h = h;
 
-	/* allocate and fill the bitmap and cairo context */
-	stride = cairo_format_stride_for_width(fmt, ctx->w);
-	assert(enif_alloc_binary(ctx->h * stride, &ctx->out));
-	assert(ctx->out.data != NULL);
+	/* get a bitmap from the pool, fill it and make the cairo context */
+	ctx->buf = bufpool_get(priv->bufpool, w, h, fmt);
+	if (pixels.size > ctx->buf->size)
+		pixels.size = ctx->buf->size;
 	if (pixels.size > 0)
-		memcpy(ctx->out.data, pixels.data, pixels.size);
-
-	ctx->sfc = cairo_image_surface_create_for_data(
-			ctx->out.data, fmt, ctx->w, ctx->h, stride);
+		memcpy(ctx->buf->data, pixels.data, pixels.size);
+	/* pooled buffers still hold someone else's last frame */
+	if (pixels.size < ctx->buf->size)
+		memset(ctx->buf->data + pixels.size, 0, ctx->buf->size - pixels.size);
+	cairo_surface_mark_dirty(ctx->buf->sfc);
 
-	if ((status = cairo_surface_status(ctx->sfc)) != CAIRO_STATUS_SUCCESS) {
-		err = enif_make_tuple2(env, enif_make_atom(env, "bad_surface_status"), enif_make_int(env, status));
-		goto fail;
-	}
-	ctx->cairo = cairo_create(ctx->sfc);
-	if ((status = cairo_status(ctx->cairo)) != CAIRO_STATUS_SUCCESS) {
-		err = enif_make_tuple2(env, enif_make_atom(env, "bad_cairo_status"), enif_make_int(env, status));
+	ctx->sfc = cairo_surface_reference(ctx->buf->sfc);
+	if (!context_attach(env, ctx, err))
 		goto fail;
-	}
 
-	/* populate the initial tag tree */
-	tail = argv[1];
-	while (enif_get_list_cell(env, tail, &head, &tail)) {
-		arity = 2;
-		if (!enif_get_tuple(env, head, &arity, &tuple)) {
-			err = enif_make_atom(env, "bad_init_args");
-			goto fail;
-		}
-		if (arity != 2) {
-			err = enif_make_atom(env, "bad_init_args");
-			goto fail;
-		}
-		tn = enif_alloc(sizeof(*tn));
-		memset(tn, 0, sizeof(*tn));
-		tn->type = TAG_DOUBLE;
-		tn->tag = tuple[0];
-		if (!enif_get_double(env, tuple[1], &tn->v_dbl)) {
-			enif_free(tn);
-			err = enif_make_atom(env, "bad_init_tag_type");
-			goto fail;
-		}
-		rn = RB_INSERT(tag_tree, &ctx->tag_head, tn);
-		if (rn != NULL) {
-			err = enif_make_atom(env, "duplicate_tag");
-			enif_free(tn);
-			goto fail;
-		}
-	}
+	return ctx;
 
-	/* now run the ops */
-	tail = argv[2];
-	while (enif_get_list_cell(env, tail, &head, &tail)) {
-		enum op_return ret;
-
-		ret = handle_op(env, ctx, head);
-
-		switch (ret) {
-			case OP_OK:
-				if ((status = cairo_status(ctx->cairo)) != CAIRO_STATUS_SUCCESS) {
-					err = enif_make_tuple3(env,
-						enif_make_atom(env, "cairo_error"),
-						enif_make_string(env, cairo_status_to_string(status), ERL_NIF_LATIN1),
-						head);
-					goto fail;
-				}
-				break;
-			case ERR_NOT_TUPLE:
-			case ERR_NOT_ATOM:
-			case ERR_BAD_ARGS:
-				err = enif_make_tuple2(env, enif_make_atom(env, "badarg"), head);
-				goto fail;
-			case ERR_UNKNOWN_OP:
-				err = enif_make_tuple2(env, enif_make_atom(env, "unknown"), head);
-				goto fail;
-			case ERR_FAILURE:
-				status = cairo_status(ctx->cairo);
-				err = enif_make_tuple3(env,
-					enif_make_atom(env, "cairo_error"),
-					enif_make_string(env, cairo_status_to_string(status), ERL_NIF_LATIN1),
-					head);
-				goto fail;
-			case ERR_TAG_ALREADY:
-				err = enif_make_tuple2(env, enif_make_atom(env, "tag_already_set"), head);
-				goto fail;
-			case ERR_TAG_NOT_SET:
-				err = enif_make_tuple2(env, enif_make_atom(env, "tag_not_set"), head);
-				goto fail;
-			default:
-				err = enif_make_tuple2(env, enif_make_atom(env, "error"), head);
-				goto fail;
-		}
-	}
+fail:
+	context_free(ctx);
+	return NULL;
+}
 
-	/* we got through ok, construct our return values */
-	out_tuple[0] = enif_make_atom(env, "cairo_image");
-	out_tuple[1] = enif_make_int(env, ctx->w);
-	out_tuple[2] = enif_make_int(env, ctx->h);
-	out_tuple[3] = img_tuple[3];
-	cairo_surface_finish(ctx->sfc);
-	out_tuple[4] = enif_make_binary(env, &ctx->out);
+/* Runs a single instruction, folding a bad cairo status into ERR_FAILURE. */
+static enum op_return
+context_exec(struct context *ctx, const struct op_instr *in)
+{
+	enum op_return ret;
+
+	ret = in->handler->handler(ctx, in);
+	if (ret == OP_OK && cairo_status(ctx->cairo) != CAIRO_STATUS_SUCCESS)
+		ret = ERR_FAILURE;
+	return ret;
+}
+
+/* Builds the sorted list of set tags. Returns 0 and sets *err on failure. */
+static int
+context_tags(ErlNifEnv *env, struct context *tctx, ERL_NIF_TERM *tags, ERL_NIF_TERM *err)
+{
+	struct cairerl_priv *priv = tctx->priv;
+	struct tag_slot *ts;
+	ERL_NIF_TERM out_tags, tag;
+	int i;
+
+	qsort(tctx->slots, tctx->n_slots, sizeof(struct tag_slot), tag_slot_cmp);
 
 	out_tags = enif_make_list(env, 0);
-	for (tn = RB_MIN(tag_tree, &ctx->tag_head); tn != NULL; tn = tn_next) {
+	for (i = 0; i < tctx->n_slots; ++i) {
 		ERL_NIF_TERM val;
 
-		tn_next = RB_NEXT(tag_tree, &ctx->tag_head, tn);
-		RB_REMOVE(tag_tree, &ctx->tag_head, tn);
-
-		switch (tn->type) {
+		ts = &tctx->slots[i];
+		switch (ts->type) {
+			case TAG_NONE:
+				continue;
 			case TAG_DOUBLE:
-				val = enif_make_double(env, tn->v_dbl);
+				val = enif_make_double(env, ts->v_dbl);
 				break;
 			case TAG_TEXT_EXTENTS:
 				val = enif_make_tuple7(env,
-					enif_make_atom(env, "cairo_tag_text_extents"),
-					enif_make_double(env, tn->v_text_exts->x_bearing),
-					enif_make_double(env, tn->v_text_exts->y_bearing),
-					enif_make_double(env, tn->v_text_exts->width),
-					enif_make_double(env, tn->v_text_exts->height),
-					enif_make_double(env, tn->v_text_exts->x_advance),
-					enif_make_double(env, tn->v_text_exts->y_advance));
-				enif_free(tn->v_text_exts);
+					priv->atom_cairo_tag_text_extents,
+					enif_make_double(env, ts->v_text_exts->x_bearing),
+					enif_make_double(env, ts->v_text_exts->y_bearing),
+					enif_make_double(env, ts->v_text_exts->width),
+					enif_make_double(env, ts->v_text_exts->height),
+					enif_make_double(env, ts->v_text_exts->x_advance),
+					enif_make_double(env, ts->v_text_exts->y_advance));
 				break;
 			case TAG_FONT_EXTENTS:
 				val = enif_make_tuple6(env,
-					enif_make_atom(env, "cairo_tag_font_extents"),
-					enif_make_double(env, tn->v_font_exts->ascent),
-					enif_make_double(env, tn->v_font_exts->descent),
-					enif_make_double(env, tn->v_font_exts->height),
-					enif_make_double(env, tn->v_font_exts->max_x_advance),
-					enif_make_double(env, tn->v_font_exts->max_y_advance));
-				enif_free(tn->v_font_exts);
+					priv->atom_cairo_tag_font_extents,
+					enif_make_double(env, ts->v_font_exts->ascent),
+					enif_make_double(env, ts->v_font_exts->descent),
+					enif_make_double(env, ts->v_font_exts->height),
+					enif_make_double(env, ts->v_font_exts->max_x_advance),
+					enif_make_double(env, ts->v_font_exts->max_y_advance));
 				break;
 			case TAG_PATTERN:
-				switch (cairo_pattern_get_type(tn->v_pattern)) {
+				switch (cairo_pattern_get_type(ts->v_pattern)) {
 					case CAIRO_PATTERN_TYPE_SOLID:
 						val = enif_make_tuple2(env,
-							enif_make_atom(env, "cairo_tag_pattern"),
-							enif_make_atom(env, "solid"));
+							priv->atom_cairo_tag_pattern,
+							priv->atom_solid);
 						break;
 					case CAIRO_PATTERN_TYPE_SURFACE:
 						val = enif_make_tuple2(env,
-							enif_make_atom(env, "cairo_tag_pattern"),
-							enif_make_atom(env, "surface"));
+							priv->atom_cairo_tag_pattern,
+							priv->atom_surface);
 						break;
 					case CAIRO_PATTERN_TYPE_LINEAR:
 						val = enif_make_tuple2(env,
-							enif_make_atom(env, "cairo_tag_pattern"),
-							enif_make_atom(env, "linear"));
+							priv->atom_cairo_tag_pattern,
+							priv->atom_linear);
 						break;
 					default:
-						err = enif_make_atom(env, "unhandled_tag_pattern_type");
-						goto fail;
+						*err = enif_make_atom(env, "unhandled_tag_pattern_type");
+						return 0;
 				}
-				cairo_pattern_destroy(tn->v_pattern);
 				break;
 			case TAG_PATH:
 				val = enif_make_tuple2(env,
-					enif_make_atom(env, "cairo_tag_path"),
-					enif_make_int(env, tn->v_path->num_data));
-				cairo_path_destroy(tn->v_path);
+					priv->atom_cairo_tag_path,
+					enif_make_int(env, ts->v_path->num_data));
 				break;
 			default:
-				err = enif_make_tuple2(env,
+				*err = enif_make_tuple2(env,
 					enif_make_atom(env, "unknown_tag_type"),
-					enif_make_int(env, tn->type));
-				goto fail;
+					enif_make_int(env, ts->type));
+				return 0;
 		}
 
+		/* a yielding draw keeps its initial tags in the job's env */
+		tag = enif_is_atom(env, ts->tag) ? ts->tag : enif_make_copy(env, ts->tag);
 		out_tags = enif_make_list_cell(env,
-			enif_make_tuple2(env, tn->tag, val), out_tags);
-
-		enif_free(tn);
+			enif_make_tuple2(env, tag, val), out_tags);
 	}
 
-	ret = enif_make_tuple3(env,
-		enif_make_atom(env, "ok"),
-		out_tags,
-		enif_make_tuple_from_array(env, out_tuple, 5));
-	goto free_and_exit;
-
-fail:
-	ret = enif_make_tuple2(env, enif_make_atom(env, "error"), err);
+	*tags = out_tags;
+	return 1;
+}
 
-free_and_exit:
-	if (ctx != NULL) {
-		for (tn = RB_MIN(tag_tree, &ctx->tag_head); tn != NULL; tn = tn_next) {
-			tn_next = RB_NEXT(tag_tree, &ctx->tag_head, tn);
-			RB_REMOVE(tag_tree, &ctx->tag_head, tn);
+/* Runs every op in prog on ctx, setting *err on the first failure. */
+static int
+context_run(ErlNifEnv *env, struct context *ctx, const struct program *prog, ERL_NIF_TERM *err)
+{
+	enum op_return ret;
+	int i;
 
-			switch (tn->type) {
-				case TAG_TEXT_EXTENTS:
-					enif_free(tn->v_text_exts);
-					break;
-				case TAG_FONT_EXTENTS:
-					enif_free(tn->v_font_exts);
-					break;
-				case TAG_PATTERN:
-					cairo_pattern_destroy(tn->v_pattern);
-					break;
-				case TAG_PATH:
-					cairo_path_destroy(tn->v_path);
-					break;
-				default:
-					/* nothing to free */
-					break;
-			}
+	for (i = 0; i < prog->n_instrs; ++i) {
+		const struct op_instr *in = &prog->instrs[i];
 
-			enif_free(tn);
+		if ((ret = context_exec(ctx, in)) != OP_OK) {
+			/* compiled programs keep their op terms in their own env */
+			*err = op_error(env, ctx->cairo, ret, (prog->env != NULL) ?
+				enif_make_copy(env, in->op) : in->op);
+			return 0;
 		}
+	}
+	return 1;
+}
 
-		if (ctx->cairo != NULL)
-			cairo_destroy(ctx->cairo);
-		if (ctx->sfc != NULL)
-			cairo_surface_destroy(ctx->sfc);
-		if (err != 0 && ctx->out.data != NULL)
-			enif_release_binary(&ctx->out);
-		enif_free(ctx);
+/* [{X, Y, W, H}] in pixels, for the damage option */
+static ERL_NIF_TERM
+context_damage(ErlNifEnv *env, const struct context *ctx)
+{
+	const struct damage_rect *r;
+	ERL_NIF_TERM list;
+	int i;
+
+	list = enif_make_list(env, 0);
+	for (i = ctx->n_damage - 1; i >= 0; --i) {
+		r = &ctx->damage[i];
+		list = enif_make_list_cell(env, enif_make_tuple4(env,
+			enif_make_int(env, r->x0), enif_make_int(env, r->y0),
+			enif_make_int(env, r->x1 - r->x0), enif_make_int(env, r->y1 - r->y0)),
+			list);
 	}
-	return ret;
+	return list;
 }
 
+/*
+ * Builds {ok, Tags, Image} from a context whose ops have all run, taking
+ * the tags from tctx (which is just ctx, except for tiled draws), or
+ * {ok, Tags, Image, Damage} when damage was tracked. The pixel binary is
+ * handed over to the result, so this can only be done once per context.
+ */
 static ERL_NIF_TERM
-png_read(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+context_result(ErlNifEnv *env, struct context *ctx, struct context *tctx)
 {
-	char fnamebuf[256];
-	cairo_surface_t *sfc = NULL;
-	cairo_format_t fmt;
-	ErlNifBinary fname, img;
-	cairo_status_t status;
-	ERL_NIF_TERM err;
-	int w, h, stride;
+	struct cairerl_priv *priv = ctx->priv;
+	ERL_NIF_TERM out_tags, err;
 	ERL_NIF_TERM out_tuple[5];
 
-	memset(&fname, 0, sizeof(fname));
-	memset(&img, 0, sizeof(img));
+	if (!context_tags(env, tctx, &out_tags, &err))
+		return enif_make_tuple2(env, priv->atom_error, err);
 
-	/* get the filename to read from */
-	if (!enif_inspect_binary(env, argv[0], &fname)) {
-		if (!enif_inspect_iolist_as_binary(env, argv[0], &fname)) {
-			err = enif_make_atom(env, "bad_filename");
-			goto fail;
-		}
-	}
-	assert(fname.size < 255);
-	memcpy(fnamebuf, fname.data, fname.size);
-	fnamebuf[fname.size] = 0;
+	out_tuple[0] = priv->atom_cairo_image;
+	out_tuple[1] = enif_make_int(env, ctx->w);
+	out_tuple[2] = enif_make_int(env, ctx->h);
+	out_tuple[3] = ctx->fmt;
+	/* the pixels go back to the pool when this binary is collected */
+	out_tuple[4] = pixbuf_make_binary(env, priv, ctx->buf);
+	ctx->buf = NULL;
 
-	sfc = cairo_image_surface_create_from_png(fnamebuf);
-	if ((status = cairo_surface_status(sfc)) != CAIRO_STATUS_SUCCESS) {
-		err = enif_make_tuple2(env, enif_make_atom(env, "bad_surface_status"), enif_make_int(env, status));
-		goto fail;
-	}
+	if (ctx->track_damage)
+		return enif_make_tuple4(env,
+			priv->atom_ok,
+			out_tags,
+			enif_make_tuple_from_array(env, out_tuple, 5),
+			context_damage(env, ctx));
+	return enif_make_tuple3(env,
+		priv->atom_ok,
+		out_tags,
+		enif_make_tuple_from_array(env, out_tuple, 5));
+}
 
-	fmt = cairo_image_surface_get_format(sfc);
-	w = cairo_image_surface_get_width(sfc);
-	h = cairo_image_surface_get_height(sfc);
-	stride = cairo_image_surface_get_stride(sfc);
-	assert(stride == cairo_format_stride_for_width(fmt, w));
+/*
+ * Runs a program against a copy of the image in one go. This is the body
+ * of draw/3, draw_binary/3, draw_compiled/3 and the async pool workers,
+ * so they always give the same result.
+ */
+static ERL_NIF_TERM
+draw_program(ErlNifEnv *env, struct cairerl_priv *priv, const ERL_NIF_TERM image, const ERL_NIF_TERM init_tags, const struct program *prog)
+{
+	struct context *ctx;
+	ERL_NIF_TERM err, ret;
 
-	assert(enif_alloc_binary(h*stride, &img));
-	memcpy(img.data, cairo_image_surface_get_data(sfc), h*stride);
+	if ((ctx = context_new(env, priv, image, init_tags, prog, &err)) == NULL)
+		return enif_make_tuple2(env, priv->atom_error, err);
 
-	out_tuple[0] = enif_make_atom(env, "cairo_image");
-	out_tuple[1] = enif_make_int(env, w);
-	out_tuple[2] = enif_make_int(env, h);
-	switch (fmt) {
-		case CAIRO_FORMAT_RGB24:
-			out_tuple[3] = enif_make_atom(env, "rgb24");
-			break;
-		case CAIRO_FORMAT_ARGB32:
-			out_tuple[3] = enif_make_atom(env, "argb32");
-			break;
-		case CAIRO_FORMAT_RGB30:
-			out_tuple[3] = enif_make_atom(env, "rgb30");
-			break;
-		case CAIRO_FORMAT_RGB16_565:
-			out_tuple[3] = enif_make_atom(env, "rgb16_565");
-			break;
-		default:
-			err = enif_make_atom(env, "invalid_format");
-			goto fail;
-	}
-	out_tuple[4] = enif_make_binary(env, &img);
-	img.data = NULL;
+	if (context_run(env, ctx, prog, &err))
+		ret = context_result(env, ctx, ctx);
+	else
+		ret = enif_make_tuple2(env, priv->atom_error, err);
+	context_free(ctx);
+	return ret;
+}
 
-	cairo_surface_destroy(sfc);
+/*
+ * A yielding draw keeps everything it needs in one of these between
+ * slices: the context, the program and the index of the next op. One-shot
+ * programs are compiled into the job's own env, so their op terms and
+ * text binaries outlive the call that started them; compiled programs are
+ * referenced instead.
+ *
+ * Compiling is sliced too: until cur.done the job is still decoding ops,
+ * and ctx (which needs the finished program's tags) isn't made yet.
+ */
+struct draw_job {
+	ErlNifEnv *env;
+	ERL_NIF_TERM image;
+	ERL_NIF_TERM init_tags;
+	struct program prog;
+	struct program_cursor cur;
+	struct program *run;
+	struct context *ctx;
+	int pc;
+};
 
-	return enif_make_tuple2(env,
-		enif_make_atom(env, "ok"),
-		enif_make_tuple_from_array(env, out_tuple, 5));
+static void
+draw_job_dtor(ErlNifEnv *env, void *obj)
+{
+	struct draw_job *job = obj;
 
-fail:
-	if (sfc != NULL)
-		cairo_surface_destroy(sfc);
-	if (img.data != NULL)
-		enif_release_binary(&img);
-	return enif_make_tuple2(env, enif_make_atom(env, "error"), err);
+	context_free(job->ctx);
+	program_clear(&job->prog);
+	if (job->run != NULL && job->run != &job->prog)
+		enif_release_resource(job->run);
+	if (job->env != NULL)
+		enif_free_env(job->env);
+}
+
+/*
+ * Reports the time spent since *mark to the scheduler, as a percentage
+ * of a normal NIF's ~1ms budget. Returns non-zero once the budget for
+ * this slice is used up.
+ */
+#define DRAW_SLICE_USEC		1000
+#define DRAW_CHUNK_OPS		32
+
+static int
+draw_timeslice_spent(ErlNifEnv *env, ErlNifTime *mark)
+{
+	ErlNifTime now = enif_monotonic_time(ERL_NIF_USEC);
+	int pct;
+
+	pct = (int)((now - *mark) * 100 / DRAW_SLICE_USEC);
+	if (pct < 1)
+		return 0;
+	if (pct > 100)
+		pct = 100;
+	*mark = now;
+	return enif_consume_timeslice(env, pct);
 }
 
 static ERL_NIF_TERM
-png_write(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+draw_job_resume(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-	ErlNifBinary fname;
-	char fnamebuf[256];
-	cairo_status_t status;
-	cairo_surface_t *sfc = NULL;
-	ERL_NIF_TERM err;
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct draw_job *job;
+	const struct op_instr *in;
+	enum op_return ret;
+	ERL_NIF_TERM res, err, bad_op;
+	ErlNifTime mark;
 
-	/* get the filename to write to */
-	if (!enif_inspect_binary(env, argv[1], &fname)) {
-		if (!enif_inspect_iolist_as_binary(env, argv[1], &fname)) {
-			err = enif_make_atom(env, "bad_filename");
-			goto fail;
+	if (!enif_get_resource(env, argv[0], priv->draw_job_rsrc, (void **)&job))
+		return enif_make_badarg(env);
+
+	mark = enif_monotonic_time(ERL_NIF_USEC);
+	if (job->ctx == NULL) {
+		while (!job->cur.done) {
+			ret = program_compile_some(job->env, &job->prog, &job->cur,
+				DRAW_CHUNK_OPS, &bad_op);
+			if (ret != OP_OK)
+				return enif_make_tuple2(env, priv->atom_error,
+					op_error(env, NULL, ret, enif_make_copy(env, bad_op)));
+			if (!job->cur.done && draw_timeslice_spent(env, &mark))
+				return enif_schedule_nif(env, "draw", 0,
+					draw_job_resume, argc, argv);
 		}
+
+		/* copies the whole input frame, so it gets a slice of its own */
+		job->ctx = context_new(job->env, priv, job->image, job->init_tags,
+			job->run, &err);
+		if (job->ctx == NULL)
+			return enif_make_tuple2(env, priv->atom_error,
+				enif_make_copy(env, err));
+		if (job->run->n_instrs > 0 && draw_timeslice_spent(env, &mark))
+			return enif_schedule_nif(env, "draw", 0,
+				draw_job_resume, argc, argv);
 	}
-	assert(fname.size < 255);
-	memcpy(fnamebuf, fname.data, fname.size);
-	fnamebuf[fname.size] = 0;
 
-	if (!create_surface_from_image(env, argv[0], &sfc, &err))
-		goto fail;
+	while (job->pc < job->run->n_instrs) {
+		in = &job->run->instrs[job->pc++];
 
-	if ((status = cairo_surface_write_to_png(sfc, fnamebuf)) != CAIRO_STATUS_SUCCESS) {
-		err = enif_make_tuple2(env, enif_make_atom(env, "bad_write_status"), enif_make_int(env, status));
-		goto fail;
-	}
+		if ((ret = context_exec(job->ctx, in)) != OP_OK) {
+			res = enif_make_tuple2(env, priv->atom_error,
+				op_error(env, job->ctx->cairo, ret,
+				    enif_make_copy(env, in->op)));
+			goto done;
+		}
 
-	cairo_surface_destroy(sfc);
+		if ((in->handler->raster || job->pc % DRAW_CHUNK_OPS == 0) &&
+		    job->pc < job->run->n_instrs &&
+		    draw_timeslice_spent(env, &mark))
+			return enif_schedule_nif(env, "draw", 0,
+				draw_job_resume, argc, argv);
+	}
 
-	return enif_make_atom(env, "ok");
+	res = context_result(env, job->ctx, job->ctx);
 
-fail:
-	if (sfc != NULL)
-		cairo_surface_destroy(sfc);
-	return enif_make_tuple2(env, enif_make_atom(env, "error"), err);
+done:
+	/* free the surface now rather than whenever the GC gets to us */
+	context_free(job->ctx);
+	job->ctx = NULL;
+	return res;
 }
 
-static int
-load_cb(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
+/*
+ * Starts a draw that runs on normal schedulers, giving the scheduler back
+ * whenever its timeslice runs out. Either compiles argv[2] (when prog is
+ * NULL), a chunk of ops per slice, or runs the given compiled program.
+ * Copying the arguments into the job can't be split up, but its time is
+ * charged to the first slice before any ops are decoded.
+ */
+static ERL_NIF_TERM
+draw_yielding(ErlNifEnv *env, const ERL_NIF_TERM argv[], struct program *prog)
 {
-	return 0;
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct draw_job *job;
+	enum op_return ret;
+	ERL_NIF_TERM ops, bad_op, res;
+	ErlNifTime mark;
+
+	mark = enif_monotonic_time(ERL_NIF_USEC);
+	job = enif_alloc_resource(priv->draw_job_rsrc, sizeof(*job));
+	assert(job != NULL);
+	memset(job, 0, sizeof(*job));
+	job->env = enif_alloc_env();
+
+	job->image = enif_make_copy(job->env, argv[0]);
+	job->init_tags = enif_make_copy(job->env, argv[1]);
+
+	if (prog != NULL) {
+		enif_keep_resource(prog);
+		job->run = prog;
+		job->cur.done = 1;
+	} else {
+		ops = enif_make_copy(job->env, argv[2]);
+		bad_op = ops;
+		job->prog.env = job->env;
+		ret = program_compile_start(job->env, priv, ops, &job->prog,
+			&job->cur, &bad_op);
+		if (ret != OP_OK) {
+			res = enif_make_tuple2(env, priv->atom_error,
+				op_error(env, NULL, ret, enif_make_copy(env, bad_op)));
+			enif_release_resource(job);
+			return res;
+		}
+		job->run = &job->prog;
+	}
+
+	res = enif_make_resource(env, job);
+	enif_release_resource(job);
+	if (draw_timeslice_spent(env, &mark))
+		return enif_schedule_nif(env, "draw", 0, draw_job_resume, 1, &res);
+	return draw_job_resume(env, 1, &res);
+}
+
+/*
+ * Draws that draw_is_expensive says will take more than about a
+ * millisecond are moved off the calling scheduler: onto a dirty CPU
+ * scheduler, or into a draw that yields between timeslices if dirty
+ * schedulers aren't available or the application is configured with
+ * {scheduling, yield}.
+ */
+enum draw_route {
+	ROUTE_INLINE,
+	ROUTE_DIRTY,
+	ROUTE_YIELD
+};
+
+/* a bad record gives 0, and will be rejected by the draw itself, quickly */
+static int
+get_image_size(ErlNifEnv *env, const ERL_NIF_TERM image, int *w, int *h)
+{
+	const ERL_NIF_TERM *img_tuple;
+	int arity;
+
+	if (!enif_get_tuple(env, image, &arity, &img_tuple) || arity != 5)
+		return 0;
+	if (!enif_get_int(env, img_tuple[1], w) || !enif_get_int(env, img_tuple[2], h))
+		return 0;
+	return 1;
+}
+
+static enum draw_route
+draw_route(struct cairerl_priv *priv, int w, int h, unsigned int n_ops, unsigned int n_raster)
+{
+	if (!draw_is_expensive(w, h, n_ops, n_raster))
+		return ROUTE_INLINE;
+
+	if (priv->dirty_support && priv->scheduling == SCHED_DIRTY)
+		return ROUTE_DIRTY;
+	return ROUTE_YIELD;
+}
+
+static ERL_NIF_TERM
+do_draw(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct program prog;
+	struct arena arena;
+	enum op_return ret;
+	ERL_NIF_TERM bad_op = argv[2], res;
+
+	arena_init(&arena);
+	memset(&prog, 0, sizeof(prog));
+	prog.arena = &arena;
+	if ((ret = program_compile(env, priv, argv[2], &prog, &bad_op)) != OP_OK) {
+		arena_release(&arena);
+		return enif_make_tuple2(env, priv->atom_error,
+			op_error(env, NULL, ret, bad_op));
+	}
+
+	res = draw_program(env, priv, argv[0], argv[1], &prog);
+	program_clear(&prog);
+	arena_release(&arena);
+
+	return res;
+}
+
+/* draw(Pixels :: binary(), InitTags :: tags(), Ops :: [cairerl:op()]) -> {ok, tags(), binary()} | {error, atom()} */
+static ERL_NIF_TERM
+draw(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	unsigned int n_ops, n_raster;
+	int w, h;
+
+	/* the wrong kind of ops is rejected inline, whatever the route */
+	if (enif_is_binary(env, argv[2]) || !get_image_size(env, argv[0], &w, &h) ||
+	    !program_scan(env, priv, argv[2], w, h, &n_ops, &n_raster))
+		return do_draw(env, argc, argv);
+
+	switch (draw_route(priv, w, h, n_ops, n_raster)) {
+		case ROUTE_DIRTY:
+			return enif_schedule_nif(env, "draw", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+				do_draw, argc, argv);
+		case ROUTE_YIELD:
+			return draw_yielding(env, argv, NULL);
+		default:
+			return do_draw(env, argc, argv);
+	}
+}
+
+static ERL_NIF_TERM
+do_draw_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct program prog;
+	struct arena arena;
+	enum op_return ret;
+	ERL_NIF_TERM bad_op = argv[2], res;
+
+	arena_init(&arena);
+	memset(&prog, 0, sizeof(prog));
+	prog.arena = &arena;
+	if ((ret = program_compile_binary(env, priv, argv[2], &prog, &bad_op)) != OP_OK) {
+		arena_release(&arena);
+		return enif_make_tuple2(env, priv->atom_error,
+			op_error(env, NULL, ret, bad_op));
+	}
+
+	res = draw_program(env, priv, argv[0], argv[1], &prog);
+	program_clear(&prog);
+	arena_release(&arena);
+
+	return res;
+}
+
+/* draw_binary(Pixels :: binary(), InitTags :: tags(), Ops :: binary()) -> {ok, tags(), binary()} | {error, atom()} */
+static ERL_NIF_TERM
+draw_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	unsigned int n_ops, n_raster;
+	int w, h;
+
+	/* the wrong kind of ops is rejected inline, whatever the route */
+	if (!enif_is_binary(env, argv[2]) || !get_image_size(env, argv[0], &w, &h) ||
+	    !program_scan(env, priv, argv[2], w, h, &n_ops, &n_raster))
+		return do_draw_binary(env, argc, argv);
+
+	switch (draw_route(priv, w, h, n_ops, n_raster)) {
+		case ROUTE_DIRTY:
+			return enif_schedule_nif(env, "draw_binary", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+				do_draw_binary, argc, argv);
+		case ROUTE_YIELD:
+			return draw_yielding(env, argv, NULL);
+		default:
+			return do_draw_binary(env, argc, argv);
+	}
+}
+
+/* compile(Ops :: [cairerl:op()] | binary()) -> {ok, program()} | {error, term()} */
+static ERL_NIF_TERM
+compile(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct program *prog;
+	enum op_return ret;
+	ERL_NIF_TERM ops, bad_op, res;
+
+	prog = enif_alloc_resource(priv->program_rsrc, sizeof(*prog));
+	assert(prog != NULL);
+	memset(prog, 0, sizeof(*prog));
+
+	prog->env = enif_alloc_env();
+	ops = enif_make_copy(prog->env, argv[0]);
+	bad_op = ops;
+
+	if (enif_is_binary(env, argv[0]))
+		ret = program_compile_binary(prog->env, priv, ops, prog, &bad_op);
+	else
+		ret = program_compile(prog->env, priv, ops, prog, &bad_op);
+	if (ret != OP_OK) {
+		res = enif_make_tuple2(env, priv->atom_error,
+			op_error(env, NULL, ret, enif_make_copy(env, bad_op)));
+		enif_release_resource(prog);
+		return res;
+	}
+
+	res = enif_make_resource(env, prog);
+	enif_release_resource(prog);
+
+	return enif_make_tuple2(env, priv->atom_ok, res);
+}
+
+static ERL_NIF_TERM
+do_draw_compiled(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct program *prog;
+
+	if (!enif_get_resource(env, argv[2], priv->program_rsrc, (void **)&prog))
+		return enif_make_tuple2(env, priv->atom_error,
+			enif_make_atom(env, "bad_program"));
+
+	return draw_program(env, priv, argv[0], argv[1], prog);
+}
+
+/* draw_compiled(Pixels :: binary(), InitTags :: tags(), Program :: program()) -> {ok, tags(), binary()} | {error, atom()} */
+static ERL_NIF_TERM
+draw_compiled(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct program *prog;
+	int w, h;
+
+	if (!enif_get_resource(env, argv[2], priv->program_rsrc, (void **)&prog) ||
+	    !get_image_size(env, argv[0], &w, &h))
+		return do_draw_compiled(env, argc, argv);
+
+	switch (draw_route(priv, w, h, prog->n_instrs, prog->n_raster)) {
+		case ROUTE_DIRTY:
+			return enif_schedule_nif(env, "draw_compiled", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+				do_draw_compiled, argc, argv);
+		case ROUTE_YIELD:
+			return draw_yielding(env, argv, prog);
+		default:
+			return do_draw_compiled(env, argc, argv);
+	}
+}
+
+/*
+ * An async draw owns a process-independent env holding copies of all its
+ * arguments, so it can run on a pool thread and send the result back
+ * from there without touching the caller again.
+ */
+struct async_draw {
+	struct pool_job job;
+	struct cairerl_priv *priv;
+	ErlNifEnv *env;
+	ErlNifPid pid;
+	ERL_NIF_TERM ref;
+	ERL_NIF_TERM image;
+	ERL_NIF_TERM init_tags;
+	ERL_NIF_TERM ops;
+	struct program *prog;
+};
+
+static void
+async_draw_run(struct pool_job *job)
+{
+	struct async_draw *ad = (struct async_draw *)job;
+	struct cairerl_priv *priv = ad->priv;
+	struct program prog;
+	enum op_return ret;
+	ERL_NIF_TERM bad_op = ad->ops, res;
+
+	if (ad->prog != NULL) {
+		res = draw_program(ad->env, priv, ad->image, ad->init_tags, ad->prog);
+	} else {
+		memset(&prog, 0, sizeof(prog));
+		if (enif_is_binary(ad->env, ad->ops))
+			ret = program_compile_binary(ad->env, priv, ad->ops, &prog, &bad_op);
+		else
+			ret = program_compile(ad->env, priv, ad->ops, &prog, &bad_op);
+		if (ret == OP_OK)
+			res = draw_program(ad->env, priv, ad->image, ad->init_tags, &prog);
+		else
+			res = enif_make_tuple2(ad->env, priv->atom_error,
+				op_error(ad->env, NULL, ret, bad_op));
+		program_clear(&prog);
+	}
+
+	enif_send(NULL, &ad->pid, ad->env,
+		enif_make_tuple3(ad->env, priv->atom_cairerl_done, ad->ref, res));
+
+	if (ad->prog != NULL)
+		enif_release_resource(ad->prog);
+	enif_free_env(ad->env);
+	enif_free(ad);
+}
+
+/* draw_async(Ref :: term(), Pixels :: binary(), InitTags :: tags(), Ops :: [cairerl:op()] | binary() | program()) -> ok | {error, busy} */
+static ERL_NIF_TERM
+draw_async(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct async_draw *ad;
+	struct program *prog = NULL;
+
+	if (enif_get_resource(env, argv[3], priv->program_rsrc, (void **)&prog))
+		enif_keep_resource(prog);
+
+	ad = enif_alloc(sizeof(*ad));
+	assert(ad != NULL);
+	memset(ad, 0, sizeof(*ad));
+	ad->job.run = async_draw_run;
+	ad->priv = priv;
+	ad->prog = prog;
+	ad->env = enif_alloc_env();
+	enif_self(env, &ad->pid);
+	ad->ref = enif_make_copy(ad->env, argv[0]);
+	ad->image = enif_make_copy(ad->env, argv[1]);
+	ad->init_tags = enif_make_copy(ad->env, argv[2]);
+	if (prog == NULL)
+		ad->ops = enif_make_copy(ad->env, argv[3]);
+
+	if (!pool_push(&priv->pool, &ad->job)) {
+		if (prog != NULL)
+			enif_release_resource(prog);
+		enif_free_env(ad->env);
+		enif_free(ad);
+		return enif_make_tuple2(env, priv->atom_error,
+			enif_make_atom(env, "busy"));
+	}
+
+	return priv->atom_ok;
+}
+
+/*
+ * A batch of contexts rendered in parallel on the async pool. Each job
+ * only runs ops (no terms are touched off the calling thread); the caller
+ * takes the first job itself, runs any job the pool has no room for, and
+ * then waits for the rest. Setting up the contexts and building results
+ * both happen on the calling thread, before and after.
+ */
+struct render_batch;
+
+struct render_job {
+	struct pool_job job;
+	struct render_batch *batch;
+	const struct program *prog;
+	struct context *ctx;		/* NULL for a job that failed setup */
+	enum op_return ret;
+	int failed_at;
+};
+
+struct render_batch {
+	ErlNifMutex *lock;
+	ErlNifCond *cond;
+	int pending;
+};
+
+static void
+render_run(struct render_job *rj)
+{
+	const struct program *prog = rj->prog;
+	int i;
+
+	rj->ret = OP_OK;
+	if (rj->ctx == NULL)
+		return;
+	for (i = 0; i < prog->n_instrs; ++i) {
+		if ((rj->ret = context_exec(rj->ctx, &prog->instrs[i])) != OP_OK) {
+			rj->failed_at = i;
+			break;
+		}
+	}
+	cairo_surface_flush(rj->ctx->sfc);
+}
+
+static void
+render_job_run(struct pool_job *job)
+{
+	struct render_job *rj = (struct render_job *)job;
+	struct render_batch *batch = rj->batch;
+
+	render_run(rj);
+
+	enif_mutex_lock(batch->lock);
+	if (--batch->pending == 0)
+		enif_cond_signal(batch->cond);
+	enif_mutex_unlock(batch->lock);
+}
+
+static void
+render_batch_run(struct cairerl_priv *priv, struct render_job *jobs, int n_jobs)
+{
+	struct render_batch batch;
+	int i;
+
+	if (n_jobs < 1)
+		return;
+
+	batch.lock = enif_mutex_create("cairerl_batch_lock");
+	batch.cond = enif_cond_create("cairerl_batch_cond");
+	assert(batch.lock != NULL && batch.cond != NULL);
+	batch.pending = n_jobs - 1;
+
+	for (i = 1; i < n_jobs; ++i) {
+		jobs[i].job.run = render_job_run;
+		jobs[i].batch = &batch;
+		if (!pool_push(&priv->pool, &jobs[i].job))
+			render_job_run(&jobs[i].job);
+	}
+	render_run(&jobs[0]);
+
+	enif_mutex_lock(batch.lock);
+	while (batch.pending > 0)
+		enif_cond_wait(batch.cond, batch.lock);
+	enif_mutex_unlock(batch.lock);
+
+	enif_cond_destroy(batch.cond);
+	enif_mutex_destroy(batch.lock);
+}
+
+/* The error term for a job whose ops failed, made on the calling thread. */
+static ERL_NIF_TERM
+render_job_error(ErlNifEnv *env, const struct render_job *rj)
+{
+	const struct op_instr *in = &rj->prog->instrs[rj->failed_at];
+
+	/* compiled programs keep their op terms in their own env */
+	return op_error(env, rj->ctx->cairo, rj->ret,
+		(rj->prog->env != NULL) ? enif_make_copy(env, in->op) : in->op);
+}
+
+/*
+ * Tiled draws split the output into horizontal bands, each with its own
+ * context drawing through its own image surface over that band's rows of
+ * the shared pixel buffer. cairo surfaces (subsurfaces included) are not
+ * safe to draw on from several threads, so bands share memory but no
+ * cairo objects. Each band surface gets a device offset of minus its
+ * first row, so every band replays the full op list with exactly the
+ * coordinates, clipping and transforms of an untiled draw, and only
+ * touches its own rows. Tags are reported from the first band, which sees
+ * the same op results as any other.
+ */
+#define MAX_TILES	64
+
+struct draw_opts {
+	int n_tiles;
+	int damage;
+};
+
+/* A band's context: its own surface, cairo_t and tag slots over part of master's pixels. */
+static struct context *
+context_new_tile(struct context *master, const struct program *prog, int y, int h)
+{
+	struct context *ctx;
+	unsigned char *data;
+	size_t slots_size;
+	int stride;
+
+	/* the master context's extra slots hold only initial (double) tags */
+	slots_size = master->n_slots * sizeof(struct tag_slot) +
+		prog->n_text_exts * sizeof(cairo_text_extents_t) +
+		prog->n_font_exts * sizeof(cairo_font_extents_t);
+	ctx = enif_alloc(sizeof(*ctx) + slots_size);
+	assert(ctx != NULL);
+	memset(ctx, 0, sizeof(*ctx) + slots_size);
+	ctx->priv = master->priv;
+	ctx->fmt = master->fmt;
+	ctx->w = master->w;
+	ctx->h = master->h;
+	ctx->track_damage = master->track_damage;
+	ctx->slots = (struct tag_slot *)(ctx + 1);
+	ctx->text_exts = (cairo_text_extents_t *)(ctx->slots + master->n_slots);
+	ctx->font_exts = (cairo_font_extents_t *)(ctx->text_exts + prog->n_text_exts);
+	ctx->n_slots = master->n_slots;
+	memcpy(ctx->slots, master->slots, master->n_slots * sizeof(struct tag_slot));
+
+	/* shift the band back up so ops keep addressing whole-image coordinates */
+	data = cairo_image_surface_get_data(master->sfc);
+	stride = cairo_image_surface_get_stride(master->sfc);
+	ctx->sfc = cairo_image_surface_create_for_data(data + (size_t)y * stride,
+		master->fmt, master->w, h, stride);
+	cairo_surface_set_device_offset(ctx->sfc, 0, -y);
+	ctx->cairo = cairo_create(ctx->sfc);
+	if (cairo_surface_status(ctx->sfc) != CAIRO_STATUS_SUCCESS ||
+	    cairo_status(ctx->cairo) != CAIRO_STATUS_SUCCESS) {
+		context_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+static ERL_NIF_TERM
+draw_program_opts(ErlNifEnv *env, struct cairerl_priv *priv, const ERL_NIF_TERM image, const ERL_NIF_TERM init_tags, const struct program *prog, const struct draw_opts *opts)
+{
+	struct context *master;
+	struct render_job *tiles = NULL;
+	ERL_NIF_TERM err, ret;
+	int i, j, y, band, n_tiles;
+
+	if ((master = context_new(env, priv, image, init_tags, prog, &err)) == NULL)
+		return enif_make_tuple2(env, priv->atom_error, err);
+	master->track_damage = opts->damage;
+
+	n_tiles = opts->n_tiles;
+	if (n_tiles > master->h)
+		n_tiles = master->h;
+	if (n_tiles <= 1) {
+		/* nothing to split, run it like any other draw */
+		if (context_run(env, master, prog, &err))
+			ret = context_result(env, master, master);
+		else
+			ret = enif_make_tuple2(env, priv->atom_error, err);
+		context_free(master);
+		return ret;
+	}
+
+	tiles = enif_alloc(n_tiles * sizeof(*tiles));
+	assert(tiles != NULL);
+	memset(tiles, 0, n_tiles * sizeof(*tiles));
+
+	band = master->h / n_tiles;
+	for (i = 0, y = 0; i < n_tiles; ++i, y += band) {
+		tiles[i].prog = prog;
+		tiles[i].ctx = context_new_tile(master, prog, y,
+			(i == n_tiles - 1) ? master->h - y : band);
+		if (tiles[i].ctx == NULL) {
+			err = enif_make_atom(env, "bad_tile_surface");
+			goto fail;
+		}
+	}
+
+	/* everything is set up before the first band can start */
+	cairo_surface_flush(master->sfc);
+	render_batch_run(priv, tiles, n_tiles);
+
+	for (i = 0; i < n_tiles; ++i) {
+		if (tiles[i].ret != OP_OK) {
+			err = render_job_error(env, &tiles[i]);
+			goto fail;
+		}
+	}
+
+	/* each band only saw damage to its own rows */
+	for (i = 0; i < n_tiles; ++i) {
+		cairo_surface_flush(tiles[i].ctx->sfc);
+		for (j = 0; j < tiles[i].ctx->n_damage; ++j)
+			damage_add(master, &tiles[i].ctx->damage[j]);
+	}
+
+	cairo_surface_mark_dirty(master->sfc);
+	ret = context_result(env, master, tiles[0].ctx);
+	goto out;
+
+fail:
+	ret = enif_make_tuple2(env, priv->atom_error, err);
+
+out:
+	for (i = 0; i < n_tiles; ++i)
+		context_free(tiles[i].ctx);
+	enif_free(tiles);
+	context_free(master);
+	return ret;
+}
+
+/*
+ * Options for draw/4 and canvas_draw/4: {tiles, N} (draw/4 only) and
+ * damage. Returns 0 and sets *err for anything else.
+ */
+static int
+get_draw_opts(ErlNifEnv *env, struct cairerl_priv *priv, const ERL_NIF_TERM list, int allow_tiles, struct draw_opts *opts, ERL_NIF_TERM *err)
+{
+	const ERL_NIF_TERM *tuple;
+	ERL_NIF_TERM head, tail;
+	int arity;
+
+	opts->n_tiles = 1;
+	opts->damage = 0;
+
+	tail = list;
+	while (enif_get_list_cell(env, tail, &head, &tail)) {
+		if (enif_is_identical(head, priv->atom_damage)) {
+			opts->damage = 1;
+		} else if (allow_tiles &&
+		    enif_get_tuple(env, head, &arity, &tuple) && arity == 2 &&
+		    enif_is_identical(tuple[0], priv->atom_tiles) &&
+		    enif_get_int(env, tuple[1], &opts->n_tiles) &&
+		    opts->n_tiles >= 1 && opts->n_tiles <= MAX_TILES) {
+			/* ok */
+		} else {
+			*err = enif_make_tuple2(env, enif_make_atom(env, "bad_option"), head);
+			return 0;
+		}
+	}
+	if (!enif_is_empty_list(env, tail)) {
+		*err = enif_make_atom(env, "bad_options");
+		return 0;
+	}
+	return 1;
+}
+
+static ERL_NIF_TERM
+do_draw_tiled(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct program prog, *cprog;
+	struct draw_opts opts;
+	ERL_NIF_TERM bad_op = argv[2], res, err;
+	enum op_return ret;
+
+	if (!get_draw_opts(env, priv, argv[3], 1, &opts, &err))
+		return enif_make_tuple2(env, priv->atom_error, err);
+
+	if (enif_get_resource(env, argv[2], priv->program_rsrc, (void **)&cprog))
+		return draw_program_opts(env, priv, argv[0], argv[1], cprog, &opts);
+
+	memset(&prog, 0, sizeof(prog));
+	if (enif_is_binary(env, argv[2]))
+		ret = program_compile_binary(env, priv, argv[2], &prog, &bad_op);
+	else
+		ret = program_compile(env, priv, argv[2], &prog, &bad_op);
+	if (ret != OP_OK)
+		return enif_make_tuple2(env, priv->atom_error,
+			op_error(env, NULL, ret, bad_op));
+
+	res = draw_program_opts(env, priv, argv[0], argv[1], &prog, &opts);
+	program_clear(&prog);
+
+	return res;
+}
+
+/* draw(Pixels :: binary(), InitTags :: tags(), Ops :: [cairerl:op()] | binary() | program(), Opts :: [{tiles, integer()} | damage]) -> {ok, tags(), binary()} | {ok, tags(), binary(), [rect()]} | {error, atom()} */
+static ERL_NIF_TERM
+draw4(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	/* the caller blocks while its bands render, so keep it off normal schedulers */
+	if (priv->dirty_support)
+		return enif_schedule_nif(env, "draw", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_draw_tiled, argc, argv);
+
+	return do_draw_tiled(env, argc, argv);
+}
+
+static ERL_NIF_TERM
+do_draw_many(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct render_job *jobs;
+	struct program *progs, *cprog;
+	ERL_NIF_TERM *results;
+	ERL_NIF_TERM head, tail, bad_op, res;
+	const ERL_NIF_TERM *tuple;
+	enum op_return ret;
+	unsigned int n_jobs, i;
+	int arity;
+
+	if (!enif_get_list_length(env, argv[0], &n_jobs))
+		return enif_make_badarg(env);
+	if (n_jobs == 0)
+		return enif_make_list(env, 0);
+
+	jobs = enif_alloc(n_jobs * (sizeof(*jobs) + sizeof(*progs) + sizeof(*results)));
+	assert(jobs != NULL);
+	memset(jobs, 0, n_jobs * (sizeof(*jobs) + sizeof(*progs) + sizeof(*results)));
+	progs = (struct program *)(jobs + n_jobs);
+	results = (ERL_NIF_TERM *)(progs + n_jobs);
+
+	/* compile and set up every job here; a job that fails gets its error now */
+	tail = argv[0];
+	for (i = 0; enif_get_list_cell(env, tail, &head, &tail); ++i) {
+		if (!enif_get_tuple(env, head, &arity, &tuple) || arity != 3) {
+			results[i] = enif_make_tuple2(env, priv->atom_error,
+				enif_make_atom(env, "bad_job"));
+			continue;
+		}
+
+		if (enif_get_resource(env, tuple[2], priv->program_rsrc, (void **)&cprog)) {
+			jobs[i].prog = cprog;
+		} else {
+			bad_op = tuple[2];
+			if (enif_is_binary(env, tuple[2]))
+				ret = program_compile_binary(env, priv, tuple[2], &progs[i], &bad_op);
+			else
+				ret = program_compile(env, priv, tuple[2], &progs[i], &bad_op);
+			if (ret != OP_OK) {
+				results[i] = enif_make_tuple2(env, priv->atom_error,
+					op_error(env, NULL, ret, bad_op));
+				continue;
+			}
+			jobs[i].prog = &progs[i];
+		}
+
+		jobs[i].ctx = context_new(env, priv, tuple[0], tuple[1], jobs[i].prog, &res);
+		if (jobs[i].ctx == NULL)
+			results[i] = enif_make_tuple2(env, priv->atom_error, res);
+	}
+
+	render_batch_run(priv, jobs, n_jobs);
+
+	for (i = 0; i < n_jobs; ++i) {
+		if (jobs[i].ctx == NULL)
+			continue;
+		if (jobs[i].ret != OP_OK)
+			results[i] = enif_make_tuple2(env, priv->atom_error,
+				render_job_error(env, &jobs[i]));
+		else
+			results[i] = context_result(env, jobs[i].ctx, jobs[i].ctx);
+		context_free(jobs[i].ctx);
+	}
+
+	res = enif_make_list_from_array(env, results, n_jobs);
+
+	for (i = 0; i < n_jobs; ++i)
+		program_clear(&progs[i]);
+	enif_free(jobs);
+
+	return res;
+}
+
+/* draw_many(Jobs :: [{Pixels :: binary(), InitTags :: tags(), Ops :: [cairerl:op()] | binary() | program()}]) -> [{ok, tags(), binary()} | {error, atom()}] */
+static ERL_NIF_TERM
+draw_many(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	/* the caller blocks while its jobs render, so keep it off normal schedulers */
+	if (priv->dirty_support)
+		return enif_schedule_nif(env, "draw_many", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_draw_many, argc, argv);
+
+	return do_draw_many(env, argc, argv);
+}
+
+/*
+ * A canvas is a long-lived surface owned by a resource, drawn on in place
+ * so that incremental updates only pay for the ops they run. Its pixels
+ * only get copied out into a binary when a snapshot is asked for. Draws
+ * and snapshots of one canvas are serialised by its lock. A canvas_map
+ * canvas draws straight into a shared file mapping instead, for another
+ * process to pick frames up from without any copy at all.
+ */
+struct canvas {
+	ErlNifMutex *lock;
+	cairo_surface_t *sfc;
+	ERL_NIF_TERM fmt;
+	int w, h;
+	void *map;			/* non-NULL for canvas_map canvases */
+	size_t map_size;
+	struct fb_header *hdr;		/* non-NULL if the mapping has a header */
+};
+
+/*
+ * The optional header at the start of a canvas_map file, for the process
+ * on the other side. All fields are host-endian. The pixels start at
+ * data_offset, stride bytes per row, in cairo's layout for format (a
+ * cairo_format_t). seq is a seqlock: it is odd while a draw is writing
+ * pixels and goes up by two per draw, so a reader that sees the same even
+ * value before and after copying a frame got a whole one. frame counts
+ * completed draws.
+ */
+#define FB_MAGIC	"CRFB"
+#define FB_VERSION	1
+#define FB_HEADER_SIZE	64
+
+struct fb_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t format;
+	uint32_t data_offset;
+	uint32_t pad;
+	uint64_t seq;
+	uint64_t frame;
+};
+
+static void
+canvas_frame_begin(struct canvas *cv)
+{
+	if (cv->hdr == NULL)
+		return;
+	__atomic_store_n(&cv->hdr->seq, cv->hdr->seq + 1, __ATOMIC_RELAXED);
+	/* the odd seq must be visible before any of the pixel writes */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+canvas_frame_end(struct canvas *cv)
+{
+	cairo_surface_flush(cv->sfc);
+	if (cv->hdr == NULL)
+		return;
+	__atomic_store_n(&cv->hdr->frame, cv->hdr->frame + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&cv->hdr->seq, cv->hdr->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void
+canvas_dtor(ErlNifEnv *env, void *obj)
+{
+	struct canvas *cv = obj;
+
+	if (cv->sfc != NULL)
+		cairo_surface_destroy(cv->sfc);
+	if (cv->map != NULL)
+		munmap(cv->map, cv->map_size);
+	if (cv->lock != NULL)
+		enif_mutex_destroy(cv->lock);
+}
+
+/* canvas_new(W :: integer(), H :: integer(), Format :: pixel_format()) -> {ok, canvas()} | {error, term()} */
+static ERL_NIF_TERM
+canvas_new(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct canvas *cv;
+	cairo_format_t fmt;
+	ERL_NIF_TERM err, res;
+	int w, h, status;
+
+	if (!enif_get_int(env, argv[0], &w)) {
+		err = enif_make_atom(env, "bad_width");
+		goto fail;
+	}
+	if (!enif_get_int(env, argv[1], &h)) {
+		err = enif_make_atom(env, "bad_height");
+		goto fail;
+	}
+	if (!check_dimensions(env, w, h, &err))
+		goto fail;
+	if (!get_draw_format(priv, argv[2], &fmt)) {
+		err = enif_make_atom(env, "bad_pixel_format");
+		goto fail;
+	}
+
+	cv = enif_alloc_resource(priv->canvas_rsrc, sizeof(*cv));
+	assert(cv != NULL);
+	memset(cv, 0, sizeof(*cv));
+	cv->fmt = argv[2];
+	cv->w = w;
+	cv->h = h;
+	cv->lock = enif_mutex_create("cairerl_canvas_lock");
+	assert(cv->lock != NULL);
+
+	/* cairo clears new image surfaces for us */
+	cv->sfc = cairo_image_surface_create(fmt, w, h);
+	if ((status = cairo_surface_status(cv->sfc)) != CAIRO_STATUS_SUCCESS) {
+		enif_release_resource(cv);
+		err = enif_make_tuple2(env, enif_make_atom(env, "bad_surface_status"), enif_make_int(env, status));
+		goto fail;
+	}
+
+	res = enif_make_resource(env, cv);
+	enif_release_resource(cv);
+	return enif_make_tuple2(env, priv->atom_ok, res);
+
+fail:
+	return enif_make_tuple2(env, priv->atom_error, err);
+}
+
+static ERL_NIF_TERM
+do_canvas_map(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct canvas *cv = NULL;
+	struct fb_header *hdr;
+	struct stat st;
+	cairo_format_t fmt;
+	ERL_NIF_TERM head, tail, err, res;
+	char *path = NULL;
+	size_t offset, size;
+	void *map;
+	int w, h, stride, status, fd = -1, header = 0;
+
+	if (!get_path(env, argv[0], &path)) {
+		err = enif_make_atom(env, "bad_filename");
+		goto fail;
+	}
+	if (!enif_get_int(env, argv[1], &w)) {
+		err = enif_make_atom(env, "bad_width");
+		goto fail;
+	}
+	if (!enif_get_int(env, argv[2], &h)) {
+		err = enif_make_atom(env, "bad_height");
+		goto fail;
+	}
+	if (!check_dimensions(env, w, h, &err))
+		goto fail;
+	if (!get_draw_format(priv, argv[3], &fmt)) {
+		err = enif_make_atom(env, "bad_pixel_format");
+		goto fail;
+	}
+	tail = argv[4];
+	while (enif_get_list_cell(env, tail, &head, &tail)) {
+		if (enif_is_identical(head, priv->atom_header)) {
+			header = 1;
+		} else {
+			err = enif_make_tuple2(env, enif_make_atom(env, "bad_option"), head);
+			goto fail;
+		}
+	}
+	if (!enif_is_empty_list(env, tail)) {
+		err = enif_make_atom(env, "bad_options");
+		goto fail;
+	}
+
+	stride = cairo_format_stride_for_width(fmt, w);
+	offset = header ? FB_HEADER_SIZE : 0;
+	size = offset + (size_t)h * stride;
+
+	/* a file that is already big enough keeps its size and contents */
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 ||
+	    fstat(fd, &st) < 0 ||
+	    ((size_t)st.st_size < size && ftruncate(fd, size) < 0)) {
+		err = enif_make_tuple2(env, enif_make_atom(env, "file_error"),
+			enif_make_int(env, errno));
+		goto fail;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		err = enif_make_tuple2(env, enif_make_atom(env, "mmap_error"),
+			enif_make_int(env, errno));
+		goto fail;
+	}
+	close(fd);
+	fd = -1;
+	enif_free(path);
+	path = NULL;
+
+	cv = enif_alloc_resource(priv->canvas_rsrc, sizeof(*cv));
+	assert(cv != NULL);
+	memset(cv, 0, sizeof(*cv));
+	cv->fmt = argv[3];
+	cv->w = w;
+	cv->h = h;
+	cv->map = map;
+	cv->map_size = size;
+	cv->lock = enif_mutex_create("cairerl_canvas_lock");
+	assert(cv->lock != NULL);
+
+	if (header) {
+		hdr = map;
+		/* a restarted writer carries on the frame count of a matching file */
+		if (memcmp(hdr->magic, FB_MAGIC, 4) != 0 || hdr->version != FB_VERSION ||
+		    hdr->width != (uint32_t)w || hdr->height != (uint32_t)h ||
+		    hdr->stride != (uint32_t)stride || hdr->format != (uint32_t)fmt) {
+			memset(hdr, 0, FB_HEADER_SIZE);
+			hdr->version = FB_VERSION;
+			hdr->width = w;
+			hdr->height = h;
+			hdr->stride = stride;
+			hdr->format = fmt;
+			hdr->data_offset = FB_HEADER_SIZE;
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			memcpy(hdr->magic, FB_MAGIC, 4);
+		}
+		if (hdr->seq & 1)
+			__atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELEASE);
+		cv->hdr = hdr;
+	}
+
+	cv->sfc = cairo_image_surface_create_for_data((unsigned char *)map + offset,
+		fmt, w, h, stride);
+	if ((status = cairo_surface_status(cv->sfc)) != CAIRO_STATUS_SUCCESS) {
+		enif_release_resource(cv);
+		err = enif_make_tuple2(env, enif_make_atom(env, "bad_surface_status"), enif_make_int(env, status));
+		goto fail;
+	}
+
+	res = enif_make_resource(env, cv);
+	enif_release_resource(cv);
+	return enif_make_tuple2(env, priv->atom_ok, res);
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	if (path != NULL)
+		enif_free(path);
+	return enif_make_tuple2(env, priv->atom_error, err);
+}
+
+/* canvas_map(Path, W :: integer(), H :: integer(), Format :: pixel_format(), Opts :: [header]) -> {ok, canvas()} | {error, term()} */
+static ERL_NIF_TERM
+canvas_map(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	/* open and ftruncate can block on a slow filesystem */
+	if (priv->dirty_support)
+		return enif_schedule_nif(env, "canvas_map", ERL_NIF_DIRTY_JOB_IO_BOUND,
+			do_canvas_map, argc, argv);
+
+	return do_canvas_map(env, argc, argv);
+}
+
+/*
+ * Takes a canvas lock without parking a normal scheduler behind another
+ * caller. Returns 0 if the lock is held elsewhere and the call should be
+ * rescheduled on a dirty scheduler, where it is then waited for.
+ */
+static int
+canvas_lock(struct cairerl_priv *priv, struct canvas *cv)
+{
+	if (enif_mutex_trylock(cv->lock) == 0)
+		return 1;
+	if (priv->dirty_support && enif_thread_type() == ERL_NIF_THR_NORMAL_SCHEDULER)
+		return 0;
+	enif_mutex_lock(cv->lock);
+	return 1;
+}
+
+static ERL_NIF_TERM
+do_canvas_draw(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct canvas *cv;
+	struct program prog, *run;
+	struct arena arena;
+	struct context *ctx = NULL;
+	struct draw_opts opts;
+	enum op_return ret;
+	ERL_NIF_TERM bad_op = argv[2], err, res, tags;
+	int i, in_frame = 0;
+
+	if (!enif_get_resource(env, argv[0], priv->canvas_rsrc, (void **)&cv))
+		return enif_make_tuple2(env, priv->atom_error,
+			enif_make_atom(env, "bad_canvas"));
+	opts.damage = 0;
+	if (argc > 3 && !get_draw_opts(env, priv, argv[3], 0, &opts, &err))
+		return enif_make_tuple2(env, priv->atom_error, err);
+
+	arena_init(&arena);
+	memset(&prog, 0, sizeof(prog));
+	prog.arena = &arena;
+	if (enif_get_resource(env, argv[2], priv->program_rsrc, (void **)&run)) {
+		/* compiled program, nothing to do */
+	} else {
+		if (enif_is_binary(env, argv[2]))
+			ret = program_compile_binary(env, priv, argv[2], &prog, &bad_op);
+		else
+			ret = program_compile(env, priv, argv[2], &prog, &bad_op);
+		if (ret != OP_OK) {
+			arena_release(&arena);
+			return enif_make_tuple2(env, priv->atom_error,
+				op_error(env, NULL, ret, bad_op));
+		}
+		run = &prog;
+	}
+
+	if (!canvas_lock(priv, cv)) {
+		program_clear(&prog);
+		arena_release(&arena);
+		return enif_schedule_nif(env, "canvas_draw", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_canvas_draw, argc, argv);
+	}
+
+	if ((ctx = context_alloc(env, priv, argv[1], run, &err)) == NULL)
+		goto fail;
+	ctx->fmt = cv->fmt;
+	ctx->w = cv->w;
+	ctx->h = cv->h;
+	ctx->sfc = cairo_surface_reference(cv->sfc);
+	ctx->track_damage = opts.damage;
+	if (!context_attach(env, ctx, &err))
+		goto fail;
+
+	/* a failing op leaves whatever the ops before it drew */
+	canvas_frame_begin(cv);
+	in_frame = 1;
+	for (i = 0; i < run->n_instrs; ++i) {
+		const struct op_instr *in = &run->instrs[i];
+
+		if ((ret = context_exec(ctx, in)) != OP_OK) {
+			err = op_error(env, ctx->cairo, ret, (run->env != NULL) ?
+				enif_make_copy(env, in->op) : in->op);
+			goto fail;
+		}
+	}
+
+	if (!context_tags(env, ctx, &tags, &err))
+		goto fail;
+	if (ctx->track_damage)
+		res = enif_make_tuple3(env, priv->atom_ok, tags,
+			context_damage(env, ctx));
+	else
+		res = enif_make_tuple2(env, priv->atom_ok, tags);
+	goto out;
+
+fail:
+	res = enif_make_tuple2(env, priv->atom_error, err);
+
+out:
+	context_free(ctx);
+	if (in_frame)
+		canvas_frame_end(cv);
+	enif_mutex_unlock(cv->lock);
+	program_clear(&prog);
+	arena_release(&arena);
+	return res;
+}
+
+/*
+ * canvas_draw(Canvas :: canvas(), InitTags :: tags(), Ops :: [cairerl:op()] | binary() | program()) -> {ok, tags()} | {error, term()}
+ * canvas_draw(Canvas, InitTags, Ops, [damage]) -> {ok, tags(), [rect()]} | {error, term()}
+ */
+static ERL_NIF_TERM
+canvas_draw(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct canvas *cv;
+	struct program *prog;
+	unsigned int n_ops, n_raster;
+
+	if (!enif_get_resource(env, argv[0], priv->canvas_rsrc, (void **)&cv))
+		return do_canvas_draw(env, argc, argv);
+
+	if (enif_get_resource(env, argv[2], priv->program_rsrc, (void **)&prog)) {
+		n_ops = prog->n_instrs;
+		n_raster = prog->n_raster;
+	} else if (!program_scan(env, priv, argv[2], cv->w, cv->h, &n_ops, &n_raster)) {
+		return do_canvas_draw(env, argc, argv);
+	}
+
+	if (priv->dirty_support && draw_is_expensive(cv->w, cv->h, n_ops, n_raster))
+		return enif_schedule_nif(env, "canvas_draw", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_canvas_draw, argc, argv);
+
+	return do_canvas_draw(env, argc, argv);
+}
+
+static ERL_NIF_TERM
+do_canvas_snapshot(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct canvas *cv;
+	ErlNifBinary img;
+	ERL_NIF_TERM out_tuple[5];
+	size_t size;
+
+	if (!enif_get_resource(env, argv[0], priv->canvas_rsrc, (void **)&cv))
+		return enif_make_tuple2(env, priv->atom_error,
+			enif_make_atom(env, "bad_canvas"));
+
+	/* the surface never changes size, so the copy can be allocated unlocked */
+	size = (size_t)cv->h * cairo_image_surface_get_stride(cv->sfc);
+	if (!enif_alloc_binary(size, &img))
+		return enif_make_tuple2(env, priv->atom_error,
+			enif_make_atom(env, "no_memory"));
+
+	if (!canvas_lock(priv, cv)) {
+		enif_release_binary(&img);
+		return enif_schedule_nif(env, "canvas_snapshot", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_canvas_snapshot, argc, argv);
+	}
+	cairo_surface_flush(cv->sfc);
+	memcpy(img.data, cairo_image_surface_get_data(cv->sfc), size);
+	enif_mutex_unlock(cv->lock);
+
+	out_tuple[0] = priv->atom_cairo_image;
+	out_tuple[1] = enif_make_int(env, cv->w);
+	out_tuple[2] = enif_make_int(env, cv->h);
+	out_tuple[3] = cv->fmt;
+	out_tuple[4] = enif_make_binary(env, &img);
+
+	return enif_make_tuple2(env, priv->atom_ok,
+		enif_make_tuple_from_array(env, out_tuple, 5));
+}
+
+/* canvases above this many bytes are copied on a dirty scheduler */
+#define SNAPSHOT_INLINE_BYTES	(512 * 1024)
+
+/* canvas_snapshot(Canvas :: canvas()) -> {ok, image()} | {error, term()} */
+static ERL_NIF_TERM
+canvas_snapshot(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct canvas *cv;
+
+	if (priv->dirty_support &&
+	    enif_get_resource(env, argv[0], priv->canvas_rsrc, (void **)&cv) &&
+	    (size_t)cv->h * cairo_image_surface_get_stride(cv->sfc) > SNAPSHOT_INLINE_BYTES)
+		return enif_schedule_nif(env, "canvas_snapshot", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_canvas_snapshot, argc, argv);
+
+	return do_canvas_snapshot(env, argc, argv);
+}
+
+/*
+ * A recording is a program run once against a cairo recording surface.
+ * Decoding, tag evaluation and path building happen then; each replay
+ * only rasterises the recorded commands into a target under a new
+ * transform. cairo recording surfaces keep internal caches when used as
+ * a source, so replays of one recording take its lock.
+ */
+struct recording {
+	ErlNifMutex *lock;
+	cairo_surface_t *sfc;
+	unsigned int n_ops, n_raster;
+};
+
+static void
+recording_dtor(ErlNifEnv *env, void *obj)
+{
+	struct recording *rec = obj;
+
+	if (rec->sfc != NULL)
+		cairo_surface_destroy(rec->sfc);
+	if (rec->lock != NULL)
+		enif_mutex_destroy(rec->lock);
+}
+
+static ERL_NIF_TERM
+do_record(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct recording *rec;
+	struct program prog, *run;
+	struct arena arena;
+	struct context *ctx = NULL;
+	enum op_return ret;
+	ERL_NIF_TERM bad_op = argv[1], err, res, tags;
+
+	arena_init(&arena);
+	memset(&prog, 0, sizeof(prog));
+	prog.arena = &arena;
+	if (enif_get_resource(env, argv[1], priv->program_rsrc, (void **)&run)) {
+		/* compiled program, nothing to do */
+	} else {
+		if (enif_is_binary(env, argv[1]))
+			ret = program_compile_binary(env, priv, argv[1], &prog, &bad_op);
+		else
+			ret = program_compile(env, priv, argv[1], &prog, &bad_op);
+		if (ret != OP_OK) {
+			arena_release(&arena);
+			return enif_make_tuple2(env, priv->atom_error,
+				op_error(env, NULL, ret, bad_op));
+		}
+		run = &prog;
+	}
+
+	if ((ctx = context_alloc(env, priv, argv[0], run, &err)) == NULL)
+		goto fail;
+	/* unbounded, so replays at any scale lose nothing to clipping */
+	ctx->sfc = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, NULL);
+	if (!context_attach(env, ctx, &err))
+		goto fail;
+	if (!context_run(env, ctx, run, &err))
+		goto fail;
+	if (!context_tags(env, ctx, &tags, &err))
+		goto fail;
+
+	rec = enif_alloc_resource(priv->recording_rsrc, sizeof(*rec));
+	assert(rec != NULL);
+	memset(rec, 0, sizeof(*rec));
+	rec->lock = enif_mutex_create("cairerl_recording_lock");
+	assert(rec->lock != NULL);
+	rec->sfc = cairo_surface_reference(ctx->sfc);
+	rec->n_ops = run->n_instrs;
+	rec->n_raster = run->n_raster;
+	res = enif_make_tuple3(env, priv->atom_ok, tags, enif_make_resource(env, rec));
+	enif_release_resource(rec);
+	goto out;
+
+fail:
+	res = enif_make_tuple2(env, priv->atom_error, err);
+
+out:
+	context_free(ctx);
+	program_clear(&prog);
+	arena_release(&arena);
+	return res;
+}
+
+/* record(InitTags :: tags(), Ops :: [cairerl:op()] | binary() | program()) -> {ok, tags(), recording()} | {error, term()} */
+static ERL_NIF_TERM
+record(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct program *prog;
+	unsigned int n_ops, n_raster;
+
+	if (enif_get_resource(env, argv[1], priv->program_rsrc, (void **)&prog)) {
+		n_ops = prog->n_instrs;
+		n_raster = prog->n_raster;
+	} else if (!program_scan(env, priv, argv[1], 1, 1, &n_ops, &n_raster)) {
+		return do_record(env, argc, argv);
+	}
+
+	/* nothing is rasterised yet, so cost it as a 1x1 surface */
+	if (priv->dirty_support && draw_is_expensive(1, 1, n_ops, n_raster))
+		return enif_schedule_nif(env, "record", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_record, argc, argv);
+
+	return do_record(env, argc, argv);
+}
+
+/* {XX, YX, XY, YY, X0, Y0}, in cairo_matrix_t order */
+static int
+get_matrix(ErlNifEnv *env, const ERL_NIF_TERM term, cairo_matrix_t *m)
+{
+	const ERL_NIF_TERM *tuple;
+	int arity;
+
+	if (!enif_get_tuple(env, term, &arity, &tuple) || arity != 6)
+		return 0;
+	return enif_get_double(env, tuple[0], &m->xx) &&
+		enif_get_double(env, tuple[1], &m->yx) &&
+		enif_get_double(env, tuple[2], &m->xy) &&
+		enif_get_double(env, tuple[3], &m->yy) &&
+		enif_get_double(env, tuple[4], &m->x0) &&
+		enif_get_double(env, tuple[5], &m->y0);
+}
+
+static ERL_NIF_TERM
+do_replay(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct recording *rec;
+	struct program prog;
+	struct context *ctx = NULL;
+	cairo_matrix_t m;
+	ERL_NIF_TERM err, res, out_tuple[5];
+	int status;
+
+	if (!enif_get_resource(env, argv[0], priv->recording_rsrc, (void **)&rec))
+		return enif_make_tuple2(env, priv->atom_error,
+			enif_make_atom(env, "bad_recording"));
+	if (!get_matrix(env, argv[2], &m))
+		return enif_make_tuple2(env, priv->atom_error,
+			enif_make_atom(env, "bad_matrix"));
+
+	/* an empty program: all the ops were run when the recording was made */
+	memset(&prog, 0, sizeof(prog));
+	if ((ctx = context_new(env, priv, argv[1], enif_make_list(env, 0), &prog, &err)) == NULL)
+		goto fail;
+
+	cairo_set_matrix(ctx->cairo, &m);
+	enif_mutex_lock(rec->lock);
+	cairo_set_source_surface(ctx->cairo, rec->sfc, 0, 0);
+	cairo_paint(ctx->cairo);
+	/* let go of the recording before anyone else can replay it */
+	cairo_set_source_rgb(ctx->cairo, 0, 0, 0);
+	enif_mutex_unlock(rec->lock);
+	if ((status = cairo_status(ctx->cairo)) != CAIRO_STATUS_SUCCESS) {
+		err = enif_make_tuple2(env, enif_make_atom(env, "bad_cairo_status"), enif_make_int(env, status));
+		goto fail;
+	}
+	cairo_surface_flush(ctx->sfc);
+
+	out_tuple[0] = priv->atom_cairo_image;
+	out_tuple[1] = enif_make_int(env, ctx->w);
+	out_tuple[2] = enif_make_int(env, ctx->h);
+	out_tuple[3] = ctx->fmt;
+	out_tuple[4] = pixbuf_make_binary(env, priv, ctx->buf);
+	ctx->buf = NULL;
+	res = enif_make_tuple2(env, priv->atom_ok,
+		enif_make_tuple_from_array(env, out_tuple, 5));
+	goto out;
+
+fail:
+	res = enif_make_tuple2(env, priv->atom_error, err);
+
+out:
+	context_free(ctx);
+	return res;
+}
+
+/* replay(Recording :: recording(), Image :: image(), Matrix :: matrix()) -> {ok, image()} | {error, term()} */
+static ERL_NIF_TERM
+replay(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct recording *rec;
+	const ERL_NIF_TERM *img_tuple;
+	int arity, w, h;
+
+	if (priv->dirty_support &&
+	    enif_get_resource(env, argv[0], priv->recording_rsrc, (void **)&rec) &&
+	    enif_get_tuple(env, argv[1], &arity, &img_tuple) && arity == 5 &&
+	    enif_get_int(env, img_tuple[1], &w) && enif_get_int(env, img_tuple[2], &h) &&
+	    draw_is_expensive(w, h, 0, rec->n_raster))
+		return enif_schedule_nif(env, "replay", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_replay, argc, argv);
+
+	return do_replay(env, argc, argv);
+}
+
+static void
+program_dtor(ErlNifEnv *env, void *obj)
+{
+	struct program *prog = obj;
+
+	program_clear(prog);
+	if (prog->env != NULL)
+		enif_free_env(prog->env);
+}
+
+/*
+ * Turns a surface fresh from a PNG loader into {ok, Image}, or an error
+ * if loading failed. Takes over the caller's reference to sfc either way.
+ */
+static ERL_NIF_TERM
+png_surface_result(ErlNifEnv *env, struct cairerl_priv *priv, cairo_surface_t *sfc)
+{
+	cairo_format_t fmt;
+	cairo_status_t status;
+	ERL_NIF_TERM err;
+	int w, h, stride;
+	ERL_NIF_TERM out_tuple[5];
+
+	if ((status = cairo_surface_status(sfc)) != CAIRO_STATUS_SUCCESS) {
+		err = enif_make_tuple2(env, enif_make_atom(env, "bad_surface_status"), enif_make_int(env, status));
+		goto fail;
+	}
+
+	fmt = cairo_image_surface_get_format(sfc);
+	w = cairo_image_surface_get_width(sfc);
+	h = cairo_image_surface_get_height(sfc);
+	stride = cairo_image_surface_get_stride(sfc);
+	assert(stride == cairo_format_stride_for_width(fmt, w));
+
+	out_tuple[0] = priv->atom_cairo_image;
+	out_tuple[1] = enif_make_int(env, w);
+	out_tuple[2] = enif_make_int(env, h);
+	switch (fmt) {
+		case CAIRO_FORMAT_RGB24:
+			out_tuple[3] = priv->atom_rgb24;
+			break;
+		case CAIRO_FORMAT_ARGB32:
+			out_tuple[3] = priv->atom_argb32;
+			break;
+		case CAIRO_FORMAT_RGB30:
+			out_tuple[3] = priv->atom_rgb30;
+			break;
+		case CAIRO_FORMAT_RGB16_565:
+			out_tuple[3] = priv->atom_rgb16_565;
+			break;
+		default:
+			err = enif_make_atom(env, "invalid_format");
+			goto fail;
+	}
+	/* the pixels stay in the surface, which the binary now keeps alive */
+	out_tuple[4] = make_surface_binary(env, priv, sfc);
+	cairo_surface_destroy(sfc);
+
+	return enif_make_tuple2(env,
+		priv->atom_ok,
+		enif_make_tuple_from_array(env, out_tuple, 5));
+
+fail:
+	cairo_surface_destroy(sfc);
+	return enif_make_tuple2(env, priv->atom_error, err);
+}
+
+static ERL_NIF_TERM
+do_png_read(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	char *path;
+	cairo_surface_t *sfc;
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	/* get the filename to read from */
+	if (!get_path(env, argv[0], &path)) {
+		return enif_make_tuple2(env, priv->atom_error,
+			enif_make_atom(env, "bad_filename"));
+	}
+
+	sfc = cairo_image_surface_create_from_png(path);
+	enif_free(path);
+
+	return png_surface_result(env, priv, sfc);
+}
+
+/* png_read(Filename :: binary() | iolist()) -> {ok, image()} | {error, term()} */
+static ERL_NIF_TERM
+png_read(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	/* a slow disk or NFS mount must not hold up a normal scheduler */
+	if (priv->dirty_support)
+		return enif_schedule_nif(env, "png_read", ERL_NIF_DIRTY_JOB_IO_BOUND,
+			do_png_read, argc, argv);
+
+	return do_png_read(env, argc, argv);
+}
+
+/* Feeds the cairo PNG stream reader straight out of a binary. */
+struct png_in {
+	const unsigned char *p;
+	size_t left;
+};
+
+static cairo_status_t
+png_in_read(void *closure, unsigned char *data, unsigned int length)
+{
+	struct png_in *pi = closure;
+
+	if (length > pi->left)
+		return CAIRO_STATUS_READ_ERROR;
+	memcpy(data, pi->p, length);
+	pi->p += length;
+	pi->left -= length;
+
+	return CAIRO_STATUS_SUCCESS;
+}
+
+static ERL_NIF_TERM
+do_png_decode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	ErlNifBinary png;
+	struct png_in pi;
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	if (!enif_inspect_binary(env, argv[0], &png)) {
+		if (!enif_inspect_iolist_as_binary(env, argv[0], &png)) {
+			return enif_make_tuple2(env, priv->atom_error,
+				enif_make_atom(env, "bad_png_data"));
+		}
+	}
+
+	pi.p = png.data;
+	pi.left = png.size;
+	return png_surface_result(env, priv,
+		cairo_image_surface_create_from_png_stream(png_in_read, &pi));
+}
+
+/* png_decode(Png :: binary() | iolist()) -> {ok, image()} | {error, term()} */
+static ERL_NIF_TERM
+png_decode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	/* inflating and unfiltering a big image takes far too long for a normal scheduler */
+	if (priv->dirty_support)
+		return enif_schedule_nif(env, "png_decode", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_png_decode, argc, argv);
+
+	return do_png_decode(env, argc, argv);
+}
+
+static ERL_NIF_TERM
+do_png_write(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	char *path = NULL;
+	cairo_status_t status;
+	cairo_surface_t *sfc = NULL;
+	ERL_NIF_TERM err;
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	/* get the filename to write to */
+	if (!get_path(env, argv[1], &path)) {
+		err = enif_make_atom(env, "bad_filename");
+		goto fail;
+	}
+
+	if (!create_surface_from_image(env, priv, argv[0], &sfc, &err))
+		goto fail;
+
+	if ((status = cairo_surface_write_to_png(sfc, path)) != CAIRO_STATUS_SUCCESS) {
+		err = enif_make_tuple2(env, enif_make_atom(env, "bad_write_status"), enif_make_int(env, status));
+		goto fail;
+	}
+
+	cairo_surface_destroy(sfc);
+	enif_free(path);
+
+	return priv->atom_ok;
+
+fail:
+	if (sfc != NULL)
+		cairo_surface_destroy(sfc);
+	if (path != NULL)
+		enif_free(path);
+	return enif_make_tuple2(env, priv->atom_error, err);
+}
+
+/* png_write(Image :: image(), Filename :: binary() | iolist()) -> ok | {error, term()} */
+static ERL_NIF_TERM
+png_write(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	if (priv->dirty_support)
+		return enif_schedule_nif(env, "png_write", ERL_NIF_DIRTY_JOB_IO_BOUND,
+			do_png_write, argc, argv);
+
+	return do_png_write(env, argc, argv);
+}
+
+static cairo_status_t
+png_fd_write(void *closure, const unsigned char *data, unsigned int length)
+{
+	int fd = *(int *)closure;
+	ssize_t n;
+
+	while (length > 0) {
+		if ((n = write(fd, data, length)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return CAIRO_STATUS_WRITE_ERROR;
+		}
+		data += n;
+		length -= n;
+	}
+
+	return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * An async PNG write runs on the render pool, like draw_async, and
+ * reports back with a message. The destination is either a path (owned
+ * here) or a file descriptor (owned by the caller and left open).
+ */
+struct async_png {
+	struct pool_job job;
+	struct cairerl_priv *priv;
+	ErlNifEnv *env;
+	ErlNifPid pid;
+	ERL_NIF_TERM ref;
+	ERL_NIF_TERM image;
+	char *path;
+	int fd;
+};
+
+static void
+async_png_run(struct pool_job *job)
+{
+	struct async_png *ap = (struct async_png *)job;
+	struct cairerl_priv *priv = ap->priv;
+	cairo_surface_t *sfc = NULL;
+	cairo_status_t status;
+	ERL_NIF_TERM res, err;
+
+	if (!create_surface_from_image(ap->env, priv, ap->image, &sfc, &err)) {
+		res = enif_make_tuple2(ap->env, priv->atom_error, err);
+		goto out;
+	}
+
+	if (ap->path != NULL)
+		status = cairo_surface_write_to_png(sfc, ap->path);
+	else
+		status = cairo_surface_write_to_png_stream(sfc, png_fd_write, &ap->fd);
+	cairo_surface_destroy(sfc);
+
+	if (status == CAIRO_STATUS_SUCCESS)
+		res = priv->atom_ok;
+	else
+		res = enif_make_tuple2(ap->env, priv->atom_error,
+			enif_make_tuple2(ap->env, enif_make_atom(ap->env, "bad_write_status"),
+				enif_make_int(ap->env, status)));
+
+out:
+	enif_send(NULL, &ap->pid, ap->env,
+		enif_make_tuple3(ap->env, priv->atom_cairerl_done, ap->ref, res));
+
+	if (ap->path != NULL)
+		enif_free(ap->path);
+	enif_free_env(ap->env);
+	enif_free(ap);
+}
+
+/* png_write_async(Ref :: term(), Image :: image(), Dest :: binary() | iolist() | {fd, integer()}) -> ok | {error, term()} */
+static ERL_NIF_TERM
+png_write_async(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	struct async_png *ap;
+	const ERL_NIF_TERM *dest;
+	char *path = NULL;
+	int arity, fd = -1;
+
+	if (enif_get_tuple(env, argv[2], &arity, &dest) && arity == 2 &&
+	    enif_is_identical(dest[0], priv->atom_fd)) {
+		if (!enif_get_int(env, dest[1], &fd) || fd < 0)
+			return enif_make_tuple2(env, priv->atom_error,
+				enif_make_atom(env, "bad_fd"));
+	} else if (!get_path(env, argv[2], &path)) {
+		return enif_make_tuple2(env, priv->atom_error,
+			enif_make_atom(env, "bad_filename"));
+	}
+
+	ap = enif_alloc(sizeof(*ap));
+	assert(ap != NULL);
+	memset(ap, 0, sizeof(*ap));
+	ap->job.run = async_png_run;
+	ap->priv = priv;
+	ap->path = path;
+	ap->fd = fd;
+	ap->env = enif_alloc_env();
+	enif_self(env, &ap->pid);
+	ap->ref = enif_make_copy(ap->env, argv[0]);
+	ap->image = enif_make_copy(ap->env, argv[1]);
+
+	if (!pool_push(&priv->pool, &ap->job)) {
+		if (path != NULL)
+			enif_free(path);
+		enif_free_env(ap->env);
+		enif_free(ap);
+		return enif_make_tuple2(env, priv->atom_error,
+			enif_make_atom(env, "busy"));
+	}
+
+	return priv->atom_ok;
+}
+
+/* A growable binary for the cairo PNG stream writer to append to. */
+struct png_out {
+	ErlNifBinary bin;
+	size_t len;
+};
+
+static cairo_status_t
+png_out_write(void *closure, const unsigned char *data, unsigned int length)
+{
+	struct png_out *po = closure;
+	size_t need = po->len + length, cap;
+
+	if (need > po->bin.size) {
+		cap = po->bin.size * 2;
+		if (cap < need)
+			cap = need;
+		if (!enif_realloc_binary(&po->bin, cap))
+			return CAIRO_STATUS_NO_MEMORY;
+	}
+	memcpy(po->bin.data + po->len, data, length);
+	po->len += length;
+
+	return CAIRO_STATUS_SUCCESS;
+}
+
+static ERL_NIF_TERM
+do_png_encode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct png_out po;
+	struct png_opts opts;
+	cairo_status_t status;
+	cairo_surface_t *sfc = NULL;
+	ERL_NIF_TERM err;
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	memset(&po, 0, sizeof(po));
+
+	if (argc > 1 && !get_png_opts(env, priv, argv[1], &opts, &err))
+		goto fail;
+
+	if (!create_surface_from_image(env, priv, argv[0], &sfc, &err))
+		goto fail;
+
+	/* tuned encodes bypass cairo's writer for our own libpng setup */
+	if (argc > 1) {
+		if (!png_encode_surface(env, sfc, &opts, &po.bin, &err))
+			goto fail;
+		cairo_surface_destroy(sfc);
+		return enif_make_tuple2(env, priv->atom_ok, enif_make_binary(env, &po.bin));
+	}
+
+	/* compressed output is usually well under a quarter of the raw pixels */
+	if (!enif_alloc_binary((size_t)cairo_image_surface_get_height(sfc) *
+	    cairo_image_surface_get_stride(sfc) / 4 + 1024, &po.bin)) {
+		err = enif_make_atom(env, "no_memory");
+		goto fail;
+	}
+
+	if ((status = cairo_surface_write_to_png_stream(sfc, png_out_write, &po)) != CAIRO_STATUS_SUCCESS) {
+		err = enif_make_tuple2(env, enif_make_atom(env, "bad_write_status"), enif_make_int(env, status));
+		goto fail;
+	}
+
+	cairo_surface_destroy(sfc);
+
+	if (po.len < po.bin.size)
+		enif_realloc_binary(&po.bin, po.len);
+	return enif_make_tuple2(env, priv->atom_ok, enif_make_binary(env, &po.bin));
+
+fail:
+	if (sfc != NULL)
+		cairo_surface_destroy(sfc);
+	if (po.bin.data != NULL)
+		enif_release_binary(&po.bin);
+	return enif_make_tuple2(env, priv->atom_error, err);
+}
+
+/* png_encode(Image :: image()[, Opts :: [png_opt()]]) -> {ok, binary()} | {error, term()} */
+static ERL_NIF_TERM
+png_encode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	/* deflating a whole image takes far longer than a NIF should block for */
+	if (priv->dirty_support)
+		return enif_schedule_nif(env, "png_encode", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_png_encode, argc, argv);
+
+	return do_png_encode(env, argc, argv);
+}
+
+static ERL_NIF_TERM
+do_qoi_encode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	cairo_surface_t *sfc = NULL;
+	ErlNifBinary out;
+	ERL_NIF_TERM err;
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	if (!create_surface_from_image(env, priv, argv[0], &sfc, &err))
+		goto fail;
+	if (!qoi_encode_surface(env, sfc, &out, &err))
+		goto fail;
+	cairo_surface_destroy(sfc);
+
+	return enif_make_tuple2(env, priv->atom_ok, enif_make_binary(env, &out));
+
+fail:
+	if (sfc != NULL)
+		cairo_surface_destroy(sfc);
+	return enif_make_tuple2(env, priv->atom_error, err);
+}
+
+/* qoi_encode(Image :: image()) -> {ok, binary()} | {error, term()} */
+static ERL_NIF_TERM
+qoi_encode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	if (priv->dirty_support)
+		return enif_schedule_nif(env, "qoi_encode", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_qoi_encode, argc, argv);
+
+	return do_qoi_encode(env, argc, argv);
+}
+
+static ERL_NIF_TERM
+do_qoi_decode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	ErlNifBinary qoi, out;
+	cairo_format_t fmt;
+	ERL_NIF_TERM err, out_tuple[5];
+	int w, h;
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	if (!enif_inspect_binary(env, argv[0], &qoi)) {
+		if (!enif_inspect_iolist_as_binary(env, argv[0], &qoi)) {
+			return enif_make_tuple2(env, priv->atom_error,
+				enif_make_atom(env, "bad_qoi_data"));
+		}
+	}
+	if (!qoi_decode_image(env, qoi.data, qoi.size, &w, &h, &fmt, &out, &err))
+		return enif_make_tuple2(env, priv->atom_error, err);
+
+	out_tuple[0] = priv->atom_cairo_image;
+	out_tuple[1] = enif_make_int(env, w);
+	out_tuple[2] = enif_make_int(env, h);
+	out_tuple[3] = (fmt == CAIRO_FORMAT_ARGB32) ? priv->atom_argb32 : priv->atom_rgb24;
+	out_tuple[4] = enif_make_binary(env, &out);
+
+	return enif_make_tuple2(env, priv->atom_ok,
+		enif_make_tuple_from_array(env, out_tuple, 5));
+}
+
+/* qoi_decode(Qoi :: binary() | iolist()) -> {ok, image()} | {error, term()} */
+static ERL_NIF_TERM
+qoi_decode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	if (priv->dirty_support)
+		return enif_schedule_nif(env, "qoi_decode", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_qoi_decode, argc, argv);
+
+	return do_qoi_decode(env, argc, argv);
+}
+
+static void
+image_res_dtor(ErlNifEnv *env, void *obj)
+{
+	struct image_res *img = obj;
+
+	if (img->sfc != NULL)
+		cairo_surface_destroy(img->sfc);
+}
+
+static ERL_NIF_TERM
+do_image_resource(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	cairo_surface_t *sfc = NULL, *own;
+	struct image_res *img;
+	cairo_format_t fmt;
+	ERL_NIF_TERM err, res;
+	int status, h;
+
+	if (!create_surface_from_image(env, priv, argv[0], &sfc, &err))
+		goto fail;
+
+	/* same format and width, so the same stride: one straight copy */
+	fmt = cairo_image_surface_get_format(sfc);
+	h = cairo_image_surface_get_height(sfc);
+	own = cairo_image_surface_create(fmt, cairo_image_surface_get_width(sfc), h);
+	if ((status = cairo_surface_status(own)) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(own);
+		err = enif_make_tuple2(env, enif_make_atom(env, "bad_surface_status"), enif_make_int(env, status));
+		goto fail;
+	}
+	cairo_surface_flush(own);
+	memcpy(cairo_image_surface_get_data(own), cairo_image_surface_get_data(sfc),
+		(size_t)h * cairo_image_surface_get_stride(own));
+	cairo_surface_mark_dirty(own);
+	cairo_surface_destroy(sfc);
+
+	img = enif_alloc_resource(priv->image_rsrc, sizeof(*img));
+	assert(img != NULL);
+	img->sfc = own;
+	res = enif_make_resource(env, img);
+	enif_release_resource(img);
+	return enif_make_tuple2(env, priv->atom_ok, res);
+
+fail:
+	if (sfc != NULL)
+		cairo_surface_destroy(sfc);
+	return enif_make_tuple2(env, priv->atom_error, err);
+}
+
+/* images above this many bytes are copied on a dirty scheduler */
+#define IMAGE_RESOURCE_INLINE_BYTES	(1024 * 1024)
+
+/* image_resource(Image :: image()) -> {ok, image_resource()} | {error, term()} */
+static ERL_NIF_TERM
+image_resource(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	const ERL_NIF_TERM *img_tuple;
+	ErlNifBinary pixels;
+	int arity;
+
+	if (priv->dirty_support &&
+	    enif_get_tuple(env, argv[0], &arity, &img_tuple) && arity == 5 &&
+	    enif_inspect_binary(env, img_tuple[4], &pixels) &&
+	    pixels.size > IMAGE_RESOURCE_INLINE_BYTES)
+		return enif_schedule_nif(env, "image_resource", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_image_resource, argc, argv);
+
+	return do_image_resource(env, argc, argv);
+}
+
+static int
+get_px_layout(struct cairerl_priv *priv, ERL_NIF_TERM term, enum px_layout *layout)
+{
+	if (enif_is_identical(term, priv->atom_rgba))
+		*layout = PX_RGBA;
+	else if (enif_is_identical(term, priv->atom_bgra))
+		*layout = PX_BGRA;
+	else if (enif_is_identical(term, priv->atom_rgb))
+		*layout = PX_RGB;
+	else
+		return 0;
+	return 1;
+}
+
+/* {Layout, W, H, Pixels} -> {ok, image()} in an argb32 or rgb24 target */
+static ERL_NIF_TERM
+convert_to_image(ErlNifEnv *env, struct cairerl_priv *priv, enum px_layout layout,
+    const ERL_NIF_TERM *raw, ERL_NIF_TERM target)
+{
+	ErlNifBinary in, out;
+	cairo_format_t fmt;
+	ERL_NIF_TERM err, out_tuple[5];
+	int w, h, stride, bpp;
+
+	if (enif_is_identical(target, priv->atom_argb32)) {
+		fmt = CAIRO_FORMAT_ARGB32;
+	} else if (enif_is_identical(target, priv->atom_rgb24)) {
+		fmt = CAIRO_FORMAT_RGB24;
+	} else {
+		err = enif_make_atom(env, "bad_target_format");
+		goto fail;
+	}
+	if (!enif_get_int(env, raw[1], &w) || !enif_get_int(env, raw[2], &h)) {
+		err = enif_make_atom(env, "bad_size");
+		goto fail;
+	}
+	if (!check_dimensions(env, w, h, &err))
+		goto fail;
+	bpp = (layout == PX_RGB) ? 3 : 4;
+	if (!enif_inspect_binary(env, raw[3], &in) || in.size < (size_t)w * h * bpp) {
+		err = enif_make_atom(env, "bad_pixel_data");
+		goto fail;
+	}
+
+	stride = cairo_format_stride_for_width(fmt, w);
+	if (!enif_alloc_binary((size_t)h * stride, &out)) {
+		err = enif_make_atom(env, "no_memory");
+		goto fail;
+	}
+	if (!convert_to_cairo(in.data, layout, w, h, fmt == CAIRO_FORMAT_RGB24, out.data, stride)) {
+		enif_release_binary(&out);
+		err = enif_make_atom(env, "no_memory");
+		goto fail;
+	}
+
+	out_tuple[0] = priv->atom_cairo_image;
+	out_tuple[1] = enif_make_int(env, w);
+	out_tuple[2] = enif_make_int(env, h);
+	out_tuple[3] = target;
+	out_tuple[4] = enif_make_binary(env, &out);
+	return enif_make_tuple2(env, priv->atom_ok,
+		enif_make_tuple_from_array(env, out_tuple, 5));
+
+fail:
+	return enif_make_tuple2(env, priv->atom_error, err);
+}
+
+/* image() -> {ok, Pixels} in a straight-alpha byte layout */
+static ERL_NIF_TERM
+convert_from_image(ErlNifEnv *env, struct cairerl_priv *priv, ERL_NIF_TERM image, ERL_NIF_TERM target)
+{
+	cairo_surface_t *sfc = NULL;
+	enum px_layout layout;
+	cairo_format_t fmt;
+	ErlNifBinary out;
+	ERL_NIF_TERM err;
+	int w, h;
+
+	if (!get_px_layout(priv, target, &layout)) {
+		err = enif_make_atom(env, "bad_target_format");
+		goto fail;
+	}
+	if (!create_surface_from_image(env, priv, image, &sfc, &err))
+		goto fail;
+	fmt = cairo_image_surface_get_format(sfc);
+	if (fmt != CAIRO_FORMAT_ARGB32 && fmt != CAIRO_FORMAT_RGB24) {
+		err = enif_make_atom(env, "unsupported_format");
+		goto fail;
+	}
+	w = cairo_image_surface_get_width(sfc);
+	h = cairo_image_surface_get_height(sfc);
+
+	if (!enif_alloc_binary((size_t)w * h * ((layout == PX_RGB) ? 3 : 4), &out)) {
+		err = enif_make_atom(env, "no_memory");
+		goto fail;
+	}
+	if (!convert_from_cairo(cairo_image_surface_get_data(sfc),
+	    cairo_image_surface_get_stride(sfc), w, h, fmt == CAIRO_FORMAT_RGB24,
+	    layout, out.data)) {
+		enif_release_binary(&out);
+		err = enif_make_atom(env, "no_memory");
+		goto fail;
+	}
+	cairo_surface_destroy(sfc);
+
+	return enif_make_tuple2(env, priv->atom_ok, enif_make_binary(env, &out));
+
+fail:
+	if (sfc != NULL)
+		cairo_surface_destroy(sfc);
+	return enif_make_tuple2(env, priv->atom_error, err);
+}
+
+static ERL_NIF_TERM
+do_convert(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	const ERL_NIF_TERM *raw;
+	enum px_layout layout;
+	int arity;
+
+	if (enif_get_tuple(env, argv[0], &arity, &raw) && arity == 4 &&
+	    get_px_layout(priv, raw[0], &layout))
+		return convert_to_image(env, priv, layout, raw, argv[1]);
+
+	return convert_from_image(env, priv, argv[0], argv[1]);
+}
+
+/* pixel data above this many bytes is converted on a dirty scheduler */
+#define CONVERT_INLINE_BYTES	(512 * 1024)
+
+/*
+ * convert(Image :: image(), rgba | bgra | rgb) -> {ok, binary()} | {error, term()}
+ * convert({rgba | bgra | rgb, W, H, binary()}, argb32 | rgb24) -> {ok, image()} | {error, term()}
+ */
+static ERL_NIF_TERM
+convert(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	const ERL_NIF_TERM *tuple;
+	ErlNifBinary pixels;
+	int arity;
+
+	/* the pixels are always the last element of either tuple */
+	if (priv->dirty_support &&
+	    enif_get_tuple(env, argv[0], &arity, &tuple) && arity >= 4 &&
+	    enif_inspect_binary(env, tuple[arity - 1], &pixels) &&
+	    pixels.size > CONVERT_INLINE_BYTES)
+		return enif_schedule_nif(env, "convert", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_convert, argc, argv);
+
+	return do_convert(env, argc, argv);
+}
+
+/* the cairo image formats resize/4 and mipmaps/2 filter directly */
+static int
+get_resize_surface(ErlNifEnv *env, struct cairerl_priv *priv, const ERL_NIF_TERM image,
+    cairo_surface_t **sfc, ERL_NIF_TERM *err)
+{
+	cairo_format_t fmt;
+
+	*sfc = NULL;
+	if (!create_surface_from_image(env, priv, image, sfc, err))
+		return 0;
+	fmt = cairo_image_surface_get_format(*sfc);
+	if (fmt != CAIRO_FORMAT_ARGB32 && fmt != CAIRO_FORMAT_RGB24) {
+		cairo_surface_destroy(*sfc);
+		*sfc = NULL;
+		*err = enif_make_atom(env, "unsupported_format");
+		return 0;
+	}
+	if (cairo_image_surface_get_width(*sfc) < 1 || cairo_image_surface_get_height(*sfc) < 1) {
+		cairo_surface_destroy(*sfc);
+		*sfc = NULL;
+		*err = enif_make_atom(env, "empty_image");
+		return 0;
+	}
+	return 1;
+}
+
+static ERL_NIF_TERM
+make_image(ErlNifEnv *env, struct cairerl_priv *priv, int w, int h, ERL_NIF_TERM fmt, ErlNifBinary *pixels)
+{
+	ERL_NIF_TERM out_tuple[5];
+
+	out_tuple[0] = priv->atom_cairo_image;
+	out_tuple[1] = enif_make_int(env, w);
+	out_tuple[2] = enif_make_int(env, h);
+	out_tuple[3] = fmt;
+	out_tuple[4] = enif_make_binary(env, pixels);
+	return enif_make_tuple_from_array(env, out_tuple, 5);
+}
+
+static ERL_NIF_TERM
+do_resize(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	cairo_surface_t *sfc = NULL;
+	enum resize_filter filter;
+	const ERL_NIF_TERM *img_tuple;
+	ErlNifBinary out;
+	cairo_format_t fmt;
+	ERL_NIF_TERM err;
+	int arity, w, h, stride;
+
+	if (!enif_get_int(env, argv[1], &w) || !enif_get_int(env, argv[2], &h) || w < 1 || h < 1) {
+		err = enif_make_atom(env, "bad_size");
+		goto fail;
+	}
+	if (!check_dimensions(env, w, h, &err))
+		goto fail;
+	if (enif_is_identical(argv[3], priv->atom_box)) {
+		filter = RESIZE_BOX;
+	} else if (enif_is_identical(argv[3], priv->atom_bilinear)) {
+		filter = RESIZE_BILINEAR;
+	} else if (enif_is_identical(argv[3], priv->atom_lanczos)) {
+		filter = RESIZE_LANCZOS;
+	} else {
+		err = enif_make_atom(env, "bad_filter");
+		goto fail;
+	}
+	if (!get_resize_surface(env, priv, argv[0], &sfc, &err))
+		goto fail;
+
+	fmt = cairo_image_surface_get_format(sfc);
+	stride = cairo_format_stride_for_width(fmt, w);
+	if (!enif_alloc_binary((size_t)h * stride, &out)) {
+		err = enif_make_atom(env, "no_memory");
+		goto fail;
+	}
+	if (!resize_image(cairo_image_surface_get_data(sfc),
+	    cairo_image_surface_get_width(sfc), cairo_image_surface_get_height(sfc),
+	    cairo_image_surface_get_stride(sfc), out.data, w, h, stride, filter,
+	    fmt == CAIRO_FORMAT_RGB24)) {
+		enif_release_binary(&out);
+		err = enif_make_atom(env, "no_memory");
+		goto fail;
+	}
+	cairo_surface_destroy(sfc);
+
+	enif_get_tuple(env, argv[0], &arity, &img_tuple);
+	return enif_make_tuple2(env, priv->atom_ok,
+		make_image(env, priv, w, h, img_tuple[3], &out));
+
+fail:
+	if (sfc != NULL)
+		cairo_surface_destroy(sfc);
+	return enif_make_tuple2(env, priv->atom_error, err);
+}
+
+/* resize(Image :: image(), W :: integer(), H :: integer(), box | bilinear | lanczos) -> {ok, image()} | {error, term()} */
+static ERL_NIF_TERM
+resize(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	if (priv->dirty_support)
+		return enif_schedule_nif(env, "resize", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_resize, argc, argv);
+
+	return do_resize(env, argc, argv);
+}
+
+#define MIPMAP_MAX_LEVELS	32
+
+static ERL_NIF_TERM
+do_mipmaps(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	cairo_surface_t *sfc = NULL;
+	const ERL_NIF_TERM *img_tuple;
+	ErlNifBinary cur;
+	ERL_NIF_TERM err, list, *levels = NULL;
+	cairo_format_t fmt;
+	const unsigned char *src;
+	int arity, n_levels, i, n = 0, w, h, stride, nw, nh, nstride;
+
+	if (!enif_get_int(env, argv[1], &n_levels) || n_levels < 0) {
+		err = enif_make_atom(env, "bad_levels");
+		goto fail;
+	}
+	if (!get_resize_surface(env, priv, argv[0], &sfc, &err))
+		goto fail;
+	enif_get_tuple(env, argv[0], &arity, &img_tuple);
+
+	fmt = cairo_image_surface_get_format(sfc);
+	w = cairo_image_surface_get_width(sfc);
+	h = cairo_image_surface_get_height(sfc);
+	stride = cairo_image_surface_get_stride(sfc);
+	src = cairo_image_surface_get_data(sfc);
+	/* halving stops at 1x1, so no chain is longer than the bits in a side */
+	if (n_levels > MIPMAP_MAX_LEVELS)
+		n_levels = MIPMAP_MAX_LEVELS;
+	if ((levels = enif_alloc((n_levels + 1) * sizeof(ERL_NIF_TERM))) == NULL) {
+		err = enif_make_atom(env, "no_memory");
+		goto fail;
+	}
+
+	/* each level is made from the one before, stopping at 1x1 */
+	for (i = 0; i < n_levels && (w > 1 || h > 1); ++i) {
+		nw = (w > 1) ? w / 2 : 1;
+		nh = (h > 1) ? h / 2 : 1;
+		nstride = cairo_format_stride_for_width(fmt, nw);
+		if (!enif_alloc_binary((size_t)nh * nstride, &cur)) {
+			err = enif_make_atom(env, "no_memory");
+			goto fail;
+		}
+		halve_image(src, w, h, stride, cur.data, nw, nh, nstride);
+		/* the binary stays alive with its term, to be the next level's source */
+		src = cur.data;
+		levels[n++] = make_image(env, priv, nw, nh, img_tuple[3], &cur);
+		w = nw;
+		h = nh;
+		stride = nstride;
+	}
+	cairo_surface_destroy(sfc);
+
+	list = enif_make_list_from_array(env, levels, n);
+	enif_free(levels);
+	return enif_make_tuple2(env, priv->atom_ok, list);
+
+fail:
+	if (levels != NULL)
+		enif_free(levels);
+	if (sfc != NULL)
+		cairo_surface_destroy(sfc);
+	return enif_make_tuple2(env, priv->atom_error, err);
+}
+
+/* mipmaps(Image :: image(), Levels :: integer()) -> {ok, [image()]} | {error, term()} */
+static ERL_NIF_TERM
+mipmaps(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+
+	if (priv->dirty_support)
+		return enif_schedule_nif(env, "mipmaps", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+			do_mipmaps, argc, argv);
+
+	return do_mipmaps(env, argc, argv);
+}
+
+/* default limit on queued draw_async jobs, past which it returns busy */
+#define ASYNC_QUEUE_DEPTH	1024
+
+/* default output buffers kept per size, and the largest buffer pooled */
+#define BUFPOOL_CAP		4
+#define BUFPOOL_MAX_MB		64
+
+/* buffer_pool_sizes: [{W, H, Format, Cap}], caps for known sizes */
+static void
+bufpool_configure(ErlNifEnv *env, struct cairerl_priv *priv, ERL_NIF_TERM sizes)
+{
+	ERL_NIF_TERM head, tail;
+	const ERL_NIF_TERM *tuple;
+	cairo_format_t fmt;
+	int arity, w, h, cap;
+
+	tail = sizes;
+	while (enif_get_list_cell(env, tail, &head, &tail)) {
+		if (!enif_get_tuple(env, head, &arity, &tuple) || arity != 4)
+			continue;
+		if (!enif_get_int(env, tuple[0], &w) || !enif_get_int(env, tuple[1], &h) ||
+		    !get_draw_format(priv, tuple[2], &fmt) ||
+		    !enif_get_int(env, tuple[3], &cap))
+			continue;
+		bufpool_set_cap(priv->bufpool, w, h, fmt, cap);
+	}
+}
+
+/* buffer_pool_stats() -> [{{W, H, Format}, [{atom(), integer()}]} | {unpooled, integer()}] */
+static ERL_NIF_TERM
+buffer_pool_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	return bufpool_stats(env, enif_priv_data(env));
+}
+
+/*
+ * set_simd(boolean()) -> boolean()
+ * Switches the pixel conversion and resize kernels between SIMD and
+ * scalar, returning the previous setting. Both give identical output,
+ * which is what this is for checking; it's not meant for production.
+ * SIMD can't be turned on if the simd load option turned it off.
+ */
+static ERL_NIF_TERM
+set_simd(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct cairerl_priv *priv = enif_priv_data(env);
+	int use_simd, prev;
+
+	if (enif_is_identical(argv[0], priv->atom_true))
+		use_simd = priv->simd_allowed;
+	else if (enif_is_identical(argv[0], priv->atom_false))
+		use_simd = 0;
+	else
+		return enif_make_badarg(env);
+
+	prev = __atomic_exchange_n(&priv->simd, use_simd, __ATOMIC_ACQ_REL);
+	if (prev != use_simd) {
+		convert_init(use_simd);
+		resize_init(use_simd);
+	}
+	return prev ? priv->atom_true : priv->atom_false;
+}
+
+static int
+load_cb(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
+{
+	struct cairerl_priv *priv;
+	ErlNifSysInfo info;
+	ERL_NIF_TERM opt;
+	int n_threads, queue_depth, buf_cap, buf_max_mb, use_simd;
+
+	priv = enif_alloc(sizeof(*priv));
+	if (priv == NULL)
+		return -1;
+	memset(priv, 0, sizeof(*priv));
+	atoms_init(env, priv);
+
+	enif_system_info(&info, sizeof(info));
+	priv->dirty_support = info.dirty_scheduler_support;
+
+	/* load_info is a map of the app env settings that matter here */
+	priv->scheduling = SCHED_DIRTY;
+	if (enif_get_map_value(env, load_info, enif_make_atom(env, "scheduling"), &opt) &&
+	    enif_is_identical(opt, enif_make_atom(env, "yield")))
+		priv->scheduling = SCHED_YIELD;
+
+	n_threads = info.scheduler_threads;
+	if (enif_get_map_value(env, load_info, enif_make_atom(env, "async_threads"), &opt))
+		enif_get_int(env, opt, &n_threads);
+	if (n_threads < 1)
+		n_threads = info.scheduler_threads;
+	queue_depth = ASYNC_QUEUE_DEPTH;
+	if (enif_get_map_value(env, load_info, enif_make_atom(env, "async_queue"), &opt))
+		enif_get_int(env, opt, &queue_depth);
+	if (queue_depth < 1)
+		queue_depth = ASYNC_QUEUE_DEPTH;
+
+	buf_cap = BUFPOOL_CAP;
+	if (enif_get_map_value(env, load_info, enif_make_atom(env, "buffer_pool_cap"), &opt))
+		enif_get_int(env, opt, &buf_cap);
+	buf_max_mb = BUFPOOL_MAX_MB;
+	if (enif_get_map_value(env, load_info, enif_make_atom(env, "buffer_pool_max_mb"), &opt))
+		enif_get_int(env, opt, &buf_max_mb);
+	if (buf_max_mb < 0)
+		buf_max_mb = 0;
+
+	use_simd = !enif_get_map_value(env, load_info, enif_make_atom(env, "simd"), &opt) ||
+		!enif_is_identical(opt, priv->atom_false);
+	priv->simd_allowed = priv->simd = use_simd;
+	convert_init(use_simd);
+	resize_init(use_simd);
+
+	priv->program_rsrc = enif_open_resource_type(env, NULL,
+		"cairerl_program", program_dtor, ERL_NIF_RT_CREATE, NULL);
+	if (priv->program_rsrc == NULL) {
+		enif_free(priv);
+		return -1;
+	}
+
+	priv->draw_job_rsrc = enif_open_resource_type(env, NULL,
+		"cairerl_draw_job", draw_job_dtor, ERL_NIF_RT_CREATE, NULL);
+	if (priv->draw_job_rsrc == NULL) {
+		enif_free(priv);
+		return -1;
+	}
+
+	priv->canvas_rsrc = enif_open_resource_type(env, NULL,
+		"cairerl_canvas", canvas_dtor, ERL_NIF_RT_CREATE, NULL);
+	if (priv->canvas_rsrc == NULL) {
+		enif_free(priv);
+		return -1;
+	}
+
+	priv->surface_rsrc = enif_open_resource_type(env, NULL,
+		"cairerl_surface", surface_rsrc_dtor, ERL_NIF_RT_CREATE, NULL);
+	if (priv->surface_rsrc == NULL) {
+		enif_free(priv);
+		return -1;
+	}
+
+	priv->pixbuf_rsrc = enif_open_resource_type(env, NULL,
+		"cairerl_pixbuf", pixbuf_rsrc_dtor, ERL_NIF_RT_CREATE, NULL);
+	if (priv->pixbuf_rsrc == NULL) {
+		enif_free(priv);
+		return -1;
+	}
+
+	priv->recording_rsrc = enif_open_resource_type(env, NULL,
+		"cairerl_recording", recording_dtor, ERL_NIF_RT_CREATE, NULL);
+	if (priv->recording_rsrc == NULL) {
+		enif_free(priv);
+		return -1;
+	}
+
+	priv->image_rsrc = enif_open_resource_type(env, NULL,
+		"cairerl_image", image_res_dtor, ERL_NIF_RT_CREATE, NULL);
+	if (priv->image_rsrc == NULL) {
+		enif_free(priv);
+		return -1;
+	}
+
+	if (!op_table_init(env, priv)) {
+		enif_free(priv);
+		return -1;
+	}
+
+	if ((priv->bufpool = bufpool_new(buf_cap, (size_t)buf_max_mb << 20)) == NULL) {
+		enif_free(priv);
+		return -1;
+	}
+	if (enif_get_map_value(env, load_info, enif_make_atom(env, "buffer_pool_sizes"), &opt))
+		bufpool_configure(env, priv, opt);
+
+	if (!pool_init(&priv->pool, n_threads, queue_depth)) {
+		bufpool_close(priv->bufpool);
+		enif_free(priv);
+		return -1;
+	}
+
+	*priv_data = priv;
+	return 0;
 }
 
 static void
 unload_cb(ErlNifEnv *env, void *priv_data)
 {
+	struct cairerl_priv *priv = priv_data;
+
+	pool_destroy(&priv->pool);
+	bufpool_close(priv->bufpool);
+	enif_free(priv);
 }
 
 static ErlNifFunc nif_funcs[] =
 {
 	{"draw", 3, draw},
+	{"draw", 4, draw4},
+	{"draw_binary", 3, draw_binary},
+	{"compile", 1, compile},
+	{"draw_compiled", 3, draw_compiled},
+	{"draw_async", 4, draw_async},
+	{"draw_many", 1, draw_many},
+	{"canvas_new", 3, canvas_new},
+	{"canvas_draw", 3, canvas_draw},
+	{"canvas_draw", 4, canvas_draw},
+	{"canvas_snapshot", 1, canvas_snapshot},
+	{"canvas_map", 5, canvas_map},
+	{"record", 2, record},
+	{"replay", 3, replay},
+	{"buffer_pool_stats", 0, buffer_pool_stats},
+	{"set_simd", 1, set_simd},
 	{"png_read", 1, png_read},
-	{"png_write", 2, png_write}
+	{"png_write", 2, png_write},
+	{"png_encode", 1, png_encode},
+	{"png_encode", 2, png_encode},
+	{"png_decode", 1, png_decode},
+	{"png_write_async", 3, png_write_async},
+	{"convert", 2, convert},
+	{"qoi_encode", 1, qoi_encode},
+	{"qoi_decode", 1, qoi_decode},
+	{"resize", 4, resize},
+	{"mipmaps", 2, mipmaps},
+	{"image_resource", 1, image_resource}
 };
 
 ERL_NIF_INIT(cairerl_nif, nif_funcs, load_cb, NULL, NULL, unload_cb)
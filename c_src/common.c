@@ -28,104 +28,330 @@
 %%
 */
 
+#include <math.h>
+
 #include "common.h"
 
-int
-tag_cmp(struct tag_node *n1, struct tag_node *n2)
+void
+atoms_init(ErlNifEnv *env, struct cairerl_priv *priv)
 {
-	return enif_compare(n1->tag, n2->tag);
+#define ATOM(name)	priv->atom_##name = enif_make_atom(env, #name)
+	ATOM(ok);
+	ATOM(error);
+	ATOM(cairo_image);
+	ATOM(rgb24);
+	ATOM(argb32);
+	ATOM(rgb30);
+	ATOM(rgb16_565);
+	ATOM(relative);
+	ATOM(preserve);
+	ATOM(undefined);
+	ATOM(default);
+	ATOM(gray);
+	ATOM(fast);
+	ATOM(good);
+	ATOM(best);
+	ATOM(normal);
+	ATOM(italic);
+	ATOM(oblique);
+	ATOM(bold);
+	ATOM(x_bearing);
+	ATOM(y_bearing);
+	ATOM(width);
+	ATOM(height);
+	ATOM(x_advance);
+	ATOM(y_advance);
+	ATOM(ascent);
+	ATOM(descent);
+	ATOM(max_x_advance);
+	ATOM(max_y_advance);
+	ATOM(cairo_tag_text_extents);
+	ATOM(cairo_tag_font_extents);
+	ATOM(cairo_tag_pattern);
+	ATOM(cairo_tag_path);
+	ATOM(solid);
+	ATOM(surface);
+	ATOM(linear);
+	ATOM(cairerl_done);
+	ATOM(damage);
+	ATOM(tiles);
+	ATOM(header);
+	ATOM(fd);
+	ATOM(rgba);
+	ATOM(bgra);
+	ATOM(rgb);
+	ATOM(box);
+	ATOM(bilinear);
+	ATOM(lanczos);
+	ATOM(true);
+	ATOM(false);
+	ATOM(level);
+	ATOM(filter);
+	ATOM(none);
+	ATOM(sub);
+	ATOM(up);
+	ATOM(paeth);
+	ATOM(adaptive);
+	ATOM(strategy);
+	ATOM(rle);
+#undef ATOM
 }
 
-RB_GENERATE(tag_tree, tag_node, entry, tag_cmp);
-
 int
-get_tag_double(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM tagOrValue, double *out)
+op_table_init(ErlNifEnv *env, struct cairerl_priv *priv)
 {
-	struct tag_node node;
-	struct tag_node *found;
+	int i, opc;
+	unsigned int idx;
+	ERL_NIF_TERM atom;
 
-	if (enif_get_double(env, tagOrValue, out)) {
-		return 1;
-	} else {
-		memset(&node, 0, sizeof(node));
-		node.tag = tagOrValue;
+	if (n_handlers * 2 > OP_TABLE_SIZE)
+		return 0;
 
-		found = RB_FIND(tag_tree, &ctx->tag_head, &node);
-		if (found == NULL)
-			return 0;
+	for (i = 0; i < n_handlers; ++i) {
+		atom = enif_make_atom(env, op_handlers[i].name);
+		idx = atom_hash(atom, OP_TABLE_BITS);
+		while (priv->op_table[idx].handler != NULL)
+			idx = (idx + 1) & (OP_TABLE_SIZE - 1);
+		priv->op_table[idx].atom = atom;
+		priv->op_table[idx].handler = &op_handlers[i];
 
-		if (found->type != TAG_DOUBLE)
+		/* two ops sharing an opcode is a bug in op_handlers[] */
+		opc = op_handlers[i].opcode;
+		if (opc == OPC_NONE)
+			continue;
+		if (opc >= N_OPCODES || priv->stream_ops[opc] != NULL)
 			return 0;
+		priv->stream_ops[opc] = &op_handlers[i];
+	}
 
-		*out = found->v_dbl;
-		return 1;
+	return 1;
+}
+
+#ifdef CAIRERL_NAME_DISPATCH
+/*
+ * The lookup op_table replaced, kept only to benchmark against: copy the
+ * name out of the atom, then prune op_handlers[] a character at a time.
+ * Build with -DCAIRERL_NAME_DISPATCH to use it (see bench/).
+ */
+static const struct op_handler *
+op_name_find(ErlNifEnv *env, const ERL_NIF_TERM atom)
+{
+	char namebuf[64];
+	const struct op_handler *candidates[n_handlers];
+	int namesz, ncand = n_handlers, i, idx;
+
+	if (!(namesz = enif_get_atom(env, atom, namebuf, sizeof(namebuf), ERL_NIF_LATIN1)))
+		return NULL;
+
+	for (i = 0; i < n_handlers; ++i)
+		candidates[i] = &op_handlers[i];
+
+	for (idx = 0; idx < namesz; ++idx) {
+		for (i = 0; i < n_handlers; ++i) {
+			if (candidates[i] != NULL) {
+				if ((namebuf[idx] != 0 && candidates[i]->name[idx] == 0) ||
+						candidates[i]->name[idx] != namebuf[idx]) {
+					candidates[i] = NULL;
+					--ncand;
+				} else if ((namebuf[idx] == 0 && candidates[i]->name[idx] == 0) || ncand == 1) {
+					return candidates[i];
+				} else if (ncand == 0) {
+					break;
+				}
+			}
+		}
 	}
+	return NULL;
 }
+#endif
 
-void *
-get_tag_ptr(ErlNifEnv *env, struct context *ctx, enum tag_type type, const ERL_NIF_TERM tag)
+const struct op_handler *
+op_table_find(ErlNifEnv *env, struct cairerl_priv *priv, const ERL_NIF_TERM atom)
 {
-	struct tag_node node;
-	struct tag_node *found;
+	unsigned int idx;
 
-	memset(&node, 0, sizeof(node));
-	node.tag = tag;
+#ifdef CAIRERL_NAME_DISPATCH
+	return op_name_find(env, atom);
+#endif
+	idx = atom_hash(atom, OP_TABLE_BITS);
+	while (priv->op_table[idx].handler != NULL) {
+		if (priv->op_table[idx].atom == atom)
+			return priv->op_table[idx].handler;
+		idx = (idx + 1) & (OP_TABLE_SIZE - 1);
+	}
 
-	found = RB_FIND(tag_tree, &ctx->tag_head, &node);
-	if (found == NULL)
-		return NULL;
+	return NULL;
+}
 
-	if (found->type != type)
+int
+get_value(struct context *ctx, const struct op_value *val, double *out)
+{
+	struct tag_slot *ts;
+
+	if (val->type == VAL_DOUBLE) {
+		*out = val->v_dbl;
+		return 1;
+	}
+
+	ts = &ctx->slots[val->slot];
+	if (ts->type != TAG_DOUBLE)
+		return 0;
+
+	*out = ts->v_dbl;
+	return 1;
+}
+
+void *
+get_tag_ptr(struct context *ctx, enum tag_type type, int slot)
+{
+	struct tag_slot *ts = &ctx->slots[slot];
+
+	if (ts->type != type)
 		return NULL;
 
-	return found->v_ptr;
+	return ts->v_ptr;
 }
 
 enum op_return
-set_tag_double(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM tag, double value)
+set_tag_double(struct context *ctx, int slot, double value)
 {
-	struct tag_node *tn, *rn;
+	struct tag_slot *ts = &ctx->slots[slot];
+
+	if (ts->type != TAG_NONE)
+		return ERR_TAG_ALREADY;
 
-	tn = enif_alloc(sizeof(*tn));
-	memset(tn, 0, sizeof(*tn));
+	ts->type = TAG_DOUBLE;
+	ts->v_dbl = value;
 
-	tn->tag = tag;
-	tn->type = TAG_DOUBLE;
-	tn->v_dbl = value;
+	return OP_OK;
+}
+
+enum op_return
+set_tag_ptr(struct context *ctx, int slot, enum tag_type type, void *value)
+{
+	struct tag_slot *ts = &ctx->slots[slot];
 
-	rn = RB_INSERT(tag_tree, &ctx->tag_head, tn);
-	if (rn != NULL) {
-		enif_free(tn);
+	if (ts->type != TAG_NONE)
 		return ERR_TAG_ALREADY;
-	}
+
+	ts->type = type;
+	ts->v_ptr = value;
 
 	return OP_OK;
 }
 
-enum op_return
-set_tag_ptr(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM tag, enum tag_type type, void *value)
+static int
+damage_area(const struct damage_rect *r)
+{
+	return (r->x1 - r->x0) * (r->y1 - r->y0);
+}
+
+static void
+damage_union(struct damage_rect *a, const struct damage_rect *b)
 {
-	struct tag_node *tn, *rn;
+	if (b->x0 < a->x0) a->x0 = b->x0;
+	if (b->y0 < a->y0) a->y0 = b->y0;
+	if (b->x1 > a->x1) a->x1 = b->x1;
+	if (b->y1 > a->y1) a->y1 = b->y1;
+}
 
-	tn = enif_alloc(sizeof(*tn));
-	assert(tn != NULL);
-	memset(tn, 0, sizeof(*tn));
+/*
+ * Adds a rect to the damage list, keeping at most DAMAGE_MAX_RECTS. Rects
+ * that touch or overlap are merged; once the list is full, the new rect
+ * goes into whichever existing one grows the least by taking it.
+ */
+void
+damage_add(struct context *ctx, const struct damage_rect *r)
+{
+	struct damage_rect m = *r, u;
+	int i, best, grow, best_grow;
 
-	tn->tag = tag;
-	tn->type = type;
-	tn->v_ptr = value;
+	if (m.x1 <= m.x0 || m.y1 <= m.y0)
+		return;
 
-	rn = RB_INSERT(tag_tree, &ctx->tag_head, tn);
-	if (rn != NULL) {
-		enif_free(tn);
-		return ERR_TAG_ALREADY;
+again:
+	for (i = 0; i < ctx->n_damage; ++i) {
+		struct damage_rect *d = &ctx->damage[i];
+
+		if (m.x0 <= d->x1 && d->x0 <= m.x1 && m.y0 <= d->y1 && d->y0 <= m.y1) {
+			/* take it out of the list and retry with the union */
+			damage_union(&m, d);
+			ctx->damage[i] = ctx->damage[--ctx->n_damage];
+			goto again;
+		}
 	}
 
-	return OP_OK;
+	if (ctx->n_damage < DAMAGE_MAX_RECTS) {
+		ctx->damage[ctx->n_damage++] = m;
+		return;
+	}
+
+	best = 0;
+	best_grow = -1;
+	for (i = 0; i < ctx->n_damage; ++i) {
+		u = ctx->damage[i];
+		damage_union(&u, &m);
+		grow = damage_area(&u) - damage_area(&ctx->damage[i]);
+		if (best_grow == -1 || grow < best_grow) {
+			best = i;
+			best_grow = grow;
+		}
+	}
+	m = ctx->damage[best];
+	ctx->damage[best] = ctx->damage[--ctx->n_damage];
+	damage_union(&m, r);
+	damage_add(ctx, &m);
+}
+
+/*
+ * Records a user-space box as damaged: it is clipped to the current clip,
+ * mapped through the CTM to the pixels it covers and clipped again to the
+ * image.
+ */
+void
+damage_user_rect(struct context *ctx, double x0, double y0, double x1, double y1)
+{
+	double cx0, cy0, cx1, cy1;
+	double px[4], py[4], minx, miny, maxx, maxy;
+	struct damage_rect r;
+	int i;
+
+	if (!ctx->track_damage)
+		return;
+
+	cairo_clip_extents(ctx->cairo, &cx0, &cy0, &cx1, &cy1);
+	if (x0 < cx0) x0 = cx0;
+	if (y0 < cy0) y0 = cy0;
+	if (x1 > cx1) x1 = cx1;
+	if (y1 > cy1) y1 = cy1;
+	if (x1 <= x0 || y1 <= y0)
+		return;
+
+	px[0] = x0; py[0] = y0;
+	px[1] = x1; py[1] = y0;
+	px[2] = x0; py[2] = y1;
+	px[3] = x1; py[3] = y1;
+	for (i = 0; i < 4; ++i)
+		cairo_user_to_device(ctx->cairo, &px[i], &py[i]);
+
+	minx = maxx = px[0];
+	miny = maxy = py[0];
+	for (i = 1; i < 4; ++i) {
+		if (px[i] < minx) minx = px[i];
+		if (px[i] > maxx) maxx = px[i];
+		if (py[i] < miny) miny = py[i];
+		if (py[i] > maxy) maxy = py[i];
+	}
+
+	r.x0 = (minx < 0) ? 0 : (int)floor(minx);
+	r.y0 = (miny < 0) ? 0 : (int)floor(miny);
+	r.x1 = (maxx > ctx->w) ? ctx->w : (int)ceil(maxx);
+	r.y1 = (maxy > ctx->h) ? ctx->h : (int)ceil(maxy);
+	damage_add(ctx, &r);
 }
 
 int
-create_surface_from_image(ErlNifEnv *env, const ERL_NIF_TERM image, cairo_surface_t **sfc, ERL_NIF_TERM *err)
+create_surface_from_image(ErlNifEnv *env, struct cairerl_priv *priv, const ERL_NIF_TERM image, cairo_surface_t **sfc, ERL_NIF_TERM *err)
 {
 	ErlNifBinary pixels;
 	cairo_status_t status;
@@ -141,7 +367,7 @@ create_surface_from_image(ErlNifEnv *env, const ERL_NIF_TERM image, cairo_surfac
 		goto fail;
 	}
 
-	if (arity != 5 || !enif_is_identical(img_tuple[0], enif_make_atom(env, "cairo_image"))) {
+	if (arity != 5 || !enif_is_identical(img_tuple[0], priv->atom_cairo_image)) {
 		if (err != NULL)
 			*err = enif_make_atom(env, "bad_record");
 		goto fail;
@@ -164,13 +390,13 @@ create_surface_from_image(ErlNifEnv *env, const ERL_NIF_TERM image, cairo_surfac
 		goto fail;
 	}
 
-	if (enif_is_identical(img_tuple[3], enif_make_atom(env, "rgb24"))) {
+	if (enif_is_identical(img_tuple[3], priv->atom_rgb24)) {
 		fmt = CAIRO_FORMAT_RGB24;
-	} else if (enif_is_identical(img_tuple[3], enif_make_atom(env, "argb32"))) {
+	} else if (enif_is_identical(img_tuple[3], priv->atom_argb32)) {
 		fmt = CAIRO_FORMAT_ARGB32;
-	} else if (enif_is_identical(img_tuple[3], enif_make_atom(env, "rgb30"))) {
+	} else if (enif_is_identical(img_tuple[3], priv->atom_rgb30)) {
 		fmt = CAIRO_FORMAT_RGB30;
-	} else if (enif_is_identical(img_tuple[3], enif_make_atom(env, "rgb16_565"))) {
+	} else if (enif_is_identical(img_tuple[3], priv->atom_rgb16_565)) {
 		fmt = CAIRO_FORMAT_RGB16_565;
 	} else {
 		if (err != NULL)
@@ -179,6 +405,11 @@ create_surface_from_image(ErlNifEnv *env, const ERL_NIF_TERM image, cairo_surfac
 	}
 
 	stride = cairo_format_stride_for_width(fmt, w);
+	if (w < 0 || h < 0 || stride < 0 || pixels.size < (size_t)h * stride) {
+		if (err != NULL)
+			*err = enif_make_atom(env, "bad_pixel_data");
+		goto fail;
+	}
 	*sfc = cairo_image_surface_create_for_data(
 			pixels.data, fmt, w, h, stride);
 
@@ -197,3 +428,38 @@ fail:
 	}
 	return 0;
 }
+
+/*
+ * Wraps an image surface's pixels in a binary without copying them. The
+ * binary holds its own reference on the surface, which goes away when
+ * the last term pointing into the pixels is garbage collected. Nothing
+ * may draw on the surface afterwards, since binaries are immutable.
+ */
+ERL_NIF_TERM
+make_surface_binary(ErlNifEnv *env, struct cairerl_priv *priv, cairo_surface_t *sfc)
+{
+	cairo_surface_t **ref;
+	ERL_NIF_TERM bin;
+	size_t size;
+
+	cairo_surface_flush(sfc);
+	size = (size_t)cairo_image_surface_get_height(sfc) *
+		cairo_image_surface_get_stride(sfc);
+
+	ref = enif_alloc_resource(priv->surface_rsrc, sizeof(*ref));
+	assert(ref != NULL);
+	*ref = cairo_surface_reference(sfc);
+	bin = enif_make_resource_binary(env, ref,
+		cairo_image_surface_get_data(sfc), size);
+	enif_release_resource(ref);
+
+	return bin;
+}
+
+void
+surface_rsrc_dtor(ErlNifEnv *env, void *obj)
+{
+	cairo_surface_t **ref = obj;
+
+	cairo_surface_destroy(*ref);
+}
@@ -39,9 +39,8 @@
 #include <string.h>
 #include "erl_nif.h"
 
-#include "tree.h"
-
 enum tag_type {
+	TAG_NONE = 0,
 	TAG_DOUBLE,
 	TAG_TEXT_EXTENTS,
 	TAG_PATTERN,
@@ -49,9 +48,7 @@ enum tag_type {
 	TAG_FONT_EXTENTS
 };
 
-struct tag_node;
-struct tag_node {
-	RB_ENTRY(tag_node) entry;
+struct tag_slot {
 	ERL_NIF_TERM tag;
 	enum tag_type type;
 	union {
@@ -64,12 +61,44 @@ struct tag_node {
 	};
 };
 
+struct cairerl_priv;
+struct arena_chunk;
+
+#define ARENA_INLINE	4096
+
+struct arena {
+	char *p, *end;
+	char *last;			/* most recent allocation */
+	struct arena_chunk *chunks;
+	uint64_t first[ARENA_INLINE / sizeof(uint64_t)];
+};
+
+/* device-space pixel rects, x1/y1 exclusive */
+struct damage_rect {
+	int x0, y0, x1, y1;
+};
+
+#define DAMAGE_MAX_RECTS	8
+
 struct context {
+	struct cairerl_priv *priv;
 	cairo_t *cairo;
 	cairo_surface_t *sfc;
 	int w, h;
-	ErlNifBinary out;
-	RB_HEAD(tag_tree, tag_node) tag_head;
+	ERL_NIF_TERM fmt;
+	struct pixbuf *buf;		/* output pixels, for image draws */
+	struct arena *arena;		/* non-NULL if ctx was allocated from it */
+
+	/* what the raster ops touched, if asked for */
+	int track_damage;
+	int n_damage;
+	struct damage_rect damage[DAMAGE_MAX_RECTS];
+
+	/* per-draw tag storage, all in one allocation at slots */
+	int n_slots;
+	struct tag_slot *slots;
+	cairo_text_extents_t *text_exts;
+	cairo_font_extents_t *font_exts;
 };
 
 enum op_return {
@@ -84,21 +113,397 @@ enum op_return {
 	ERR_BAD_ARGS = -10
 };
 
-int tag_cmp(struct tag_node *, struct tag_node *);
-RB_PROTOTYPE(tag_tree, tag_node, entry, tag_cmp);
+enum value_type {
+	VAL_DOUBLE,
+	VAL_TAG
+};
+
+/* a numeric op argument: either a literal or the slot of a double tag */
+struct op_value {
+	enum value_type type;
+	union {
+		double v_dbl;
+		int slot;
+	};
+};
+
+enum deref_field {
+	FIELD_X_BEARING,
+	FIELD_Y_BEARING,
+	FIELD_WIDTH,
+	FIELD_HEIGHT,
+	FIELD_X_ADVANCE,
+	FIELD_Y_ADVANCE,
+	FIELD_ASCENT,
+	FIELD_DESCENT,
+	FIELD_MAX_X_ADVANCE,
+	FIELD_MAX_Y_ADVANCE
+};
+
+#define OP_FLAG_RELATIVE	(1 << 0)
+#define OP_FLAG_PRESERVE	(1 << 1)
+#define OP_FLAG_ALPHA		(1 << 2)
+
+#define OP_MAX_VALUES	5
+
+struct op_handler;
+
+/*
+ * A single op, decoded out of its tuple. Everything a handler needs is
+ * in here, so running one never has to look at the original terms.
+ */
+struct op_instr {
+	const struct op_handler *handler;
+	ERL_NIF_TERM op;		/* the original tuple, for errors */
+	int flags;
+	int mode[2];			/* enum args: aa mode, slant/weight, field */
+	int slot[2];			/* tag slots */
+	int ext;			/* index into the per-draw extents arrays */
+	struct op_value val[OP_MAX_VALUES];
+	const char *text;		/* NUL-terminated, points into a binary */
+	char *face;			/* owned copy of a font family name */
+	cairo_surface_t *sfc;		/* owned */
+};
+
+struct program;
+
+/*
+ * Opcodes of the binary op stream (see program.c), as written by
+ * cairerl:encode_ops/1. These are wire format: never renumber one.
+ */
+enum stream_opcode {
+	OPC_NONE = -1,			/* op can't be put in a stream */
+	OPC_ARC = 0,
+	OPC_RECTANGLE = 1,
+	OPC_NEW_PATH = 2,
+	OPC_NEW_SUB_PATH = 3,
+	OPC_LINE_TO = 4,
+	OPC_MOVE_TO = 5,
+	OPC_CLOSE_PATH = 6,
+	OPC_SET_LINE_WIDTH = 7,
+	OPC_SET_SOURCE = 8,
+	OPC_SET_SOURCE_RGBA = 9,
+	OPC_SET_ANTIALIAS = 10,
+	OPC_CLIP = 11,
+	OPC_STROKE = 12,
+	OPC_FILL = 13,
+	OPC_PAINT = 14,
+	OPC_PATTERN_CREATE_FOR_SURFACE = 15,
+	OPC_PATTERN_TRANSLATE = 16,
+	OPC_IDENTITY_MATRIX = 17,
+	OPC_TRANSLATE = 18,
+	OPC_SCALE = 19,
+	OPC_TEXT_EXTENTS = 20,
+	OPC_FONT_EXTENTS = 21,
+	OPC_SELECT_FONT_FACE = 22,
+	OPC_SET_FONT_SIZE = 23,
+	OPC_SHOW_TEXT = 24,
+	OPC_SET_TAG = 25,
+	OPC_TAG_DEREF = 26,
+	N_OPCODES
+};
 
 struct op_handler {
 	const char *name;
-	enum op_return (*handler)(ErlNifEnv*, struct context *, const ERL_NIF_TERM *, int);
+	enum stream_opcode opcode;
+	int argc;
+	int raster;			/* touches pixels, for cost estimates */
+	const char *sig;		/* operands in the binary op stream */
+	enum op_return (*decode)(ErlNifEnv *, struct program *, const ERL_NIF_TERM *, struct op_instr *);
+	enum op_return (*handler)(struct context *, const struct op_instr *);
+};
+
+/*
+ * A list of ops lowered into op_instrs. Compiled programs keep their own
+ * copy of the op terms in env (text and image arguments point into it);
+ * the one-shot programs built inline by draw/3 borrow the caller's env instead.
+ *
+ * Every tag atom the ops mention is given a dense slot number while
+ * decoding, so at draw time tags live in a flat array.
+ */
+struct program {
+	ErlNifEnv *env;
+	struct cairerl_priv *priv;
+	struct arena *arena;		/* one-shot programs allocate from this */
+	int n_instrs;
+	int n_raster;
+	struct op_instr *instrs;
+
+	int n_tags;
+	ERL_NIF_TERM *tags;		/* slot -> tag atom */
+	int tag_table_bits;
+	int *tag_table;			/* open-addressed, slot + 1 or 0 */
+
+	int n_text_exts;
+	int n_font_exts;
+};
+
+/*
+ * Where a program compiled a chunk at a time has got to: the rest of an
+ * op list, or of a binary stream.
+ */
+struct program_cursor {
+	int binary;
+	int done;
+	int cap;			/* instrs allocated so far */
+	ERL_NIF_TERM rest;
+	const unsigned char *start, *p, *end;
 };
 
 extern struct op_handler op_handlers[];
 extern const int n_handlers;
 
-int get_tag_double(ErlNifEnv *, struct context *, const ERL_NIF_TERM, double *);
-void *get_tag_ptr(ErlNifEnv *, struct context *, enum tag_type, const ERL_NIF_TERM);
-enum op_return set_tag_double(ErlNifEnv *, struct context *, const ERL_NIF_TERM, double);
-enum op_return set_tag_ptr(ErlNifEnv *, struct context *, const ERL_NIF_TERM, enum tag_type, void *);
-int create_surface_from_image(ErlNifEnv *, const ERL_NIF_TERM, cairo_surface_t **, ERL_NIF_TERM *);
+static inline unsigned int
+atom_hash(const ERL_NIF_TERM atom, int bits)
+{
+	return (unsigned int)(((uint64_t)atom * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+/*
+ * A very rough cost model for a draw on a w x h surface, in nanoseconds:
+ * a fixed amount per op, plus a pass over the whole surface for every op
+ * that rasterises. Anything over EXPENSIVE_COST (about a millisecond) is
+ * too long to run on a normal scheduler in one go.
+ */
+#define COST_PER_OP		200
+#define COST_PER_PIXEL		1
+#define EXPENSIVE_COST		1000000
+
+static inline int
+draw_is_expensive(int w, int h, unsigned int n_ops, unsigned int n_raster)
+{
+	uint64_t cost;
+
+	if (w <= 0 || h <= 0)
+		return 0;
+	cost = (uint64_t)n_ops * COST_PER_OP +
+		(uint64_t)n_raster * w * h * COST_PER_PIXEL;
+	return (cost > EXPENSIVE_COST);
+}
+
+/* open-addressed table of op atoms, must be at least 2x n_handlers */
+#define OP_TABLE_BITS	6
+#define OP_TABLE_SIZE	(1 << OP_TABLE_BITS)
+
+struct op_slot {
+	ERL_NIF_TERM atom;
+	const struct op_handler *handler;
+};
+
+struct pool_job {
+	struct pool_job *next;
+	void (*run)(struct pool_job *);	/* called on a pool thread */
+};
+
+struct pool {
+	ErlNifMutex *lock;
+	ErlNifCond *cond;
+	struct pool_job *head, *tail;
+	int depth, max_depth;
+	int n_threads;
+	ErlNifTid *tids;
+	int shutdown;
+};
+
+/* a pooled draw output buffer: pixels with an image surface over them */
+struct pixbuf {
+	struct pixbuf *next;
+	struct bufpool *pool;
+	struct buf_bucket *bucket;	/* NULL if not pooled */
+	cairo_surface_t *sfc;
+	unsigned char *data;
+	size_t size;
+};
+
+struct buf_bucket {
+	int w, h;
+	cairo_format_t fmt;
+	int cap;
+	int n_free;
+	struct pixbuf *free;
+	uint64_t hits, misses;
+};
+
+#define BUFPOOL_MAX_BUCKETS	32
+
+struct bufpool {
+	ErlNifMutex *lock;
+	unsigned long refs;		/* the owner's, plus one per buffer out */
+	int closed;
+	int default_cap;
+	size_t max_bytes;
+	int n_buckets;
+	struct buf_bucket buckets[BUFPOOL_MAX_BUCKETS];
+	uint64_t unpooled;
+};
+
+/* png_encode/2 settings; -1 leaves one at the libpng default */
+struct png_opts {
+	int level;		/* zlib level, 0..9 */
+	int filter;		/* libpng PNG_FILTER_* mask */
+	int strategy;		/* zlib Z_* strategy */
+};
+
+/* image_resource/1: pixels copied once into a surface cairo owns */
+struct image_res {
+	cairo_surface_t *sfc;
+};
+
+/* byte layouts convert/2 moves cairo images to and from */
+enum px_layout {
+	PX_RGBA = 0,
+	PX_BGRA,
+	PX_RGB
+};
+
+/* resize/4 filters */
+enum resize_filter {
+	RESIZE_BOX = 0,
+	RESIZE_BILINEAR,
+	RESIZE_LANCZOS
+};
+
+/* where expensive draws go, from the 'scheduling' app env at load */
+enum sched_mode {
+	SCHED_DIRTY = 0,
+	SCHED_YIELD
+};
+
+struct cairerl_priv {
+	struct op_slot op_table[OP_TABLE_SIZE];
+	const struct op_handler *stream_ops[N_OPCODES];	/* by opcode */
+	ErlNifResourceType *program_rsrc;
+	ErlNifResourceType *draw_job_rsrc;
+	ErlNifResourceType *canvas_rsrc;
+	ErlNifResourceType *surface_rsrc;
+	ErlNifResourceType *pixbuf_rsrc;
+	ErlNifResourceType *recording_rsrc;
+	ErlNifResourceType *image_rsrc;
+	int dirty_support;
+	enum sched_mode scheduling;
+	struct pool pool;
+	struct bufpool *bufpool;
+	int simd_allowed;		/* the simd load option */
+	int simd;			/* kernels in use; set_simd/1 swaps it */
+
+	/* atoms used on hot paths, made once in load_cb */
+	ERL_NIF_TERM atom_ok;
+	ERL_NIF_TERM atom_error;
+	ERL_NIF_TERM atom_cairo_image;
+	ERL_NIF_TERM atom_rgb24;
+	ERL_NIF_TERM atom_argb32;
+	ERL_NIF_TERM atom_rgb30;
+	ERL_NIF_TERM atom_rgb16_565;
+	ERL_NIF_TERM atom_relative;
+	ERL_NIF_TERM atom_preserve;
+	ERL_NIF_TERM atom_undefined;
+	ERL_NIF_TERM atom_default;
+	ERL_NIF_TERM atom_gray;
+	ERL_NIF_TERM atom_fast;
+	ERL_NIF_TERM atom_good;
+	ERL_NIF_TERM atom_best;
+	ERL_NIF_TERM atom_normal;
+	ERL_NIF_TERM atom_italic;
+	ERL_NIF_TERM atom_oblique;
+	ERL_NIF_TERM atom_bold;
+	ERL_NIF_TERM atom_x_bearing;
+	ERL_NIF_TERM atom_y_bearing;
+	ERL_NIF_TERM atom_width;
+	ERL_NIF_TERM atom_height;
+	ERL_NIF_TERM atom_x_advance;
+	ERL_NIF_TERM atom_y_advance;
+	ERL_NIF_TERM atom_ascent;
+	ERL_NIF_TERM atom_descent;
+	ERL_NIF_TERM atom_max_x_advance;
+	ERL_NIF_TERM atom_max_y_advance;
+	ERL_NIF_TERM atom_cairo_tag_text_extents;
+	ERL_NIF_TERM atom_cairo_tag_font_extents;
+	ERL_NIF_TERM atom_cairo_tag_pattern;
+	ERL_NIF_TERM atom_cairo_tag_path;
+	ERL_NIF_TERM atom_solid;
+	ERL_NIF_TERM atom_surface;
+	ERL_NIF_TERM atom_linear;
+	ERL_NIF_TERM atom_cairerl_done;
+	ERL_NIF_TERM atom_damage;
+	ERL_NIF_TERM atom_tiles;
+	ERL_NIF_TERM atom_header;
+	ERL_NIF_TERM atom_fd;
+	ERL_NIF_TERM atom_rgba;
+	ERL_NIF_TERM atom_bgra;
+	ERL_NIF_TERM atom_rgb;
+	ERL_NIF_TERM atom_box;
+	ERL_NIF_TERM atom_bilinear;
+	ERL_NIF_TERM atom_lanczos;
+	ERL_NIF_TERM atom_true;
+	ERL_NIF_TERM atom_false;
+	ERL_NIF_TERM atom_level;
+	ERL_NIF_TERM atom_filter;
+	ERL_NIF_TERM atom_none;
+	ERL_NIF_TERM atom_sub;
+	ERL_NIF_TERM atom_up;
+	ERL_NIF_TERM atom_paeth;
+	ERL_NIF_TERM atom_adaptive;
+	ERL_NIF_TERM atom_strategy;
+	ERL_NIF_TERM atom_rle;
+};
+
+void atoms_init(ErlNifEnv *, struct cairerl_priv *);
+int op_table_init(ErlNifEnv *, struct cairerl_priv *);
+const struct op_handler *op_table_find(ErlNifEnv *, struct cairerl_priv *, const ERL_NIF_TERM);
+
+enum op_return decode_op(ErlNifEnv *, struct program *, const ERL_NIF_TERM, struct op_instr *);
+void op_instr_clear(struct program *, struct op_instr *);
+void *program_alloc(struct program *, size_t);
+enum op_return program_compile(ErlNifEnv *, struct cairerl_priv *, const ERL_NIF_TERM, struct program *, ERL_NIF_TERM *);
+enum op_return program_compile_binary(ErlNifEnv *, struct cairerl_priv *, const ERL_NIF_TERM, struct program *, ERL_NIF_TERM *);
+enum op_return program_compile_start(ErlNifEnv *, struct cairerl_priv *, const ERL_NIF_TERM, struct program *, struct program_cursor *, ERL_NIF_TERM *);
+enum op_return program_compile_some(ErlNifEnv *, struct program *, struct program_cursor *, int, ERL_NIF_TERM *);
+void program_clear(struct program *);
+int program_scan(ErlNifEnv *, struct cairerl_priv *, const ERL_NIF_TERM, int, int, unsigned int *, unsigned int *);
+int program_tag_slot(struct program *, const ERL_NIF_TERM);
+int program_find_tag(const struct program *, const ERL_NIF_TERM);
+
+int get_value(struct context *, const struct op_value *, double *);
+void *get_tag_ptr(struct context *, enum tag_type, int);
+enum op_return set_tag_double(struct context *, int, double);
+enum op_return set_tag_ptr(struct context *, int, enum tag_type, void *);
+void arena_init(struct arena *);
+void *arena_alloc(struct arena *, size_t);
+void *arena_realloc(struct arena *, void *, size_t, size_t);
+void arena_release(struct arena *);
+
+int pool_init(struct pool *, int, int);
+int pool_push(struct pool *, struct pool_job *);
+void pool_destroy(struct pool *);
+
+struct bufpool *bufpool_new(int, size_t);
+int bufpool_set_cap(struct bufpool *, int, int, cairo_format_t, int);
+struct pixbuf *bufpool_get(struct bufpool *, int, int, cairo_format_t);
+void bufpool_put(struct bufpool *, struct pixbuf *);
+void bufpool_close(struct bufpool *);
+ERL_NIF_TERM bufpool_stats(ErlNifEnv *, struct cairerl_priv *);
+ERL_NIF_TERM pixbuf_make_binary(ErlNifEnv *, struct cairerl_priv *, struct pixbuf *);
+void pixbuf_rsrc_dtor(ErlNifEnv *, void *);
+
+void damage_add(struct context *, const struct damage_rect *);
+void damage_user_rect(struct context *, double, double, double, double);
+
+int create_surface_from_image(ErlNifEnv *, struct cairerl_priv *, const ERL_NIF_TERM, cairo_surface_t **, ERL_NIF_TERM *);
+ERL_NIF_TERM make_surface_binary(ErlNifEnv *, struct cairerl_priv *, cairo_surface_t *);
+void surface_rsrc_dtor(ErlNifEnv *, void *);
+
+void convert_init(int);
+int convert_from_cairo(const unsigned char *, int, int, int, int, enum px_layout, unsigned char *);
+int convert_to_cairo(const unsigned char *, enum px_layout, int, int, int, unsigned char *, int);
+
+void resize_init(int);
+int resize_image(const unsigned char *, int, int, int, unsigned char *, int, int, int, enum resize_filter, int);
+void halve_image(const unsigned char *, int, int, int, unsigned char *, int, int, int);
+
+int qoi_encode_surface(ErlNifEnv *, cairo_surface_t *, ErlNifBinary *, ERL_NIF_TERM *);
+int qoi_decode_image(ErlNifEnv *, const unsigned char *, size_t, int *, int *, cairo_format_t *, ErlNifBinary *, ERL_NIF_TERM *);
+
+int get_png_opts(ErlNifEnv *, struct cairerl_priv *, const ERL_NIF_TERM, struct png_opts *, ERL_NIF_TERM *);
+int png_encode_surface(ErlNifEnv *, cairo_surface_t *, const struct png_opts *, ErlNifBinary *, ERL_NIF_TERM *);
 
 #endif
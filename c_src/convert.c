@@ -0,0 +1,506 @@
+/*
+%%
+%% cairo erlang binding
+%%
+%% Copyright (c) 2014, The University of Queensland
+%% Author: Alex Wilson <alex@uq.edu.au>
+%%
+%% Redistribution and use in source and binary forms, with or without
+%% modification, are permitted provided that the following conditions are met:
+%%
+%%  * Redistributions of source code must retain the above copyright notice,
+%%    this list of conditions and the following disclaimer.
+%%  * Redistributions in binary form must reproduce the above copyright notice,
+%%    this list of conditions and the following disclaimer in the documentation
+%%    and/or other materials provided with the distribution.
+%%
+%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+%% AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+%% IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+%% ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+%% LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+%% CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF
+%% SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR  BUSINESS
+%% INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+%% CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+%% ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+%% POSSIBILITY OF SUCH DAMAGE.
+%%
+*/
+
+
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86	1
+#include <immintrin.h>
+#elif defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN)
+#define CONVERT_NEON	1
+#include <arm_neon.h>
+#endif
+
+/*
+ * Conversion between cairo's premultiplied native-endian ARGB32 / RGB24
+ * and the straight-alpha byte layouts browsers and encoders want.
+ *
+ * Every kernel works on a row of 32-bit pixels. "swap" selects R,G,B,A
+ * byte order on the byte side instead of B,G,R,A (which is the same as
+ * cairo's own layout on little-endian hosts), and "opaque" means the
+ * cairo side is RGB24, so its alpha byte is ignored (and written as 0xff).
+ * 3-byte RGB goes through a row of RGBA and is packed or unpacked around
+ * the kernels.
+ *
+ * The results are bit-exact across kernels:
+ * - Unpremultiplying is (c * 255 + a / 2) / a, the same as cairo's PNG
+ *   writer. The SIMD kernels use a float division, which is correctly
+ *   rounded, and then truncate; that can't land on the wrong integer
+ *   for numerators under 2^16.
+ * - Premultiplying is pixman's rounding multiply, which fits 16-bit
+ *   lanes exactly.
+ */
+
+struct px_kernels {
+	void (*unpremul)(const uint32_t *, unsigned char *, int, int, int);
+	void (*premul)(const unsigned char *, uint32_t *, int, int, int);
+};
+
+static inline uint32_t
+mul_un8(uint32_t c, uint32_t a)
+{
+	uint32_t t = c * a + 0x80;
+
+	return ((t >> 8) + t) >> 8;
+}
+
+static void
+unpremul_scalar(const uint32_t *src, unsigned char *dst, int n, int swap, int opaque)
+{
+	uint32_t px, a, r, g, b;
+	int x;
+
+	for (x = 0; x < n; ++x, dst += 4) {
+		px = src[x];
+		a = opaque ? 0xff : px >> 24;
+		r = (px >> 16) & 0xff;
+		g = (px >> 8) & 0xff;
+		b = px & 0xff;
+		if (a == 0) {
+			r = g = b = 0;
+		} else if (a != 0xff) {
+			r = (r * 255 + a / 2) / a;
+			g = (g * 255 + a / 2) / a;
+			b = (b * 255 + a / 2) / a;
+			/* only reachable from pixels that weren't really premultiplied */
+			if (r > 0xff)
+				r = 0xff;
+			if (g > 0xff)
+				g = 0xff;
+			if (b > 0xff)
+				b = 0xff;
+		}
+		dst[0] = swap ? r : b;
+		dst[1] = g;
+		dst[2] = swap ? b : r;
+		dst[3] = a;
+	}
+}
+
+static void
+premul_scalar(const unsigned char *src, uint32_t *dst, int n, int swap, int opaque)
+{
+	uint32_t a, r, g, b;
+	int x;
+
+	for (x = 0; x < n; ++x, src += 4) {
+		r = swap ? src[0] : src[2];
+		g = src[1];
+		b = swap ? src[2] : src[0];
+		a = opaque ? 0xff : src[3];
+		if (a != 0xff) {
+			r = mul_un8(r, a);
+			g = mul_un8(g, a);
+			b = mul_un8(b, a);
+		}
+		dst[x] = (a << 24) | (r << 16) | (g << 8) | b;
+	}
+}
+
+static const struct px_kernels kernels_scalar = {
+	unpremul_scalar, premul_scalar
+};
+
+#ifdef CONVERT_X86
+
+__attribute__((target("sse2")))
+static inline __m128i
+sse2_swap_rb(__m128i v)
+{
+	const __m128i ff = _mm_set1_epi32(0xff);
+
+	return _mm_or_si128(_mm_and_si128(v, _mm_set1_epi32(0xff00ff00)),
+		_mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), ff),
+			_mm_slli_epi32(_mm_and_si128(v, ff), 16)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i
+sse2_unpremul_ch(__m128i c, __m128i half, __m128 af)
+{
+	__m128i q, big;
+
+	q = _mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(c, 8), c), half);
+	q = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(q), af));
+	big = _mm_cmpgt_epi32(q, _mm_set1_epi32(0xff));
+	return _mm_or_si128(_mm_andnot_si128(big, q),
+		_mm_and_si128(big, _mm_set1_epi32(0xff)));
+}
+
+__attribute__((target("sse2")))
+static void
+unpremul_sse2(const uint32_t *src, unsigned char *dst, int n, int swap, int opaque)
+{
+	const __m128i amask = _mm_set1_epi32(0xff000000);
+	const __m128i ff = _mm_set1_epi32(0xff);
+	__m128i v, a, zero, r, g, b, a1;
+	__m128 af;
+	int x;
+
+	for (x = 0; x + 4 <= n; x += 4) {
+		v = _mm_loadu_si128((const __m128i *)(src + x));
+		if (opaque)
+			v = _mm_or_si128(v, amask);
+		/* all opaque: nothing to divide, only a swizzle */
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(v, amask), amask)) != 0xffff) {
+			a = _mm_srli_epi32(v, 24);
+			zero = _mm_cmpeq_epi32(a, _mm_setzero_si128());
+			a1 = _mm_or_si128(a, _mm_and_si128(zero, _mm_set1_epi32(1)));
+			af = _mm_cvtepi32_ps(a1);
+			r = sse2_unpremul_ch(_mm_and_si128(_mm_srli_epi32(v, 16), ff), _mm_srli_epi32(a, 1), af);
+			g = sse2_unpremul_ch(_mm_and_si128(_mm_srli_epi32(v, 8), ff), _mm_srli_epi32(a, 1), af);
+			b = sse2_unpremul_ch(_mm_and_si128(v, ff), _mm_srli_epi32(a, 1), af);
+			v = _mm_or_si128(_mm_slli_epi32(a, 24),
+				_mm_or_si128(_mm_slli_epi32(r, 16),
+					_mm_or_si128(_mm_slli_epi32(g, 8), b)));
+			v = _mm_andnot_si128(zero, v);
+		}
+		if (swap)
+			v = sse2_swap_rb(v);
+		_mm_storeu_si128((__m128i *)(dst + x * 4), v);
+	}
+	unpremul_scalar(src + x, dst + x * 4, n - x, swap, opaque);
+}
+
+__attribute__((target("sse2")))
+static void
+premul_sse2(const unsigned char *src, uint32_t *dst, int n, int swap, int opaque)
+{
+	const __m128i amask = _mm_set1_epi32(0xff000000);
+	const __m128i lo = _mm_set1_epi32(0x00ff00ff);
+	const __m128i round = _mm_set1_epi16(0x80);
+	__m128i v, a, rb, ag;
+	int x;
+
+	for (x = 0; x + 4 <= n; x += 4) {
+		v = _mm_loadu_si128((const __m128i *)(src + x * 4));
+		if (swap)
+			v = sse2_swap_rb(v);
+		if (opaque)
+			v = _mm_or_si128(v, amask);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(v, amask), amask)) != 0xffff) {
+			/* alpha in both 16-bit halves; a * c < 2^16 fits a 16-bit lane */
+			a = _mm_srli_epi32(v, 24);
+			a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+			rb = _mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(v, lo), a), round);
+			rb = _mm_srli_epi16(_mm_add_epi16(_mm_srli_epi16(rb, 8), rb), 8);
+			ag = _mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(v, 8), lo), a), round);
+			ag = _mm_srli_epi16(_mm_add_epi16(_mm_srli_epi16(ag, 8), ag), 8);
+			/* ag holds g * a in its low half and a * a in its high one: keep a */
+			v = _mm_or_si128(rb, _mm_or_si128(
+				_mm_slli_epi32(_mm_and_si128(ag, _mm_set1_epi32(0xff)), 8),
+				_mm_and_si128(v, amask)));
+		}
+		_mm_storeu_si128((__m128i *)(dst + x), v);
+	}
+	premul_scalar(src + x * 4, dst + x, n - x, swap, opaque);
+}
+
+static const struct px_kernels kernels_sse2 = {
+	unpremul_sse2, premul_sse2
+};
+
+__attribute__((target("avx2")))
+static inline __m256i
+avx2_swap_rb(__m256i v)
+{
+	const __m256i shuf = _mm256_setr_epi8(
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+	return _mm256_shuffle_epi8(v, shuf);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+avx2_unpremul_ch(__m256i c, __m256i half, __m256 af)
+{
+	__m256i q;
+
+	q = _mm256_add_epi32(_mm256_sub_epi32(_mm256_slli_epi32(c, 8), c), half);
+	q = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(q), af));
+	return _mm256_min_epi32(q, _mm256_set1_epi32(0xff));
+}
+
+__attribute__((target("avx2")))
+static void
+unpremul_avx2(const uint32_t *src, unsigned char *dst, int n, int swap, int opaque)
+{
+	const __m256i amask = _mm256_set1_epi32(0xff000000);
+	const __m256i ff = _mm256_set1_epi32(0xff);
+	__m256i v, a, half, zero, r, g, b;
+	__m256 af;
+	int x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		v = _mm256_loadu_si256((const __m256i *)(src + x));
+		if (opaque)
+			v = _mm256_or_si256(v, amask);
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(v, amask), amask)) != -1) {
+			a = _mm256_srli_epi32(v, 24);
+			half = _mm256_srli_epi32(a, 1);
+			zero = _mm256_cmpeq_epi32(a, _mm256_setzero_si256());
+			af = _mm256_cvtepi32_ps(_mm256_max_epi32(a, _mm256_set1_epi32(1)));
+			r = avx2_unpremul_ch(_mm256_and_si256(_mm256_srli_epi32(v, 16), ff), half, af);
+			g = avx2_unpremul_ch(_mm256_and_si256(_mm256_srli_epi32(v, 8), ff), half, af);
+			b = avx2_unpremul_ch(_mm256_and_si256(v, ff), half, af);
+			v = _mm256_or_si256(_mm256_slli_epi32(a, 24),
+				_mm256_or_si256(_mm256_slli_epi32(r, 16),
+					_mm256_or_si256(_mm256_slli_epi32(g, 8), b)));
+			v = _mm256_andnot_si256(zero, v);
+		}
+		if (swap)
+			v = avx2_swap_rb(v);
+		_mm256_storeu_si256((__m256i *)(dst + x * 4), v);
+	}
+	unpremul_sse2(src + x, dst + x * 4, n - x, swap, opaque);
+}
+
+__attribute__((target("avx2")))
+static void
+premul_avx2(const unsigned char *src, uint32_t *dst, int n, int swap, int opaque)
+{
+	const __m256i amask = _mm256_set1_epi32(0xff000000);
+	/* alpha of each pixel copied into all four of its 16-bit halves */
+	const __m256i abcast = _mm256_setr_epi8(
+		3, -1, 3, -1, 7, -1, 7, -1, 11, -1, 11, -1, 15, -1, 15, -1,
+		3, -1, 3, -1, 7, -1, 7, -1, 11, -1, 11, -1, 15, -1, 15, -1);
+	const __m256i lo = _mm256_set1_epi32(0x00ff00ff);
+	const __m256i round = _mm256_set1_epi16(0x80);
+	__m256i v, a, rb, ag;
+	int x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		v = _mm256_loadu_si256((const __m256i *)(src + x * 4));
+		if (swap)
+			v = avx2_swap_rb(v);
+		if (opaque)
+			v = _mm256_or_si256(v, amask);
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(v, amask), amask)) != -1) {
+			a = _mm256_shuffle_epi8(v, abcast);
+			rb = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(v, lo), a), round);
+			rb = _mm256_srli_epi16(_mm256_add_epi16(_mm256_srli_epi16(rb, 8), rb), 8);
+			ag = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi16(v, 8), lo), a), round);
+			ag = _mm256_srli_epi16(_mm256_add_epi16(_mm256_srli_epi16(ag, 8), ag), 8);
+			/* ag holds g * a in its low half and a * a in its high one: keep a */
+			v = _mm256_or_si256(rb, _mm256_or_si256(
+				_mm256_slli_epi32(_mm256_and_si256(ag, _mm256_set1_epi32(0xff)), 8),
+				_mm256_and_si256(v, amask)));
+		}
+		_mm256_storeu_si256((__m256i *)(dst + x), v);
+	}
+	premul_sse2(src + x * 4, dst + x, n - x, swap, opaque);
+}
+
+static const struct px_kernels kernels_avx2 = {
+	unpremul_avx2, premul_avx2
+};
+
+#endif /* CONVERT_X86 */
+
+#ifdef CONVERT_NEON
+
+static inline uint32x4_t
+neon_swap_rb(uint32x4_t v)
+{
+	const uint8_t idx[16] = { 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 };
+
+	return vreinterpretq_u32_u8(vqtbl1q_u8(vreinterpretq_u8_u32(v), vld1q_u8(idx)));
+}
+
+static inline uint32x4_t
+neon_unpremul_ch(uint32x4_t c, uint32x4_t half, float32x4_t af)
+{
+	uint32x4_t q;
+
+	q = vaddq_u32(vsubq_u32(vshlq_n_u32(c, 8), c), half);
+	q = vcvtq_u32_f32(vdivq_f32(vcvtq_f32_u32(q), af));
+	return vminq_u32(q, vdupq_n_u32(0xff));
+}
+
+static void
+unpremul_neon(const uint32_t *src, unsigned char *dst, int n, int swap, int opaque)
+{
+	const uint32x4_t amask = vdupq_n_u32(0xff000000);
+	const uint32x4_t ff = vdupq_n_u32(0xff);
+	uint32x4_t v, a, half, zero, r, g, b;
+	float32x4_t af;
+	int x;
+
+	for (x = 0; x + 4 <= n; x += 4) {
+		v = vld1q_u32(src + x);
+		if (opaque)
+			v = vorrq_u32(v, amask);
+		if (vminvq_u32(vandq_u32(v, amask)) != 0xff000000) {
+			a = vshrq_n_u32(v, 24);
+			half = vshrq_n_u32(a, 1);
+			zero = vceqq_u32(a, vdupq_n_u32(0));
+			af = vcvtq_f32_u32(vmaxq_u32(a, vdupq_n_u32(1)));
+			r = neon_unpremul_ch(vandq_u32(vshrq_n_u32(v, 16), ff), half, af);
+			g = neon_unpremul_ch(vandq_u32(vshrq_n_u32(v, 8), ff), half, af);
+			b = neon_unpremul_ch(vandq_u32(v, ff), half, af);
+			v = vorrq_u32(vshlq_n_u32(a, 24),
+				vorrq_u32(vshlq_n_u32(r, 16),
+					vorrq_u32(vshlq_n_u32(g, 8), b)));
+			v = vbicq_u32(v, zero);
+		}
+		if (swap)
+			v = neon_swap_rb(v);
+		vst1q_u8(dst + x * 4, vreinterpretq_u8_u32(v));
+	}
+	unpremul_scalar(src + x, dst + x * 4, n - x, swap, opaque);
+}
+
+static void
+premul_neon(const unsigned char *src, uint32_t *dst, int n, int swap, int opaque)
+{
+	uint8x16x4_t px;
+	uint8x16_t tmp;
+	uint8x8_t l, h;
+	uint16x8_t t;
+	int x, i;
+
+	/* de-interleaved 16 pixels at a time: one plane per byte position */
+	for (x = 0; x + 16 <= n; x += 16) {
+		px = vld4q_u8(src + x * 4);
+		if (swap) {
+			tmp = px.val[0];
+			px.val[0] = px.val[2];
+			px.val[2] = tmp;
+		}
+		if (opaque)
+			px.val[3] = vdupq_n_u8(0xff);
+		for (i = 0; i < 3; ++i) {
+			t = vmlal_u8(vdupq_n_u16(0x80), vget_low_u8(px.val[i]), vget_low_u8(px.val[3]));
+			l = vshrn_n_u16(vsraq_n_u16(t, t, 8), 8);
+			t = vmlal_u8(vdupq_n_u16(0x80), vget_high_u8(px.val[i]), vget_high_u8(px.val[3]));
+			h = vshrn_n_u16(vsraq_n_u16(t, t, 8), 8);
+			px.val[i] = vcombine_u8(l, h);
+		}
+		vst4q_u8((uint8_t *)(dst + x), px);
+	}
+	premul_scalar(src + x * 4, dst + x, n - x, swap, opaque);
+}
+
+static const struct px_kernels kernels_neon = {
+	unpremul_neon, premul_neon
+};
+
+#endif /* CONVERT_NEON */
+
+static const struct px_kernels *kernels = &kernels_scalar;
+
+/*
+ * Picks the widest kernels this CPU runs, from load and set_simd/1. The
+ * table is published with one atomic store and each conversion loads it
+ * once, so a call racing a switch runs wholly on one set or the other.
+ */
+void
+convert_init(int use_simd)
+{
+	const struct px_kernels *k = &kernels_scalar;
+
+	if (use_simd) {
+#ifdef CONVERT_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			k = &kernels_avx2;
+		else if (__builtin_cpu_supports("sse2"))
+			k = &kernels_sse2;
+#elif defined(CONVERT_NEON)
+		k = &kernels_neon;
+#endif
+	}
+	__atomic_store_n(&kernels, k, __ATOMIC_RELEASE);
+}
+
+/* cairo image rows -> tightly packed straight-alpha rows in dst */
+int
+convert_from_cairo(const unsigned char *src, int stride, int w, int h, int opaque,
+    enum px_layout layout, unsigned char *dst)
+{
+	const struct px_kernels *k = __atomic_load_n(&kernels, __ATOMIC_ACQUIRE);
+	unsigned char *row = NULL, *p;
+	int x, y;
+
+	if (layout == PX_RGB && (row = enif_alloc((size_t)w * 4)) == NULL)
+		return 0;
+
+	for (y = 0; y < h; ++y, src += stride) {
+		if (layout != PX_RGB) {
+			k->unpremul((const uint32_t *)src, dst, w, layout == PX_RGBA, opaque);
+			dst += (size_t)w * 4;
+			continue;
+		}
+		k->unpremul((const uint32_t *)src, row, w, 1, opaque);
+		for (x = 0, p = row; x < w; ++x, p += 4, dst += 3) {
+			dst[0] = p[0];
+			dst[1] = p[1];
+			dst[2] = p[2];
+		}
+	}
+
+	if (row != NULL)
+		enif_free(row);
+	return 1;
+}
+
+/* tightly packed straight-alpha rows -> cairo image rows in dst */
+int
+convert_to_cairo(const unsigned char *src, enum px_layout layout, int w, int h, int opaque,
+    unsigned char *dst, int stride)
+{
+	const struct px_kernels *k = __atomic_load_n(&kernels, __ATOMIC_ACQUIRE);
+	unsigned char *row = NULL, *p;
+	int x, y;
+
+	if (layout == PX_RGB && (row = enif_alloc((size_t)w * 4)) == NULL)
+		return 0;
+
+	for (y = 0; y < h; ++y, dst += stride) {
+		if (layout != PX_RGB) {
+			k->premul(src, (uint32_t *)dst, w, layout == PX_RGBA, opaque);
+			src += (size_t)w * 4;
+			continue;
+		}
+		for (x = 0, p = row; x < w; ++x, p += 4, src += 3) {
+			p[0] = src[0];
+			p[1] = src[1];
+			p[2] = src[2];
+			p[3] = 0xff;
+		}
+		k->premul(row, (uint32_t *)dst, w, 1, 1);
+	}
+
+	if (row != NULL)
+		enif_free(row);
+	return 1;
+}
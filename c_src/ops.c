@@ -28,74 +28,157 @@
 %%
 */
 
+
 #include "common.h"
 
+static int
+decode_value(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM term, struct op_value *val)
+{
+	if (enif_get_double(env, term, &val->v_dbl)) {
+		val->type = VAL_DOUBLE;
+		return 1;
+	} else if (enif_is_atom(env, term)) {
+		val->type = VAL_TAG;
+		val->slot = program_tag_slot(prog, term);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+decode_tag(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM term, int *slot)
+{
+	if (!enif_is_atom(env, term))
+		return 0;
+	*slot = program_tag_slot(prog, term);
+	return 1;
+}
+
+static int
+decode_text(ErlNifEnv *env, const ERL_NIF_TERM term, const char **text)
+{
+	ErlNifBinary textbin;
+
+	memset(&textbin, 0, sizeof(textbin));
+	if (!enif_inspect_binary(env, term, &textbin)) {
+		if (!enif_inspect_iolist_as_binary(env, term, &textbin)) {
+			return 0;
+		}
+	}
+	if (textbin.size == 0 || textbin.data[textbin.size-1] != 0)
+		return 0;
+
+	*text = (const char *)textbin.data;
+	return 1;
+}
+
+static int
+decode_flag(ErlNifEnv *env, const ERL_NIF_TERM list, const ERL_NIF_TERM atom)
+{
+	ERL_NIF_TERM head, tail;
+	int found = 0;
+
+	tail = list;
+	while (enif_get_list_cell(env, tail, &head, &tail)) {
+		if (enif_is_identical(head, atom)) {
+			found = 1;
+		}
+	}
+	return found;
+}
+
+static enum op_return
+decode_none(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
+{
+	return OP_OK;
+}
+
 static enum op_return
-handle_op_arc(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+decode_values(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
+{
+	int i;
+
+	for (i = 0; i < in->handler->argc; ++i) {
+		if (!decode_value(env, prog, argv[i], &in->val[i]))
+			return ERR_BAD_ARGS;
+	}
+	return OP_OK;
+}
+
+static enum op_return
+decode_path_to(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
+{
+	if (!decode_value(env, prog, argv[0], &in->val[0]))
+		return ERR_BAD_ARGS;
+	if (!decode_value(env, prog, argv[1], &in->val[1]))
+		return ERR_BAD_ARGS;
+	if (decode_flag(env, argv[2], prog->priv->atom_relative))
+		in->flags |= OP_FLAG_RELATIVE;
+	return OP_OK;
+}
+
+static enum op_return
+decode_preserve(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
+{
+	if (decode_flag(env, argv[0], prog->priv->atom_preserve))
+		in->flags |= OP_FLAG_PRESERVE;
+	return OP_OK;
+}
+
+static enum op_return
+handle_op_arc(struct context *ctx, const struct op_instr *in)
 {
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 5)
-		return ERR_BAD_ARGS;
 	return OP_OK;
 }
 
 static enum op_return
-handle_op_new_sub_path(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_new_sub_path(struct context *ctx, const struct op_instr *in)
 {
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 0)
-		return ERR_BAD_ARGS;
 	cairo_new_sub_path(ctx->cairo);
 	return OP_OK;
 }
 
 static enum op_return
-handle_op_new_path(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_new_path(struct context *ctx, const struct op_instr *in)
 {
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 0)
-		return ERR_BAD_ARGS;
 	cairo_new_path(ctx->cairo);
 	return OP_OK;
 }
 
 static enum op_return
-handle_op_close_path(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_close_path(struct context *ctx, const struct op_instr *in)
 {
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 0)
-		return ERR_BAD_ARGS;
 	cairo_close_path(ctx->cairo);
 	return OP_OK;
 }
 
 static enum op_return
-handle_op_identity_matrix(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_identity_matrix(struct context *ctx, const struct op_instr *in)
 {
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 0)
-		return ERR_BAD_ARGS;
 	cairo_identity_matrix(ctx->cairo);
 	return OP_OK;
 }
 
 static enum op_return
-handle_op_translate(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_translate(struct context *ctx, const struct op_instr *in)
 {
 	double x, y;
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 2)
-		return ERR_BAD_ARGS;
 
-	if (!get_tag_double(env, ctx, argv[0], &x))
+	if (!get_value(ctx, &in->val[0], &x))
 		return ERR_BAD_ARGS;
-	if (!get_tag_double(env, ctx, argv[1], &y))
+	if (!get_value(ctx, &in->val[1], &y))
 		return ERR_BAD_ARGS;
 
 	cairo_translate(ctx->cairo, x, y);
@@ -104,17 +187,15 @@ handle_op_translate(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *arg
 }
 
 static enum op_return
-handle_op_scale(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_scale(struct context *ctx, const struct op_instr *in)
 {
 	double x, y;
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 2)
-		return ERR_BAD_ARGS;
 
-	if (!get_tag_double(env, ctx, argv[0], &x))
+	if (!get_value(ctx, &in->val[0], &x))
 		return ERR_BAD_ARGS;
-	if (!get_tag_double(env, ctx, argv[1], &y))
+	if (!get_value(ctx, &in->val[1], &y))
 		return ERR_BAD_ARGS;
 
 	cairo_scale(ctx->cairo, x, y);
@@ -123,22 +204,20 @@ handle_op_scale(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, i
 }
 
 static enum op_return
-handle_op_rectangle(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_rectangle(struct context *ctx, const struct op_instr *in)
 {
 	double x, y, w, h;
 
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 4)
-		return ERR_BAD_ARGS;
 
-	if (!get_tag_double(env, ctx, argv[0], &x))
+	if (!get_value(ctx, &in->val[0], &x))
 		return ERR_BAD_ARGS;
-	if (!get_tag_double(env, ctx, argv[1], &y))
+	if (!get_value(ctx, &in->val[1], &y))
 		return ERR_BAD_ARGS;
-	if (!get_tag_double(env, ctx, argv[2], &w))
+	if (!get_value(ctx, &in->val[2], &w))
 		return ERR_BAD_ARGS;
-	if (!get_tag_double(env, ctx, argv[3], &h))
+	if (!get_value(ctx, &in->val[3], &h))
 		return ERR_BAD_ARGS;
 
 	cairo_rectangle(ctx->cairo, x, y, w, h);
@@ -146,30 +225,19 @@ handle_op_rectangle(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *arg
 }
 
 static enum op_return
-handle_op_move_to(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_move_to(struct context *ctx, const struct op_instr *in)
 {
 	double x, y;
-	int relative = 0;
-	ERL_NIF_TERM head, tail, relatom;
 
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 3)
-		return ERR_BAD_ARGS;
 
-	if (!get_tag_double(env, ctx, argv[0], &x))
+	if (!get_value(ctx, &in->val[0], &x))
 		return ERR_BAD_ARGS;
-	if (!get_tag_double(env, ctx, argv[1], &y))
+	if (!get_value(ctx, &in->val[1], &y))
 		return ERR_BAD_ARGS;
 
-	relatom = enif_make_atom(env, "relative");
-	tail = argv[2];
-	while (enif_get_list_cell(env, tail, &head, &tail)) {
-		if (enif_is_identical(head, relatom)) {
-			relative = 1;
-		}
-	}
-	if (relative) {
+	if (in->flags & OP_FLAG_RELATIVE) {
 		cairo_rel_move_to(ctx->cairo, x, y);
 	} else {
 		cairo_move_to(ctx->cairo, x, y);
@@ -178,30 +246,19 @@ handle_op_move_to(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv,
 }
 
 static enum op_return
-handle_op_line_to(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_line_to(struct context *ctx, const struct op_instr *in)
 {
 	double x, y;
-	int relative = 0;
-	ERL_NIF_TERM head, tail, relatom;
 
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 3)
-		return ERR_BAD_ARGS;
 
-	if (!get_tag_double(env, ctx, argv[0], &x))
+	if (!get_value(ctx, &in->val[0], &x))
 		return ERR_BAD_ARGS;
-	if (!get_tag_double(env, ctx, argv[1], &y))
+	if (!get_value(ctx, &in->val[1], &y))
 		return ERR_BAD_ARGS;
 
-	relatom = enif_make_atom(env, "relative");
-	tail = argv[2];
-	while (enif_get_list_cell(env, tail, &head, &tail)) {
-		if (enif_is_identical(head, relatom)) {
-			relative = 1;
-		}
-	}
-	if (relative) {
+	if (in->flags & OP_FLAG_RELATIVE) {
 		cairo_rel_line_to(ctx->cairo, x, y);
 	} else {
 		cairo_line_to(ctx->cairo, x, y);
@@ -210,45 +267,37 @@ handle_op_line_to(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv,
 }
 
 static enum op_return
-handle_op_set_source_rgba(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+decode_op_set_source_rgba(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
+{
+	int i;
+
+	/* colour components are literals only, never tags */
+	for (i = 0; i < 4; ++i) {
+		if (!enif_get_double(env, argv[i], &in->val[i].v_dbl))
+			return ERR_BAD_ARGS;
+		in->val[i].type = VAL_DOUBLE;
+	}
+	return OP_OK;
+}
+
+static enum op_return
+handle_op_set_source_rgba(struct context *ctx, const struct op_instr *in)
 {
-	double r, g, b, a;
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 4)
-		return ERR_BAD_ARGS;
-
-	if (!enif_get_double(env, argv[0], &r))
-		return ERR_BAD_ARGS;
-	if (!enif_get_double(env, argv[1], &g))
-		return ERR_BAD_ARGS;
-	if (!enif_get_double(env, argv[2], &b))
-		return ERR_BAD_ARGS;
-	if (!enif_get_double(env, argv[3], &a))
-		return ERR_BAD_ARGS;
 
-	cairo_set_source_rgba(ctx->cairo, r, g, b, a);
+	cairo_set_source_rgba(ctx->cairo, in->val[0].v_dbl, in->val[1].v_dbl,
+		in->val[2].v_dbl, in->val[3].v_dbl);
 
 	return OP_OK;
 }
 
 static enum op_return
-handle_op_clip(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_clip(struct context *ctx, const struct op_instr *in)
 {
-	ERL_NIF_TERM head, tail, psatom;
-	int preserve = 0;
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 1)
-		return ERR_BAD_ARGS;
-	psatom = enif_make_atom(env, "preserve");
-	tail = argv[0];
-	while (enif_get_list_cell(env, tail, &head, &tail)) {
-		if (enif_is_identical(head, psatom)) {
-			preserve = 1;
-		}
-	}
-	if (preserve) {
+	if (in->flags & OP_FLAG_PRESERVE) {
 		cairo_clip_preserve(ctx->cairo);
 	} else {
 		cairo_clip(ctx->cairo);
@@ -257,43 +306,48 @@ handle_op_clip(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, in
 }
 
 static enum op_return
-handle_op_paint(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+decode_op_paint(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
 {
-	ERL_NIF_TERM udatom;
-	double alpha;
+	if (enif_is_identical(argv[0], prog->priv->atom_undefined))
+		return OP_OK;
+	if (!enif_get_double(env, argv[0], &in->val[0].v_dbl))
+		return ERR_BAD_ARGS;
+	in->val[0].type = VAL_DOUBLE;
+	in->flags |= OP_FLAG_ALPHA;
+	return OP_OK;
+}
+
+static enum op_return
+handle_op_paint(struct context *ctx, const struct op_instr *in)
+{
+	double x0, y0, x1, y1;
+
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 1)
-		return ERR_BAD_ARGS;
-	udatom = enif_make_atom(env, "undefined");
-	if (enif_is_identical(argv[0], udatom)) {
-		cairo_paint(ctx->cairo);
-		return OP_OK;
+	if (ctx->track_damage) {
+		cairo_clip_extents(ctx->cairo, &x0, &y0, &x1, &y1);
+		damage_user_rect(ctx, x0, y0, x1, y1);
+	}
+	if (in->flags & OP_FLAG_ALPHA) {
+		cairo_paint_with_alpha(ctx->cairo, in->val[0].v_dbl);
 	} else {
-		if (!enif_get_double(env, argv[0], &alpha))
-			return ERR_BAD_ARGS;
-		cairo_paint_with_alpha(ctx->cairo, alpha);
-		return OP_OK;
+		cairo_paint(ctx->cairo);
 	}
+	return OP_OK;
 }
 
 static enum op_return
-handle_op_stroke(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_stroke(struct context *ctx, const struct op_instr *in)
 {
-	ERL_NIF_TERM head, tail, psatom;
-	int preserve = 0;
+	double x0, y0, x1, y1;
+
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 1)
-		return ERR_BAD_ARGS;
-	psatom = enif_make_atom(env, "preserve");
-	tail = argv[0];
-	while (enif_get_list_cell(env, tail, &head, &tail)) {
-		if (enif_is_identical(head, psatom)) {
-			preserve = 1;
-		}
+	if (ctx->track_damage) {
+		cairo_stroke_extents(ctx->cairo, &x0, &y0, &x1, &y1);
+		damage_user_rect(ctx, x0, y0, x1, y1);
 	}
-	if (preserve) {
+	if (in->flags & OP_FLAG_PRESERVE) {
 		cairo_stroke_preserve(ctx->cairo);
 	} else {
 		cairo_stroke(ctx->cairo);
@@ -302,22 +356,17 @@ handle_op_stroke(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv,
 }
 
 static enum op_return
-handle_op_fill(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_fill(struct context *ctx, const struct op_instr *in)
 {
-	ERL_NIF_TERM head, tail, psatom;
-	int preserve = 0;
+	double x0, y0, x1, y1;
+
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 1)
-		return ERR_BAD_ARGS;
-	psatom = enif_make_atom(env, "preserve");
-	tail = argv[0];
-	while (enif_get_list_cell(env, tail, &head, &tail)) {
-		if (enif_is_identical(head, psatom)) {
-			preserve = 1;
-		}
+	if (ctx->track_damage) {
+		cairo_fill_extents(ctx->cairo, &x0, &y0, &x1, &y1);
+		damage_user_rect(ctx, x0, y0, x1, y1);
 	}
-	if (preserve) {
+	if (in->flags & OP_FLAG_PRESERVE) {
 		cairo_fill_preserve(ctx->cairo);
 	} else {
 		cairo_fill(ctx->cairo);
@@ -326,15 +375,13 @@ handle_op_fill(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, in
 }
 
 static enum op_return
-handle_op_set_line_width(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_set_line_width(struct context *ctx, const struct op_instr *in)
 {
 	double lw;
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 1)
-		return ERR_BAD_ARGS;
 
-	if (!get_tag_double(env, ctx, argv[0], &lw))
+	if (!get_value(ctx, &in->val[0], &lw))
 		return ERR_BAD_ARGS;
 
 	cairo_set_line_width(ctx->cairo, lw);
@@ -342,128 +389,171 @@ handle_op_set_line_width(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM
 }
 
 static enum op_return
-handle_op_set_tag(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+decode_op_set_tag(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
+{
+	if (!decode_tag(env, prog, argv[0], &in->slot[0]))
+		return ERR_BAD_ARGS;
+	if (!decode_value(env, prog, argv[1], &in->val[0]))
+		return ERR_BAD_ARGS;
+	return OP_OK;
+}
+
+static enum op_return
+handle_op_set_tag(struct context *ctx, const struct op_instr *in)
 {
 	double val;
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 2)
+
+	if (!get_value(ctx, &in->val[0], &val))
 		return ERR_BAD_ARGS;
 
-	if (!get_tag_double(env, ctx, argv[1], &val))
+	return set_tag_double(ctx, in->slot[0], val);
+}
+
+static enum op_return
+decode_op_pattern_create_for_surface(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
+{
+	if (!decode_tag(env, prog, argv[0], &in->slot[0]))
+		return ERR_BAD_ARGS;
+	if (!create_surface_from_image(env, prog->priv, argv[1], &in->sfc, NULL))
 		return ERR_BAD_ARGS;
+	return OP_OK;
+}
+
+/* the resource's surface is shared, not copied: the instr just holds a reference */
+static enum op_return
+decode_op_pattern_create_for_resource(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
+{
+	struct image_res *img;
 
-	return set_tag_double(env, ctx, argv[0], val);
+	if (!decode_tag(env, prog, argv[0], &in->slot[0]))
+		return ERR_BAD_ARGS;
+	if (!enif_get_resource(env, argv[1], prog->priv->image_rsrc, (void **)&img))
+		return ERR_BAD_ARGS;
+	in->sfc = cairo_surface_reference(img->sfc);
+	return OP_OK;
 }
 
 static enum op_return
-handle_op_pattern_create_for_surface(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_pattern_create_for_surface(struct context *ctx, const struct op_instr *in)
 {
-	cairo_surface_t *sfc = NULL;
 	cairo_pattern_t *ptn = NULL;
 
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 2)
-		return ERR_BAD_ARGS;
 
-	if (!create_surface_from_image(env, argv[1], &sfc, NULL))
-		return ERR_FAILURE;
-
-	ptn = cairo_pattern_create_for_surface(sfc);
+	ptn = cairo_pattern_create_for_surface(in->sfc);
 	if (cairo_pattern_status(ptn) != CAIRO_STATUS_SUCCESS) {
-		cairo_surface_destroy(sfc);
+		cairo_pattern_destroy(ptn);
 		return ERR_FAILURE;
 	}
 
-	cairo_surface_destroy(sfc);
+	return set_tag_ptr(ctx, in->slot[0], TAG_PATTERN, ptn);
+}
 
-	return set_tag_ptr(env, ctx, argv[0], TAG_PATTERN, ptn);
+static enum op_return
+decode_op_text_extents(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
+{
+	if (!decode_tag(env, prog, argv[0], &in->slot[0]))
+		return ERR_BAD_ARGS;
+	if (!decode_text(env, argv[1], &in->text))
+		return ERR_BAD_ARGS;
+	in->ext = prog->n_text_exts++;
+	return OP_OK;
 }
 
 static enum op_return
-handle_op_text_extents(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_text_extents(struct context *ctx, const struct op_instr *in)
 {
 	cairo_text_extents_t *exts = NULL;
-	ErlNifBinary textbin;
 
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 2)
-		return ERR_BAD_ARGS;
 
-	memset(&textbin, 0, sizeof(textbin));
-	if (!enif_inspect_binary(env, argv[1], &textbin)) {
-		if (!enif_inspect_iolist_as_binary(env, argv[1], &textbin)) {
-			return ERR_BAD_ARGS;
-		}
-	}
-	if (textbin.data[textbin.size-1] != 0)
-		return ERR_BAD_ARGS;
-
-	exts = enif_alloc(sizeof(*exts));
-	assert(exts != NULL);
+	exts = &ctx->text_exts[in->ext];
 	memset(exts, 0, sizeof(*exts));
 
-	cairo_text_extents(ctx->cairo, (const char *)textbin.data, exts);
+	cairo_text_extents(ctx->cairo, in->text, exts);
+
+	return set_tag_ptr(ctx, in->slot[0], TAG_TEXT_EXTENTS, exts);
+}
 
-	return set_tag_ptr(env, ctx, argv[0], TAG_TEXT_EXTENTS, exts);
+static enum op_return
+decode_op_font_extents(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
+{
+	if (!decode_tag(env, prog, argv[0], &in->slot[0]))
+		return ERR_BAD_ARGS;
+	in->ext = prog->n_font_exts++;
+	return OP_OK;
 }
 
 static enum op_return
-handle_op_font_extents(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_font_extents(struct context *ctx, const struct op_instr *in)
 {
 	cairo_font_extents_t *exts = NULL;
 
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 1)
-		return ERR_BAD_ARGS;
 
-	exts = enif_alloc(sizeof(*exts));
-	assert(exts != NULL);
+	exts = &ctx->font_exts[in->ext];
 	memset(exts, 0, sizeof(*exts));
 
 	cairo_font_extents(ctx->cairo, exts);
 
-	return set_tag_ptr(env, ctx, argv[0], TAG_FONT_EXTENTS, exts);
+	return set_tag_ptr(ctx, in->slot[0], TAG_FONT_EXTENTS, exts);
 }
 
 static enum op_return
-handle_op_show_text(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+decode_op_show_text(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
 {
-	ErlNifBinary textbin;
+	if (!decode_text(env, argv[0], &in->text))
+		return ERR_BAD_ARGS;
+	return OP_OK;
+}
+
+static enum op_return
+handle_op_show_text(struct context *ctx, const struct op_instr *in)
+{
+	cairo_text_extents_t te;
+	double x, y;
 
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 1)
-		return ERR_BAD_ARGS;
 
-	memset(&textbin, 0, sizeof(textbin));
-	if (!enif_inspect_binary(env, argv[0], &textbin)) {
-		if (!enif_inspect_iolist_as_binary(env, argv[0], &textbin)) {
-			return ERR_BAD_ARGS;
-		}
+	if (ctx->track_damage) {
+		/* glyph ink can stray a little past the extents, so pad by a pixel */
+		cairo_text_extents(ctx->cairo, in->text, &te);
+		x = y = 0;
+		if (cairo_has_current_point(ctx->cairo))
+			cairo_get_current_point(ctx->cairo, &x, &y);
+		x += te.x_bearing;
+		y += te.y_bearing;
+		damage_user_rect(ctx, x - 1, y - 1, x + te.width + 1, y + te.height + 1);
 	}
-	if (textbin.data[textbin.size-1] != 0)
-		return ERR_BAD_ARGS;
 
-	cairo_show_text(ctx->cairo, (const char *)textbin.data);
+	cairo_show_text(ctx->cairo, in->text);
 
 	return OP_OK;
 }
 
 static enum op_return
-handle_op_set_source(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+decode_op_set_source(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
+{
+	if (!decode_tag(env, prog, argv[0], &in->slot[0]))
+		return ERR_BAD_ARGS;
+	return OP_OK;
+}
+
+static enum op_return
+handle_op_set_source(struct context *ctx, const struct op_instr *in)
 {
 	cairo_pattern_t *ptn = NULL;
 
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 1)
-		return ERR_BAD_ARGS;
 
-	ptn = (cairo_pattern_t *)get_tag_ptr(env, ctx, TAG_PATTERN, argv[0]);
+	ptn = (cairo_pattern_t *)get_tag_ptr(ctx, TAG_PATTERN, in->slot[0]);
 	if (ptn == NULL)
 		return ERR_BAD_ARGS;
 
@@ -473,7 +563,19 @@ handle_op_set_source(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *ar
 }
 
 static enum op_return
-handle_op_pattern_translate(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+decode_op_pattern_translate(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
+{
+	if (!decode_tag(env, prog, argv[0], &in->slot[0]))
+		return ERR_BAD_ARGS;
+	if (!decode_value(env, prog, argv[1], &in->val[0]))
+		return ERR_BAD_ARGS;
+	if (!decode_value(env, prog, argv[2], &in->val[1]))
+		return ERR_BAD_ARGS;
+	return OP_OK;
+}
+
+static enum op_return
+handle_op_pattern_translate(struct context *ctx, const struct op_instr *in)
 {
 	cairo_pattern_t *ptn = NULL;
 	double x, y;
@@ -481,15 +583,13 @@ handle_op_pattern_translate(ErlNifEnv *env, struct context *ctx, const ERL_NIF_T
 
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 3)
-		return ERR_BAD_ARGS;
 
-	if (!get_tag_double(env, ctx, argv[1], &x))
+	if (!get_value(ctx, &in->val[0], &x))
 		return ERR_BAD_ARGS;
-	if (!get_tag_double(env, ctx, argv[2], &y))
+	if (!get_value(ctx, &in->val[1], &y))
 		return ERR_BAD_ARGS;
 
-	ptn = (cairo_pattern_t *)get_tag_ptr(env, ctx, TAG_PATTERN, argv[0]);
+	ptn = (cairo_pattern_t *)get_tag_ptr(ctx, TAG_PATTERN, in->slot[0]);
 	if (ptn == NULL)
 		return ERR_BAD_ARGS;
 
@@ -501,16 +601,14 @@ handle_op_pattern_translate(ErlNifEnv *env, struct context *ctx, const ERL_NIF_T
 }
 
 static enum op_return
-handle_op_set_font_size(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_set_font_size(struct context *ctx, const struct op_instr *in)
 {
 	double size;
 
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 1)
-		return ERR_BAD_ARGS;
 
-	if (!get_tag_double(env, ctx, argv[0], &size))
+	if (!get_value(ctx, &in->val[0], &size))
 		return ERR_BAD_ARGS;
 
 	cairo_set_font_size(ctx->cairo, size);
@@ -518,20 +616,11 @@ handle_op_set_font_size(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM
 }
 
 static enum op_return
-handle_op_select_font_face(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+decode_op_select_font_face(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
 {
-	char facebuf[256];
 	ErlNifBinary facebin;
-	cairo_font_slant_t slant;
-	cairo_font_weight_t weight;
-
-	if (ctx->cairo == NULL)
-		return ERR_NOT_INIT;
-	if (argc != 3)
-		return ERR_BAD_ARGS;
 
 	memset(&facebin, 0, sizeof(facebin));
-	memset(facebuf, 0, sizeof(facebuf));
 
 	/* get the font family name */
 	if (!enif_inspect_binary(env, argv[0], &facebin)) {
@@ -539,86 +628,140 @@ handle_op_select_font_face(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TE
 			return ERR_BAD_ARGS;
 		}
 	}
-	assert(facebin.size < sizeof(facebuf) - 1);
-	memcpy(facebuf, facebin.data, facebin.size);
-	facebuf[facebin.size] = 0;
-
-	if (enif_is_identical(argv[1], enif_make_atom(env, "normal"))) {
-		slant = CAIRO_FONT_SLANT_NORMAL;
-	} else if (enif_is_identical(argv[1], enif_make_atom(env, "italic"))) {
-		slant = CAIRO_FONT_SLANT_ITALIC;
-	} else if (enif_is_identical(argv[1], enif_make_atom(env, "oblique"))) {
-		slant = CAIRO_FONT_SLANT_OBLIQUE;
+	if (facebin.size >= 255)
+		return ERR_BAD_ARGS;
+
+	if (enif_is_identical(argv[1], prog->priv->atom_normal)) {
+		in->mode[0] = CAIRO_FONT_SLANT_NORMAL;
+	} else if (enif_is_identical(argv[1], prog->priv->atom_italic)) {
+		in->mode[0] = CAIRO_FONT_SLANT_ITALIC;
+	} else if (enif_is_identical(argv[1], prog->priv->atom_oblique)) {
+		in->mode[0] = CAIRO_FONT_SLANT_OBLIQUE;
 	} else {
 		return ERR_BAD_ARGS;
 	}
 
-	if (enif_is_identical(argv[2], enif_make_atom(env, "normal"))) {
-		weight = CAIRO_FONT_WEIGHT_NORMAL;
-	} else if (enif_is_identical(argv[2], enif_make_atom(env, "bold"))) {
-		weight = CAIRO_FONT_WEIGHT_BOLD;
+	if (enif_is_identical(argv[2], prog->priv->atom_normal)) {
+		in->mode[1] = CAIRO_FONT_WEIGHT_NORMAL;
+	} else if (enif_is_identical(argv[2], prog->priv->atom_bold)) {
+		in->mode[1] = CAIRO_FONT_WEIGHT_BOLD;
 	} else {
 		return ERR_BAD_ARGS;
 	}
 
-	cairo_select_font_face(ctx->cairo, facebuf, slant, weight);
+	in->face = program_alloc(prog, facebin.size + 1);
+	memcpy(in->face, facebin.data, facebin.size);
+	in->face[facebin.size] = 0;
 
 	return OP_OK;
 }
 
 static enum op_return
-handle_op_tag_deref(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+handle_op_select_font_face(struct context *ctx, const struct op_instr *in)
 {
-	struct tag_node node;
-	struct tag_node *found;
-	double val;
-
 	if (ctx->cairo == NULL)
 		return ERR_NOT_INIT;
-	if (argc != 3)
+
+	cairo_select_font_face(ctx->cairo, in->face,
+		(cairo_font_slant_t)in->mode[0], (cairo_font_weight_t)in->mode[1]);
+
+	return OP_OK;
+}
+
+static enum op_return
+decode_op_tag_deref(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
+{
+	if (!decode_tag(env, prog, argv[0], &in->slot[0]))
+		return ERR_BAD_ARGS;
+	if (!decode_tag(env, prog, argv[2], &in->slot[1]))
+		return ERR_BAD_ARGS;
+
+	if (enif_is_identical(argv[1], prog->priv->atom_x_bearing)) {
+		in->mode[0] = FIELD_X_BEARING;
+	} else if (enif_is_identical(argv[1], prog->priv->atom_y_bearing)) {
+		in->mode[0] = FIELD_Y_BEARING;
+	} else if (enif_is_identical(argv[1], prog->priv->atom_width)) {
+		in->mode[0] = FIELD_WIDTH;
+	} else if (enif_is_identical(argv[1], prog->priv->atom_height)) {
+		in->mode[0] = FIELD_HEIGHT;
+	} else if (enif_is_identical(argv[1], prog->priv->atom_x_advance)) {
+		in->mode[0] = FIELD_X_ADVANCE;
+	} else if (enif_is_identical(argv[1], prog->priv->atom_y_advance)) {
+		in->mode[0] = FIELD_Y_ADVANCE;
+	} else if (enif_is_identical(argv[1], prog->priv->atom_ascent)) {
+		in->mode[0] = FIELD_ASCENT;
+	} else if (enif_is_identical(argv[1], prog->priv->atom_descent)) {
+		in->mode[0] = FIELD_DESCENT;
+	} else if (enif_is_identical(argv[1], prog->priv->atom_max_x_advance)) {
+		in->mode[0] = FIELD_MAX_X_ADVANCE;
+	} else if (enif_is_identical(argv[1], prog->priv->atom_max_y_advance)) {
+		in->mode[0] = FIELD_MAX_Y_ADVANCE;
+	} else {
 		return ERR_BAD_ARGS;
+	}
+	return OP_OK;
+}
+
+static enum op_return
+handle_op_tag_deref(struct context *ctx, const struct op_instr *in)
+{
+	struct tag_slot *found;
+	double val;
 
-	memset(&node, 0, sizeof(node));
-	node.tag = argv[0];
+	if (ctx->cairo == NULL)
+		return ERR_NOT_INIT;
 
-	found = RB_FIND(tag_tree, &ctx->tag_head, &node);
-	if (found == NULL)
+	found = &ctx->slots[in->slot[0]];
+	if (found->type == TAG_NONE)
 		return ERR_TAG_NOT_SET;
 
 	switch (found->type) {
 		case TAG_TEXT_EXTENTS:
-			if (enif_is_identical(argv[1], enif_make_atom(env, "x_bearing"))) {
-				val = found->v_text_exts->x_bearing;
-			} else if (enif_is_identical(argv[1], enif_make_atom(env, "y_bearing"))) {
-				val = found->v_text_exts->y_bearing;
-			} else if (enif_is_identical(argv[1], enif_make_atom(env, "width"))) {
-				val = found->v_text_exts->width;
-			} else if (enif_is_identical(argv[1], enif_make_atom(env, "height"))) {
-				val = found->v_text_exts->height;
-			} else if (enif_is_identical(argv[1], enif_make_atom(env, "x_advance"))) {
-				val = found->v_text_exts->x_advance;
-			} else if (enif_is_identical(argv[1], enif_make_atom(env, "y_advance"))) {
-				val = found->v_text_exts->y_advance;
-			} else {
-				return ERR_BAD_ARGS;
+			switch (in->mode[0]) {
+				case FIELD_X_BEARING:
+					val = found->v_text_exts->x_bearing;
+					break;
+				case FIELD_Y_BEARING:
+					val = found->v_text_exts->y_bearing;
+					break;
+				case FIELD_WIDTH:
+					val = found->v_text_exts->width;
+					break;
+				case FIELD_HEIGHT:
+					val = found->v_text_exts->height;
+					break;
+				case FIELD_X_ADVANCE:
+					val = found->v_text_exts->x_advance;
+					break;
+				case FIELD_Y_ADVANCE:
+					val = found->v_text_exts->y_advance;
+					break;
+				default:
+					return ERR_BAD_ARGS;
 			}
-			return set_tag_double(env, ctx, argv[2], val);
+			return set_tag_double(ctx, in->slot[1], val);
 
 		case TAG_FONT_EXTENTS:
-			if (enif_is_identical(argv[1], enif_make_atom(env, "ascent"))) {
-				val = found->v_font_exts->ascent;
-			} else if (enif_is_identical(argv[1], enif_make_atom(env, "descent"))) {
-				val = found->v_font_exts->descent;
-			} else if (enif_is_identical(argv[1], enif_make_atom(env, "height"))) {
-				val = found->v_font_exts->height;
-			} else if (enif_is_identical(argv[1], enif_make_atom(env, "max_x_advance"))) {
-				val = found->v_font_exts->max_x_advance;
-			} else if (enif_is_identical(argv[1], enif_make_atom(env, "max_y_advance"))) {
-				val = found->v_font_exts->max_y_advance;
-			} else {
-				return ERR_BAD_ARGS;
+			switch (in->mode[0]) {
+				case FIELD_ASCENT:
+					val = found->v_font_exts->ascent;
+					break;
+				case FIELD_DESCENT:
+					val = found->v_font_exts->descent;
+					break;
+				case FIELD_HEIGHT:
+					val = found->v_font_exts->height;
+					break;
+				case FIELD_MAX_X_ADVANCE:
+					val = found->v_font_exts->max_x_advance;
+					break;
+				case FIELD_MAX_Y_ADVANCE:
+					val = found->v_font_exts->max_y_advance;
+					break;
+				default:
+					return ERR_BAD_ARGS;
 			}
-			return set_tag_double(env, ctx, argv[2], val);
+			return set_tag_double(ctx, in->slot[1], val);
 
 		default:
 			return ERR_BAD_ARGS;
@@ -626,79 +769,84 @@ handle_op_tag_deref(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *arg
 }
 
 static enum op_return
-handle_op_set_aa(ErlNifEnv *env, struct context *ctx, const ERL_NIF_TERM *argv, int argc)
+decode_op_set_aa(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM *argv, struct op_instr *in)
 {
-	struct aa_mode { ERL_NIF_TERM atom; cairo_antialias_t mode; };
-	int i;
-	cairo_antialias_t *mode = NULL;
-	struct aa_mode modes[] = {
-		{enif_make_atom(env, "default"), CAIRO_ANTIALIAS_DEFAULT},
-		{enif_make_atom(env, "gray"), CAIRO_ANTIALIAS_GRAY},
-		{enif_make_atom(env, "fast"), CAIRO_ANTIALIAS_FAST},
-		{enif_make_atom(env, "good"), CAIRO_ANTIALIAS_GOOD},
-		{enif_make_atom(env, "best"), CAIRO_ANTIALIAS_BEST}
-	};
-	if (ctx->cairo == NULL)
-		return ERR_NOT_INIT;
-	if (argc != 1)
+	if (enif_is_identical(argv[0], prog->priv->atom_default)) {
+		in->mode[0] = CAIRO_ANTIALIAS_DEFAULT;
+	} else if (enif_is_identical(argv[0], prog->priv->atom_gray)) {
+		in->mode[0] = CAIRO_ANTIALIAS_GRAY;
+	} else if (enif_is_identical(argv[0], prog->priv->atom_fast)) {
+		in->mode[0] = CAIRO_ANTIALIAS_FAST;
+	} else if (enif_is_identical(argv[0], prog->priv->atom_good)) {
+		in->mode[0] = CAIRO_ANTIALIAS_GOOD;
+	} else if (enif_is_identical(argv[0], prog->priv->atom_best)) {
+		in->mode[0] = CAIRO_ANTIALIAS_BEST;
+	} else {
 		return ERR_BAD_ARGS;
-
-	for (i = 0; i < (sizeof(modes) / sizeof(*modes)); ++i) {
-		if (enif_is_identical(argv[0], modes[i].atom)) {
-			mode = &modes[i].mode;
-		}
 	}
-	if (mode == NULL)
-		return ERR_BAD_ARGS;
+	return OP_OK;
+}
 
-	cairo_set_antialias(ctx->cairo, *mode);
+static enum op_return
+handle_op_set_aa(struct context *ctx, const struct op_instr *in)
+{
+	if (ctx->cairo == NULL)
+		return ERR_NOT_INIT;
+
+	cairo_set_antialias(ctx->cairo, (cairo_antialias_t)in->mode[0]);
 
 	return OP_OK;
 }
 
+/*
+ * The index of each entry is also its opcode in the binary op stream, and
+ * the sig field describes its operands there (see program.c), so new ops
+ * must only ever be added at the end. Ops that rasterise are marked so
+ * draw can estimate its cost.
+ */
 struct op_handler op_handlers[] = {
 	/* path operations */
-	{"cairo_arc", handle_op_arc},
-	{"cairo_rectangle", handle_op_rectangle},
-	{"cairo_new_path", handle_op_new_path},
-	{"cairo_new_sub_path", handle_op_new_sub_path},
-	{"cairo_line_to", handle_op_line_to},
-	{"cairo_move_to", handle_op_move_to},
-	{"cairo_close_path", handle_op_close_path},
+	{"cairo_arc", OPC_ARC, 5, 0, "vvvvv", decode_values, handle_op_arc},
+	{"cairo_rectangle", OPC_RECTANGLE, 4, 0, "vvvv", decode_values, handle_op_rectangle},
+	{"cairo_new_path", OPC_NEW_PATH, 0, 0, "", decode_none, handle_op_new_path},
+	{"cairo_new_sub_path", OPC_NEW_SUB_PATH, 0, 0, "", decode_none, handle_op_new_sub_path},
+	{"cairo_line_to", OPC_LINE_TO, 3, 0, "vvf", decode_path_to, handle_op_line_to},
+	{"cairo_move_to", OPC_MOVE_TO, 3, 0, "vvf", decode_path_to, handle_op_move_to},
+	{"cairo_close_path", OPC_CLOSE_PATH, 0, 0, "", decode_none, handle_op_close_path},
 
 	/* rendering operations */
-	{"cairo_set_line_width", handle_op_set_line_width},
-	{"cairo_set_source", handle_op_set_source},
-	{"cairo_set_source_rgba", handle_op_set_source_rgba},
-	{"cairo_set_antialias", handle_op_set_aa},
+	{"cairo_set_line_width", OPC_SET_LINE_WIDTH, 1, 0, "v", decode_values, handle_op_set_line_width},
+	{"cairo_set_source", OPC_SET_SOURCE, 1, 0, "t", decode_op_set_source, handle_op_set_source},
+	{"cairo_set_source_rgba", OPC_SET_SOURCE_RGBA, 4, 0, "dddd", decode_op_set_source_rgba, handle_op_set_source_rgba},
+	{"cairo_set_antialias", OPC_SET_ANTIALIAS, 1, 0, "A", decode_op_set_aa, handle_op_set_aa},
 	/*{"cairo_set_fill_rule", handle_op_set_fill_rule},*/
-	{"cairo_clip", handle_op_clip},
-	{"cairo_stroke", handle_op_stroke},
-	{"cairo_fill", handle_op_fill},
-	{"cairo_paint", handle_op_paint},
+	{"cairo_clip", OPC_CLIP, 1, 0, "f", decode_preserve, handle_op_clip},
+	{"cairo_stroke", OPC_STROKE, 1, 1, "f", decode_preserve, handle_op_stroke},
+	{"cairo_fill", OPC_FILL, 1, 1, "f", decode_preserve, handle_op_fill},
+	{"cairo_paint", OPC_PAINT, 1, 1, "a", decode_op_paint, handle_op_paint},
 
 	/* pattern operations */
 	/*{"cairo_pattern_create_linear", handle_op_pattern_create_linear},*/
 	/*{"cairo_pattern_add_color_stop_rgba", handle_op_pattern_add_color_stop_rgba},*/
-	{"cairo_pattern_create_for_surface", handle_op_pattern_create_for_surface},
-	{"cairo_pattern_translate", handle_op_pattern_translate},
+	{"cairo_pattern_create_for_surface", OPC_PATTERN_CREATE_FOR_SURFACE, 2, 0, "ti", decode_op_pattern_create_for_surface, handle_op_pattern_create_for_surface},
+	{"cairo_pattern_create_for_resource", OPC_NONE, 2, 0, "tR", decode_op_pattern_create_for_resource, handle_op_pattern_create_for_surface},
+	{"cairo_pattern_translate", OPC_PATTERN_TRANSLATE, 3, 0, "tvv", decode_op_pattern_translate, handle_op_pattern_translate},
 
 	/* transform operations */
-	{"cairo_identity_matrix", handle_op_identity_matrix},
-	{"cairo_translate", handle_op_translate},
-	{"cairo_scale", handle_op_scale},
+	{"cairo_identity_matrix", OPC_IDENTITY_MATRIX, 0, 0, "", decode_none, handle_op_identity_matrix},
+	{"cairo_translate", OPC_TRANSLATE, 2, 0, "vv", decode_values, handle_op_translate},
+	{"cairo_scale", OPC_SCALE, 2, 0, "vv", decode_values, handle_op_scale},
 	/*{"cairo_rotate", handle_op_rotate},*/
 
 	/* text operations */
-	{"cairo_text_extents", handle_op_text_extents},
-	{"cairo_font_extents", handle_op_font_extents},
-	{"cairo_select_font_face", handle_op_select_font_face},
-	{"cairo_set_font_size", handle_op_set_font_size},
-	{"cairo_show_text", handle_op_show_text},
+	{"cairo_text_extents", OPC_TEXT_EXTENTS, 2, 0, "tse", decode_op_text_extents, handle_op_text_extents},
+	{"cairo_font_extents", OPC_FONT_EXTENTS, 1, 0, "tE", decode_op_font_extents, handle_op_font_extents},
+	{"cairo_select_font_face", OPC_SELECT_FONT_FACE, 3, 0, "SLW", decode_op_select_font_face, handle_op_select_font_face},
+	{"cairo_set_font_size", OPC_SET_FONT_SIZE, 1, 0, "v", decode_values, handle_op_set_font_size},
+	{"cairo_show_text", OPC_SHOW_TEXT, 1, 1, "s", decode_op_show_text, handle_op_show_text},
 
 	/* tag ops */
-	{"cairo_set_tag", handle_op_set_tag},
-	{"cairo_tag_deref", handle_op_tag_deref}
+	{"cairo_set_tag", OPC_SET_TAG, 2, 0, "tv", decode_op_set_tag, handle_op_set_tag},
+	{"cairo_tag_deref", OPC_TAG_DEREF, 3, 0, "tDt", decode_op_tag_deref, handle_op_tag_deref}
 };
 const int n_handlers = sizeof(op_handlers) / sizeof(struct op_handler);
-
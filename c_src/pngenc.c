@@ -0,0 +1,248 @@
+/*
+%%
+%% cairo erlang binding
+%%
+%% Copyright (c) 2014, The University of Queensland
+%% Author: Alex Wilson <alex@uq.edu.au>
+%%
+%% Redistribution and use in source and binary forms, with or without
+%% modification, are permitted provided that the following conditions are met:
+%%
+%%  * Redistributions of source code must retain the above copyright notice,
+%%    this list of conditions and the following disclaimer.
+%%  * Redistributions in binary form must reproduce the above copyright notice,
+%%    this list of conditions and the following disclaimer in the documentation
+%%    and/or other materials provided with the distribution.
+%%
+%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+%% AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+%% IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+%% ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+%% LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+%% CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF
+%% SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR  BUSINESS
+%% INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+%% CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+%% ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+%% POSSIBILITY OF SUCH DAMAGE.
+%%
+*/
+
+
+#include <setjmp.h>
+#include <png.h>
+#include <zlib.h>
+
+#include "common.h"
+
+/*
+ * png_encode/2 drives libpng directly rather than going through
+ * cairo_surface_write_to_png_stream, which always uses libpng's default
+ * zlib level and adaptive filtering. Pixels are converted a row at a time
+ * the same way cairo's own writer does it (premultiplied native-endian
+ * ARGB to straight RGBA through the convert.c kernels, RGB24 to RGB), so
+ * both paths give the same image.
+ */
+
+/* png_encode/2 options: [{level, 0..9} | {filter, F} | {strategy, S}] */
+int
+get_png_opts(ErlNifEnv *env, struct cairerl_priv *priv, const ERL_NIF_TERM list, struct png_opts *opts, ERL_NIF_TERM *err)
+{
+	const ERL_NIF_TERM *tuple;
+	ERL_NIF_TERM head, tail;
+	int arity;
+
+	opts->level = -1;
+	opts->filter = -1;
+	opts->strategy = -1;
+
+	tail = list;
+	while (enif_get_list_cell(env, tail, &head, &tail)) {
+		if (!enif_get_tuple(env, head, &arity, &tuple) || arity != 2)
+			goto bad;
+
+		if (enif_is_identical(tuple[0], priv->atom_level)) {
+			if (!enif_get_int(env, tuple[1], &opts->level) ||
+			    opts->level < 0 || opts->level > 9)
+				goto bad;
+		} else if (enif_is_identical(tuple[0], priv->atom_filter)) {
+			if (enif_is_identical(tuple[1], priv->atom_none))
+				opts->filter = PNG_FILTER_NONE;
+			else if (enif_is_identical(tuple[1], priv->atom_sub))
+				opts->filter = PNG_FILTER_SUB;
+			else if (enif_is_identical(tuple[1], priv->atom_up))
+				opts->filter = PNG_FILTER_UP;
+			else if (enif_is_identical(tuple[1], priv->atom_paeth))
+				opts->filter = PNG_FILTER_PAETH;
+			else if (enif_is_identical(tuple[1], priv->atom_adaptive))
+				opts->filter = PNG_ALL_FILTERS;
+			else
+				goto bad;
+		} else if (enif_is_identical(tuple[0], priv->atom_strategy)) {
+			if (enif_is_identical(tuple[1], priv->atom_default))
+				opts->strategy = Z_DEFAULT_STRATEGY;
+			else if (enif_is_identical(tuple[1], priv->atom_rle))
+				opts->strategy = Z_RLE;
+			else
+				goto bad;
+		} else {
+			goto bad;
+		}
+	}
+	if (!enif_is_empty_list(env, tail)) {
+		*err = enif_make_atom(env, "bad_options");
+		return 0;
+	}
+	return 1;
+
+bad:
+	*err = enif_make_tuple2(env, enif_make_atom(env, "bad_option"), head);
+	return 0;
+}
+
+struct png_sink {
+	ErlNifBinary *bin;
+	size_t len;
+};
+
+static void
+png_sink_write(png_structp png, png_bytep data, png_size_t length)
+{
+	struct png_sink *ps = png_get_io_ptr(png);
+	size_t need = ps->len + length, cap;
+
+	if (need > ps->bin->size) {
+		cap = ps->bin->size * 2;
+		if (cap < need)
+			cap = need;
+		if (!enif_realloc_binary(ps->bin, cap))
+			png_error(png, "out of memory");
+	}
+	memcpy(ps->bin->data + ps->len, data, length);
+	ps->len += length;
+}
+
+static void
+png_sink_flush(png_structp png)
+{
+}
+
+static void
+rgb24_row(const uint32_t *src, png_bytep dst, int w)
+{
+	uint32_t px;
+	int x;
+
+	for (x = 0; x < w; ++x, dst += 3) {
+		px = src[x];
+		dst[0] = px >> 16;
+		dst[1] = px >> 8;
+		dst[2] = px;
+	}
+}
+
+/*
+ * Encodes sfc into a new binary in *out (trimmed to the PNG's length).
+ * Formats other than ARGB32 and RGB24 are first converted to RGB24 by
+ * cairo, as cairo's writer does for them.
+ */
+int
+png_encode_surface(ErlNifEnv *env, cairo_surface_t *sfc, const struct png_opts *opts, ErlNifBinary *out, ERL_NIF_TERM *err)
+{
+	png_structp png = NULL;
+	png_infop info = NULL;
+	struct png_sink ps;
+	cairo_surface_t *conv = NULL;
+	cairo_t *cr;
+	png_bytep row = NULL;
+	const unsigned char *data;
+	cairo_format_t fmt;
+	int w, h, y, stride, alpha;
+
+	memset(out, 0, sizeof(*out));
+
+	cairo_surface_flush(sfc);
+	fmt = cairo_image_surface_get_format(sfc);
+	w = cairo_image_surface_get_width(sfc);
+	h = cairo_image_surface_get_height(sfc);
+	if (fmt != CAIRO_FORMAT_ARGB32 && fmt != CAIRO_FORMAT_RGB24) {
+		conv = cairo_image_surface_create(CAIRO_FORMAT_RGB24, w, h);
+		cr = cairo_create(conv);
+		cairo_set_source_surface(cr, sfc, 0, 0);
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+		cairo_paint(cr);
+		cairo_destroy(cr);
+		cairo_surface_flush(conv);
+		if (cairo_surface_status(conv) != CAIRO_STATUS_SUCCESS) {
+			*err = enif_make_atom(env, "no_memory");
+			goto fail;
+		}
+		sfc = conv;
+		fmt = CAIRO_FORMAT_RGB24;
+	}
+	alpha = (fmt == CAIRO_FORMAT_ARGB32);
+	data = cairo_image_surface_get_data(sfc);
+	stride = cairo_image_surface_get_stride(sfc);
+
+	/* compressed output is usually well under a quarter of the raw pixels */
+	row = enif_alloc((size_t)w * 4);
+	if (row == NULL || !enif_alloc_binary((size_t)h * stride / 4 + 1024, out)) {
+		*err = enif_make_atom(env, "no_memory");
+		goto fail;
+	}
+	ps.bin = out;
+	ps.len = 0;
+
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (png != NULL)
+		info = png_create_info_struct(png);
+	if (info == NULL) {
+		*err = enif_make_atom(env, "no_memory");
+		goto fail;
+	}
+	if (setjmp(png_jmpbuf(png))) {
+		*err = enif_make_atom(env, "png_error");
+		goto fail;
+	}
+
+	png_set_write_fn(png, &ps, png_sink_write, png_sink_flush);
+	if (opts->level >= 0)
+		png_set_compression_level(png, opts->level);
+	if (opts->strategy >= 0)
+		png_set_compression_strategy(png, opts->strategy);
+	if (opts->filter >= 0)
+		png_set_filter(png, PNG_FILTER_TYPE_BASE, opts->filter);
+
+	png_set_IHDR(png, info, w, h, 8,
+		alpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	png_write_info(png, info);
+
+	for (y = 0; y < h; ++y) {
+		if (alpha)
+			convert_from_cairo(data + (size_t)y * stride, stride, w, 1, 0, PX_RGBA, row);
+		else
+			rgb24_row((const uint32_t *)(data + (size_t)y * stride), row, w);
+		png_write_row(png, row);
+	}
+	png_write_end(png, info);
+	png_destroy_write_struct(&png, &info);
+
+	enif_free(row);
+	if (conv != NULL)
+		cairo_surface_destroy(conv);
+	if (ps.len < out->size)
+		enif_realloc_binary(out, ps.len);
+	return 1;
+
+fail:
+	if (png != NULL)
+		png_destroy_write_struct(&png, info != NULL ? &info : NULL);
+	if (row != NULL)
+		enif_free(row);
+	if (conv != NULL)
+		cairo_surface_destroy(conv);
+	if (out->data != NULL)
+		enif_release_binary(out);
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+%%
+%% cairo erlang binding
+%%
+%% Copyright (c) 2014, The University of Queensland
+%% Author: Alex Wilson <alex@uq.edu.au>
+%%
+%% Redistribution and use in source and binary forms, with or without
+%% modification, are permitted provided that the following conditions are met:
+%%
+%%  * Redistributions of source code must retain the above copyright notice,
+%%    this list of conditions and the following disclaimer.
+%%  * Redistributions in binary form must reproduce the above copyright notice,
+%%    this list of conditions and the following disclaimer in the documentation
+%%    and/or other materials provided with the distribution.
+%%
+%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+%% AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+%% IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+%% ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+%% LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+%% CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF
+%% SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR  BUSINESS
+%% INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+%% CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+%% ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+%% POSSIBILITY OF SUCH DAMAGE.
+%%
+*/
+
+
+#include "common.h"
+
+/*
+ * A fixed set of native threads taking jobs off one FIFO. Jobs are pushed
+ * from NIF calls and never block the caller: when the queue is at its
+ * limit pool_push fails and the caller reports that back to Erlang.
+ */
+
+static void *
+pool_worker(void *arg)
+{
+	struct pool *pool = arg;
+	struct pool_job *job;
+
+	enif_mutex_lock(pool->lock);
+	for (;;) {
+		while (pool->head == NULL && !pool->shutdown)
+			enif_cond_wait(pool->cond, pool->lock);
+		/* drain whatever is queued before going away */
+		if (pool->head == NULL)
+			break;
+
+		job = pool->head;
+		pool->head = job->next;
+		if (pool->head == NULL)
+			pool->tail = NULL;
+		--pool->depth;
+		enif_mutex_unlock(pool->lock);
+
+		job->next = NULL;
+		job->run(job);
+
+		enif_mutex_lock(pool->lock);
+	}
+	enif_mutex_unlock(pool->lock);
+
+	return NULL;
+}
+
+int
+pool_init(struct pool *pool, int n_threads, int max_depth)
+{
+	ErlNifThreadOpts *opts;
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->max_depth = max_depth;
+
+	pool->lock = enif_mutex_create("cairerl_pool_lock");
+	pool->cond = enif_cond_create("cairerl_pool_cond");
+	pool->tids = enif_alloc(n_threads * sizeof(ErlNifTid));
+	if (pool->lock == NULL || pool->cond == NULL || pool->tids == NULL)
+		goto fail;
+
+	/* cairo and freetype want a good deal more than the default stack */
+	opts = enif_thread_opts_create("cairerl_pool_opts");
+	if (opts == NULL)
+		goto fail;
+	opts->suggested_stack_size = 256;
+
+	for (i = 0; i < n_threads; ++i) {
+		if (enif_thread_create("cairerl_pool", &pool->tids[i],
+		    pool_worker, pool, opts) != 0)
+			break;
+		++pool->n_threads;
+	}
+	enif_thread_opts_destroy(opts);
+
+	if (pool->n_threads != n_threads)
+		goto fail;
+
+	return 1;
+
+fail:
+	pool_destroy(pool);
+	return 0;
+}
+
+int
+pool_push(struct pool *pool, struct pool_job *job)
+{
+	enif_mutex_lock(pool->lock);
+	if (pool->depth >= pool->max_depth || pool->shutdown) {
+		enif_mutex_unlock(pool->lock);
+		return 0;
+	}
+
+	job->next = NULL;
+	if (pool->tail != NULL)
+		pool->tail->next = job;
+	else
+		pool->head = job;
+	pool->tail = job;
+	++pool->depth;
+
+	enif_cond_signal(pool->cond);
+	enif_mutex_unlock(pool->lock);
+
+	return 1;
+}
+
+void
+pool_destroy(struct pool *pool)
+{
+	int i;
+
+	if (pool->lock != NULL && pool->cond != NULL) {
+		enif_mutex_lock(pool->lock);
+		pool->shutdown = 1;
+		enif_cond_broadcast(pool->cond);
+		enif_mutex_unlock(pool->lock);
+	}
+
+	for (i = 0; i < pool->n_threads; ++i)
+		enif_thread_join(pool->tids[i], NULL);
+	pool->n_threads = 0;
+
+	if (pool->tids != NULL)
+		enif_free(pool->tids);
+	if (pool->cond != NULL)
+		enif_cond_destroy(pool->cond);
+	if (pool->lock != NULL)
+		enif_mutex_destroy(pool->lock);
+	memset(pool, 0, sizeof(*pool));
+}
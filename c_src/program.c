@@ -0,0 +1,777 @@
+/*
+%%
+%% cairo erlang binding
+%%
+%% Copyright (c) 2014, The University of Queensland
+%% Author: Alex Wilson <alex@uq.edu.au>
+%%
+%% Redistribution and use in source and binary forms, with or without
+%% modification, are permitted provided that the following conditions are met:
+%%
+%%  * Redistributions of source code must retain the above copyright notice,
+%%    this list of conditions and the following disclaimer.
+%%  * Redistributions in binary form must reproduce the above copyright notice,
+%%    this list of conditions and the following disclaimer in the documentation
+%%    and/or other materials provided with the distribution.
+%%
+%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+%% AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+%% IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+%% ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+%% LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+%% CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF
+%% SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR  BUSINESS
+%% INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+%% CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+%% ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+%% POSSIBILITY OF SUCH DAMAGE.
+%%
+*/
+
+
+#include <limits.h>
+
+#include "common.h"
+
+#define TAG_TABLE_MIN_BITS	4
+
+static void
+tag_table_insert(struct program *prog, int slot)
+{
+	unsigned int idx, mask;
+
+	mask = (1U << prog->tag_table_bits) - 1;
+	idx = atom_hash(prog->tags[slot], prog->tag_table_bits);
+	while (prog->tag_table[idx] != 0)
+		idx = (idx + 1) & mask;
+	prog->tag_table[idx] = slot + 1;
+}
+
+int
+program_find_tag(const struct program *prog, const ERL_NIF_TERM tag)
+{
+	unsigned int idx, mask;
+	int slot;
+
+	if (prog->tag_table == NULL)
+		return -1;
+
+	mask = (1U << prog->tag_table_bits) - 1;
+	idx = atom_hash(tag, prog->tag_table_bits);
+	while ((slot = prog->tag_table[idx]) != 0) {
+		if (prog->tags[slot - 1] == tag)
+			return slot - 1;
+		idx = (idx + 1) & mask;
+	}
+
+	return -1;
+}
+
+/* one-shot programs take their memory from the draw's arena */
+void *
+program_alloc(struct program *prog, size_t size)
+{
+	void *p;
+
+	if (prog->arena != NULL)
+		return arena_alloc(prog->arena, size);
+	p = enif_alloc(size);
+	assert(p != NULL);
+	return p;
+}
+
+static void *
+program_realloc(struct program *prog, void *old, size_t old_size, size_t size)
+{
+	void *p;
+
+	if (prog->arena != NULL)
+		return arena_realloc(prog->arena, old, old_size, size);
+	if (old == NULL)
+		p = enif_alloc(size);
+	else
+		p = enif_realloc(old, size);
+	assert(p != NULL);
+	return p;
+}
+
+static void
+program_free(struct program *prog, void *p)
+{
+	if (prog->arena == NULL && p != NULL)
+		enif_free(p);
+}
+
+/* returns the slot for a tag atom, giving it a new one if needed */
+int
+program_tag_slot(struct program *prog, const ERL_NIF_TERM tag)
+{
+	int slot, i;
+
+	if ((slot = program_find_tag(prog, tag)) != -1)
+		return slot;
+
+	/* keep the table at most half full */
+	if (prog->tag_table == NULL || (prog->n_tags + 1) * 2 > (1 << prog->tag_table_bits)) {
+		if (prog->tag_table == NULL)
+			prog->tag_table_bits = TAG_TABLE_MIN_BITS;
+		else
+			++prog->tag_table_bits;
+
+		program_free(prog, prog->tag_table);
+		prog->tag_table = program_alloc(prog, sizeof(int) << prog->tag_table_bits);
+		memset(prog->tag_table, 0, sizeof(int) << prog->tag_table_bits);
+
+		/* the slot -> atom array never needs to be bigger than half the table */
+		prog->tags = program_realloc(prog, prog->tags,
+			prog->n_tags * sizeof(ERL_NIF_TERM),
+			sizeof(ERL_NIF_TERM) << (prog->tag_table_bits - 1));
+
+		for (i = 0; i < prog->n_tags; ++i)
+			tag_table_insert(prog, i);
+	}
+
+	slot = prog->n_tags++;
+	prog->tags[slot] = tag;
+	tag_table_insert(prog, slot);
+
+	return slot;
+}
+
+enum op_return
+decode_op(ErlNifEnv *env, struct program *prog, const ERL_NIF_TERM op, struct op_instr *in)
+{
+	int arity;
+	const ERL_NIF_TERM *args;
+	const struct op_handler *h;
+
+	memset(in, 0, sizeof(*in));
+	in->op = op;
+
+	if (!enif_get_tuple(env, op, &arity, &args))
+		return ERR_NOT_TUPLE;
+	if (arity < 1 || !enif_is_atom(env, args[0]))
+		return ERR_NOT_ATOM;
+
+	/* atoms are unique immediates, so we can hash the term itself */
+	if ((h = op_table_find(env, prog->priv, args[0])) == NULL)
+		return ERR_UNKNOWN_OP;
+	if (arity - 1 != h->argc)
+		return ERR_BAD_ARGS;
+
+	in->handler = h;
+	return h->decode(env, prog, &args[1], in);
+}
+
+void
+op_instr_clear(struct program *prog, struct op_instr *in)
+{
+	if (in->face != NULL)
+		program_free(prog, in->face);
+	if (in->sfc != NULL)
+		cairo_surface_destroy(in->sfc);
+	in->face = NULL;
+	in->sfc = NULL;
+}
+
+void
+program_clear(struct program *prog)
+{
+	int i;
+
+	for (i = 0; i < prog->n_instrs; ++i)
+		op_instr_clear(prog, &prog->instrs[i]);
+	program_free(prog, prog->instrs);
+	program_free(prog, prog->tags);
+	program_free(prog, prog->tag_table);
+	prog->instrs = NULL;
+	prog->n_instrs = 0;
+	prog->n_raster = 0;
+	prog->tags = NULL;
+	prog->tag_table = NULL;
+	prog->n_tags = 0;
+	prog->n_text_exts = 0;
+	prog->n_font_exts = 0;
+}
+
+/*
+ * The binary op stream, as produced by cairerl:encode_ops/1:
+ *
+ *   stream := "CROP" version:8 ntags:16 tag{ntags} op*
+ *   tag    := len:8 name:len           (an existing atom's text, latin1)
+ *   op     := opcode:8 operand*        (opcode as in enum stream_opcode)
+ *
+ * All integers are unsigned and little-endian, floats are little-endian
+ * IEEE doubles. The operands of each op are given by its sig string:
+ *
+ *   v  a value: 0:8 float:64, or 1:8 tag:16
+ *   d  a literal float:64
+ *   t  tag:16
+ *   f  flags:8 (1 = relative, 2 = preserve)
+ *   a  paint alpha: 0:8, or 1:8 float:64
+ *   s  len:32 text:len, which must end with a NUL
+ *   S  len:32 name:len, shorter than 255 bytes
+ *   i  width:32 height:32 format:8 len:32 pixels:len, format one of
+ *      0 argb32, 1 rgb24, 4 rgb16_565, 5 rgb30
+ *   A  antialias mode:8: 0 default, 2 gray, 4 fast, 5 good, 6 best
+ *   L  font slant:8: 0 normal, 1 italic, 2 oblique
+ *   W  font weight:8: 0 normal, 1 bold
+ *   D  tag_deref field:8: 0 x_bearing, 1 y_bearing, 2 width, 3 height,
+ *      4 x_advance, 5 y_advance, 6 ascent, 7 descent, 8 max_x_advance,
+ *      9 max_y_advance
+ *   R  an image resource, which can't be put in a stream: ops taking one
+ *      only work in list form
+ *
+ * e and E read nothing; they reserve the op a text or font extents struct.
+ * Tags are referred to by their index in the header.
+ *
+ * The enum bytes are the stream's own, mapped to cairo's values below, so
+ * the format doesn't change if cairo's enums or op_handlers[] do.
+ */
+
+#define OPS_MAGIC	"CROP"
+#define OPS_VERSION	1
+
+struct stream {
+	const unsigned char *p;
+	const unsigned char *start;
+	const unsigned char *end;
+};
+
+static int
+stream_format(unsigned int b, cairo_format_t *fmt)
+{
+	switch (b) {
+		case 0: *fmt = CAIRO_FORMAT_ARGB32; break;
+		case 1: *fmt = CAIRO_FORMAT_RGB24; break;
+		case 4: *fmt = CAIRO_FORMAT_RGB16_565; break;
+		case 5: *fmt = CAIRO_FORMAT_RGB30; break;
+		default: return 0;
+	}
+	return 1;
+}
+
+static int
+stream_antialias(unsigned int b, int *mode)
+{
+	switch (b) {
+		case 0: *mode = CAIRO_ANTIALIAS_DEFAULT; break;
+		case 2: *mode = CAIRO_ANTIALIAS_GRAY; break;
+		case 4: *mode = CAIRO_ANTIALIAS_FAST; break;
+		case 5: *mode = CAIRO_ANTIALIAS_GOOD; break;
+		case 6: *mode = CAIRO_ANTIALIAS_BEST; break;
+		default: return 0;
+	}
+	return 1;
+}
+
+static const int stream_slants[] = {
+	CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_SLANT_ITALIC, CAIRO_FONT_SLANT_OBLIQUE
+};
+static const int stream_weights[] = {
+	CAIRO_FONT_WEIGHT_NORMAL, CAIRO_FONT_WEIGHT_BOLD
+};
+static const int stream_fields[] = {
+	FIELD_X_BEARING, FIELD_Y_BEARING, FIELD_WIDTH, FIELD_HEIGHT,
+	FIELD_X_ADVANCE, FIELD_Y_ADVANCE, FIELD_ASCENT, FIELD_DESCENT,
+	FIELD_MAX_X_ADVANCE, FIELD_MAX_Y_ADVANCE
+};
+
+#define N_ELEMS(a)	(sizeof(a) / sizeof((a)[0]))
+
+/* the handler for a stream opcode, or NULL */
+static const struct op_handler *
+stream_op(const struct cairerl_priv *priv, unsigned int opcode)
+{
+	if (opcode >= N_OPCODES)
+		return NULL;
+	return priv->stream_ops[opcode];
+}
+
+static int
+get_u8(struct stream *s, unsigned int *v)
+{
+	if (s->end - s->p < 1)
+		return 0;
+	*v = s->p[0];
+	s->p += 1;
+	return 1;
+}
+
+static int
+get_u16(struct stream *s, unsigned int *v)
+{
+	if (s->end - s->p < 2)
+		return 0;
+	*v = s->p[0] | (s->p[1] << 8);
+	s->p += 2;
+	return 1;
+}
+
+static int
+get_u32(struct stream *s, uint32_t *v)
+{
+	if (s->end - s->p < 4)
+		return 0;
+	*v = (uint32_t)s->p[0] | ((uint32_t)s->p[1] << 8) |
+		((uint32_t)s->p[2] << 16) | ((uint32_t)s->p[3] << 24);
+	s->p += 4;
+	return 1;
+}
+
+static int
+get_f64(struct stream *s, double *v)
+{
+	uint64_t u = 0;
+	int i;
+
+	if (s->end - s->p < 8)
+		return 0;
+	for (i = 7; i >= 0; --i)
+		u = (u << 8) | s->p[i];
+	memcpy(v, &u, sizeof(*v));
+	s->p += 8;
+	return 1;
+}
+
+static int
+get_bytes(struct stream *s, uint32_t len, const unsigned char **v)
+{
+	if ((size_t)(s->end - s->p) < len)
+		return 0;
+	*v = s->p;
+	s->p += len;
+	return 1;
+}
+
+static int
+get_tag(struct stream *s, const struct program *prog, int *slot)
+{
+	unsigned int idx;
+
+	if (!get_u16(s, &idx) || idx >= (unsigned int)prog->n_tags)
+		return 0;
+	/* header tags are given slots in order, so the index is the slot */
+	*slot = idx;
+	return 1;
+}
+
+static int
+get_image(struct stream *s, cairo_surface_t **sfc)
+{
+	uint32_t w, h, len;
+	unsigned int b;
+	cairo_format_t fmt;
+	const unsigned char *data;
+	int stride;
+
+	if (!get_u32(s, &w) || !get_u32(s, &h) || !get_u8(s, &b) || !get_u32(s, &len))
+		return 0;
+	if (!get_bytes(s, len, &data))
+		return 0;
+	if (w > 32768 || h > 32768)
+		return 0;
+	if (!stream_format(b, &fmt))
+		return 0;
+
+	stride = cairo_format_stride_for_width(fmt, w);
+	if ((uint64_t)stride * h > len)
+		return 0;
+
+	*sfc = cairo_image_surface_create_for_data((unsigned char *)data,
+		fmt, w, h, stride);
+	if (cairo_surface_status(*sfc) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(*sfc);
+		*sfc = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+static enum op_return
+decode_op_binary(ErlNifEnv *env, struct program *prog, struct stream *s, struct op_instr *in)
+{
+	const struct op_handler *h;
+	const char *c;
+	const unsigned char *data;
+	unsigned int opcode, b;
+	uint32_t len;
+	int nval = 0, nslot = 0, nmode = 0;
+
+	memset(in, 0, sizeof(*in));
+	in->op = enif_make_int(env, s->p - s->start);
+
+	if (!get_u8(s, &opcode))
+		return ERR_BAD_ARGS;
+	if ((h = stream_op(prog->priv, opcode)) == NULL)
+		return ERR_UNKNOWN_OP;
+	in->handler = h;
+
+	for (c = h->sig; *c != 0; ++c) {
+		switch (*c) {
+			case 'v':
+				if (!get_u8(s, &b))
+					return ERR_BAD_ARGS;
+				if (b == 0) {
+					in->val[nval].type = VAL_DOUBLE;
+					if (!get_f64(s, &in->val[nval].v_dbl))
+						return ERR_BAD_ARGS;
+				} else if (b == 1) {
+					in->val[nval].type = VAL_TAG;
+					if (!get_tag(s, prog, &in->val[nval].slot))
+						return ERR_BAD_ARGS;
+				} else {
+					return ERR_BAD_ARGS;
+				}
+				++nval;
+				break;
+			case 'd':
+				in->val[nval].type = VAL_DOUBLE;
+				if (!get_f64(s, &in->val[nval++].v_dbl))
+					return ERR_BAD_ARGS;
+				break;
+			case 't':
+				if (!get_tag(s, prog, &in->slot[nslot++]))
+					return ERR_BAD_ARGS;
+				break;
+			case 'f':
+				if (!get_u8(s, &b))
+					return ERR_BAD_ARGS;
+				in->flags |= b & (OP_FLAG_RELATIVE | OP_FLAG_PRESERVE);
+				break;
+			case 'a':
+				if (!get_u8(s, &b) || b > 1)
+					return ERR_BAD_ARGS;
+				if (b == 1) {
+					in->flags |= OP_FLAG_ALPHA;
+					in->val[nval].type = VAL_DOUBLE;
+					if (!get_f64(s, &in->val[nval++].v_dbl))
+						return ERR_BAD_ARGS;
+				}
+				break;
+			case 's':
+				if (!get_u32(s, &len) || !get_bytes(s, len, &data))
+					return ERR_BAD_ARGS;
+				if (len == 0 || data[len-1] != 0)
+					return ERR_BAD_ARGS;
+				in->text = (const char *)data;
+				break;
+			case 'S':
+				if (!get_u32(s, &len) || !get_bytes(s, len, &data))
+					return ERR_BAD_ARGS;
+				if (len >= 255)
+					return ERR_BAD_ARGS;
+				in->face = program_alloc(prog, len + 1);
+				memcpy(in->face, data, len);
+				in->face[len] = 0;
+				break;
+			case 'i':
+				if (!get_image(s, &in->sfc))
+					return ERR_BAD_ARGS;
+				break;
+			case 'A':
+				if (!get_u8(s, &b) || !stream_antialias(b, &in->mode[nmode++]))
+					return ERR_BAD_ARGS;
+				break;
+			case 'L':
+				if (!get_u8(s, &b) || b >= N_ELEMS(stream_slants))
+					return ERR_BAD_ARGS;
+				in->mode[nmode++] = stream_slants[b];
+				break;
+			case 'W':
+				if (!get_u8(s, &b) || b >= N_ELEMS(stream_weights))
+					return ERR_BAD_ARGS;
+				in->mode[nmode++] = stream_weights[b];
+				break;
+			case 'D':
+				if (!get_u8(s, &b) || b >= N_ELEMS(stream_fields))
+					return ERR_BAD_ARGS;
+				in->mode[nmode++] = stream_fields[b];
+				break;
+			case 'R':
+				return ERR_BAD_ARGS;
+			case 'e':
+				in->ext = prog->n_text_exts++;
+				break;
+			case 'E':
+				in->ext = prog->n_font_exts++;
+				break;
+			default:
+				assert(0);
+		}
+	}
+
+	return OP_OK;
+}
+
+/*
+ * Starts compiling an op list or binary stream, to be carried on with
+ * program_compile_some. Only the header of a stream (its tag names) is
+ * decoded here; the ops are left for later.
+ */
+enum op_return
+program_compile_start(ErlNifEnv *env, struct cairerl_priv *priv, const ERL_NIF_TERM ops, struct program *prog, struct program_cursor *cur, ERL_NIF_TERM *bad_op)
+{
+	ErlNifBinary bin;
+	struct stream s;
+	const unsigned char *data;
+	unsigned int version, ntags, len, i;
+	ERL_NIF_TERM tag;
+
+	prog->priv = priv;
+	prog->n_instrs = 0;
+	prog->instrs = NULL;
+	memset(cur, 0, sizeof(*cur));
+
+	if (!enif_inspect_binary(env, ops, &bin)) {
+		if (!enif_get_list_length(env, ops, &len))
+			return ERR_BAD_ARGS;
+		if (len > 0)
+			prog->instrs = program_alloc(prog, len * sizeof(struct op_instr));
+		cur->cap = len;
+		cur->rest = ops;
+		cur->done = (len == 0);
+		return OP_OK;
+	}
+
+	s.start = s.p = bin.data;
+	s.end = bin.data + bin.size;
+
+	*bad_op = enif_make_int(env, 0);
+	if (!get_bytes(&s, 4, &data) || memcmp(data, OPS_MAGIC, 4) != 0)
+		return ERR_BAD_ARGS;
+	if (!get_u8(&s, &version) || version != OPS_VERSION)
+		return ERR_BAD_ARGS;
+	if (!get_u16(&s, &ntags))
+		return ERR_BAD_ARGS;
+
+	for (i = 0; i < ntags; ++i) {
+		*bad_op = enif_make_int(env, s.p - s.start);
+		if (!get_u8(&s, &len) || !get_bytes(&s, len, &data)) {
+			program_clear(prog);
+			return ERR_BAD_ARGS;
+		}
+		/*
+		 * atoms are never freed, so a stream may only name ones that
+		 * exist already; duplicate names would break index == slot
+		 */
+		if (!enif_make_existing_atom_len(env, (const char *)data, len, &tag, ERL_NIF_LATIN1) ||
+		    program_tag_slot(prog, tag) != (int)i) {
+			program_clear(prog);
+			return ERR_BAD_ARGS;
+		}
+	}
+
+	cur->binary = 1;
+	cur->start = s.start;
+	cur->p = s.p;
+	cur->end = s.end;
+	cur->done = (s.p >= s.end);
+	return OP_OK;
+}
+
+/*
+ * Decodes up to max more ops into prog->instrs, setting cur->done once
+ * there are none left. On failure the offending op term (or a stream's
+ * byte offset) is returned in *bad_op, and prog is left empty.
+ */
+enum op_return
+program_compile_some(ErlNifEnv *env, struct program *prog, struct program_cursor *cur, int max, ERL_NIF_TERM *bad_op)
+{
+	struct op_instr *in;
+	struct stream s;
+	ERL_NIF_TERM head;
+	enum op_return ret;
+	int n;
+
+	s.start = cur->start;
+	s.p = cur->p;
+	s.end = cur->end;
+
+	for (n = 0; n < max && !cur->done; ++n) {
+		if (cur->binary) {
+			if (prog->n_instrs == cur->cap) {
+				cur->cap = (cur->cap == 0) ? 64 : cur->cap * 2;
+				prog->instrs = program_realloc(prog, prog->instrs,
+					prog->n_instrs * sizeof(struct op_instr),
+					cur->cap * sizeof(struct op_instr));
+			}
+			in = &prog->instrs[prog->n_instrs];
+			ret = decode_op_binary(env, prog, &s, in);
+			head = in->op;
+			cur->p = s.p;
+			cur->done = (s.p >= s.end);
+		} else {
+			if (!enif_get_list_cell(env, cur->rest, &head, &cur->rest)) {
+				cur->done = 1;
+				break;
+			}
+			in = &prog->instrs[prog->n_instrs];
+			ret = decode_op(env, prog, head, in);
+			cur->done = enif_is_empty_list(env, cur->rest);
+		}
+		if (ret != OP_OK) {
+			op_instr_clear(prog, in);
+			*bad_op = head;
+			program_clear(prog);
+			return ret;
+		}
+		if (in->handler->raster)
+			++prog->n_raster;
+		++prog->n_instrs;
+	}
+
+	return OP_OK;
+}
+
+/*
+ * Decode every op in the list into prog->instrs. On failure the offending
+ * op term is returned in *bad_op, and prog is left empty.
+ */
+enum op_return
+program_compile(ErlNifEnv *env, struct cairerl_priv *priv, const ERL_NIF_TERM ops, struct program *prog, ERL_NIF_TERM *bad_op)
+{
+	struct program_cursor cur;
+	enum op_return ret;
+
+	if (enif_is_binary(env, ops))
+		return ERR_BAD_ARGS;
+	if ((ret = program_compile_start(env, priv, ops, prog, &cur, bad_op)) != OP_OK)
+		return ret;
+	return program_compile_some(env, prog, &cur, INT_MAX, bad_op);
+}
+
+/*
+ * Like program_compile, but decodes a binary op stream. Errors give the
+ * byte offset of the bad op (or header) in *bad_op.
+ */
+enum op_return
+program_compile_binary(ErlNifEnv *env, struct cairerl_priv *priv, const ERL_NIF_TERM ops, struct program *prog, ERL_NIF_TERM *bad_op)
+{
+	struct program_cursor cur;
+	enum op_return ret;
+
+	prog->priv = priv;
+	prog->n_instrs = 0;
+	prog->instrs = NULL;
+	if (!enif_is_binary(env, ops))
+		return ERR_BAD_ARGS;
+	if ((ret = program_compile_start(env, priv, ops, prog, &cur, bad_op)) != OP_OK)
+		return ret;
+	return program_compile_some(env, prog, &cur, INT_MAX, bad_op);
+}
+
+/* steps over one op in a binary stream without decoding it */
+static int
+skip_op_binary(const struct cairerl_priv *priv, struct stream *s, const struct op_handler **h)
+{
+	const char *c;
+	const unsigned char *data;
+	unsigned int opcode, b;
+	uint32_t len;
+
+	if (!get_u8(s, &opcode) || (*h = stream_op(priv, opcode)) == NULL)
+		return 0;
+
+	for (c = (*h)->sig; *c != 0; ++c) {
+		switch (*c) {
+			case 'v':
+				if (!get_u8(s, &b))
+					return 0;
+				if (!get_bytes(s, (b == 0) ? 8 : 2, &data))
+					return 0;
+				break;
+			case 'd':
+				if (!get_bytes(s, 8, &data))
+					return 0;
+				break;
+			case 't':
+				if (!get_bytes(s, 2, &data))
+					return 0;
+				break;
+			case 'a':
+				if (!get_u8(s, &b))
+					return 0;
+				if (b == 1 && !get_bytes(s, 8, &data))
+					return 0;
+				break;
+			case 's':
+			case 'S':
+				if (!get_u32(s, &len) || !get_bytes(s, len, &data))
+					return 0;
+				break;
+			case 'i':
+				if (!get_bytes(s, 9, &data) || !get_u32(s, &len) ||
+				    !get_bytes(s, len, &data))
+					return 0;
+				break;
+			case 'f':
+			case 'A':
+			case 'L':
+			case 'W':
+			case 'D':
+				if (!get_bytes(s, 1, &data))
+					return 0;
+				break;
+			case 'R':
+				return 0;
+			default:
+				break;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Counts the ops in a list or binary stream, and how many of those
+ * rasterise, looking at no more than the op names. Used to guess how
+ * long a draw on a w x h surface will take before committing to decoding
+ * it, so the count stops as soon as the draw is known to be expensive.
+ */
+int
+program_scan(ErlNifEnv *env, struct cairerl_priv *priv, const ERL_NIF_TERM ops, int w, int h, unsigned int *n_ops, unsigned int *n_raster)
+{
+	ERL_NIF_TERM head, tail;
+	const ERL_NIF_TERM *args;
+	const struct op_handler *op;
+	ErlNifBinary bin;
+	struct stream s;
+	const unsigned char *data;
+	unsigned int ntags, len, i;
+	int arity;
+
+	*n_ops = 0;
+	*n_raster = 0;
+
+	if (enif_inspect_binary(env, ops, &bin)) {
+		s.start = s.p = bin.data;
+		s.end = bin.data + bin.size;
+		if (!get_bytes(&s, 5, &data) || !get_u16(&s, &ntags))
+			return 0;
+		for (i = 0; i < ntags; ++i) {
+			if (!get_u8(&s, &len) || !get_bytes(&s, len, &data))
+				return 0;
+		}
+		while (s.p < s.end) {
+			if (!skip_op_binary(priv, &s, &op))
+				return 0;
+			++*n_ops;
+			if (op->raster)
+				++*n_raster;
+			if (draw_is_expensive(w, h, *n_ops, *n_raster))
+				break;
+		}
+		return 1;
+	}
+
+	tail = ops;
+	while (enif_get_list_cell(env, tail, &head, &tail)) {
+		++*n_ops;
+		if (enif_get_tuple(env, head, &arity, &args) && arity >= 1 &&
+		    (op = op_table_find(env, priv, args[0])) != NULL && op->raster)
+			++*n_raster;
+		if (draw_is_expensive(w, h, *n_ops, *n_raster))
+			break;
+	}
+	return 1;
+}
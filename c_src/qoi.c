@@ -0,0 +1,299 @@
+/*
+%%
+%% cairo erlang binding
+%%
+%% Copyright (c) 2014, The University of Queensland
+%% Author: Alex Wilson <alex@uq.edu.au>
+%%
+%% Redistribution and use in source and binary forms, with or without
+%% modification, are permitted provided that the following conditions are met:
+%%
+%%  * Redistributions of source code must retain the above copyright notice,
+%%    this list of conditions and the following disclaimer.
+%%  * Redistributions in binary form must reproduce the above copyright notice,
+%%    this list of conditions and the following disclaimer in the documentation
+%%    and/or other materials provided with the distribution.
+%%
+%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+%% AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+%% IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+%% ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+%% LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+%% CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF
+%% SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR  BUSINESS
+%% INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+%% CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+%% ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+%% POSSIBILITY OF SUCH DAMAGE.
+%%
+*/
+
+
+#include "common.h"
+
+/*
+ * QOI ("Quite OK Image", qoiformat.org) encoding and decoding of cairo
+ * image data. QOI stores straight alpha, so ARGB32 rows go through the
+ * convert.c kernels to RGBA on the way out and are premultiplied again
+ * on the way in; RGB24 maps to a 3-channel QOI image.
+ */
+
+#define QOI_OP_INDEX	0x00
+#define QOI_OP_DIFF	0x40
+#define QOI_OP_LUMA	0x80
+#define QOI_OP_RUN	0xc0
+#define QOI_OP_RGB	0xfe
+#define QOI_OP_RGBA	0xff
+#define QOI_MASK_2	0xc0
+
+#define QOI_HEADER_SIZE	14
+#define QOI_PADDING	8
+
+static const unsigned char qoi_padding[QOI_PADDING] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+union qoi_px {
+	struct {
+		unsigned char r, g, b, a;
+	} c;
+	uint32_t v;
+};
+
+static inline int
+qoi_hash(union qoi_px px)
+{
+	return (px.c.r * 3 + px.c.g * 5 + px.c.b * 7 + px.c.a * 11) % 64;
+}
+
+static inline void
+put_u32be(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline uint32_t
+get_u32be(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+int
+qoi_encode_surface(ErlNifEnv *env, cairo_surface_t *sfc, ErlNifBinary *out, ERL_NIF_TERM *err)
+{
+	union qoi_px index[64], px, prev;
+	unsigned char *row = NULL, *p, *src;
+	cairo_format_t fmt;
+	int w, h, x, y, stride, channels, run = 0;
+	signed char vr, vg, vb, vg_r, vg_b;
+
+	memset(out, 0, sizeof(*out));
+
+	cairo_surface_flush(sfc);
+	fmt = cairo_image_surface_get_format(sfc);
+	if (fmt != CAIRO_FORMAT_ARGB32 && fmt != CAIRO_FORMAT_RGB24) {
+		*err = enif_make_atom(env, "unsupported_format");
+		goto fail;
+	}
+	channels = (fmt == CAIRO_FORMAT_ARGB32) ? 4 : 3;
+	w = cairo_image_surface_get_width(sfc);
+	h = cairo_image_surface_get_height(sfc);
+	stride = cairo_image_surface_get_stride(sfc);
+	src = cairo_image_surface_get_data(sfc);
+
+	/* worst case is an RGB(A) op for every pixel */
+	row = enif_alloc((size_t)w * 4);
+	if (row == NULL || !enif_alloc_binary(QOI_HEADER_SIZE +
+	    (size_t)w * h * (channels + 1) + QOI_PADDING, out)) {
+		*err = enif_make_atom(env, "no_memory");
+		goto fail;
+	}
+
+	p = out->data;
+	memcpy(p, "qoif", 4);
+	put_u32be(p + 4, w);
+	put_u32be(p + 8, h);
+	p[12] = channels;
+	p[13] = 0;			/* sRGB with linear alpha */
+	p += QOI_HEADER_SIZE;
+
+	memset(index, 0, sizeof(index));
+	prev.c.r = prev.c.g = prev.c.b = 0;
+	prev.c.a = 255;
+
+	for (y = 0; y < h; ++y, src += stride) {
+		convert_from_cairo(src, stride, w, 1, channels == 3, PX_RGBA, row);
+		for (x = 0; x < w; ++x) {
+			memcpy(&px.v, row + x * 4, 4);
+
+			if (px.v == prev.v) {
+				if (++run == 62) {
+					*p++ = QOI_OP_RUN | (run - 1);
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0) {
+				*p++ = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+
+			if (index[qoi_hash(px)].v == px.v) {
+				*p++ = QOI_OP_INDEX | qoi_hash(px);
+			} else if (px.c.a == prev.c.a) {
+				index[qoi_hash(px)] = px;
+				vr = px.c.r - prev.c.r;
+				vg = px.c.g - prev.c.g;
+				vb = px.c.b - prev.c.b;
+				vg_r = vr - vg;
+				vg_b = vb - vg;
+				if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+					*p++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+				} else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+				    vg_b > -9 && vg_b < 8) {
+					*p++ = QOI_OP_LUMA | (vg + 32);
+					*p++ = (vg_r + 8) << 4 | (vg_b + 8);
+				} else {
+					*p++ = QOI_OP_RGB;
+					*p++ = px.c.r;
+					*p++ = px.c.g;
+					*p++ = px.c.b;
+				}
+			} else {
+				index[qoi_hash(px)] = px;
+				*p++ = QOI_OP_RGBA;
+				*p++ = px.c.r;
+				*p++ = px.c.g;
+				*p++ = px.c.b;
+				*p++ = px.c.a;
+			}
+			prev = px;
+		}
+	}
+	if (run > 0)
+		*p++ = QOI_OP_RUN | (run - 1);
+	memcpy(p, qoi_padding, QOI_PADDING);
+	p += QOI_PADDING;
+
+	enif_free(row);
+	enif_realloc_binary(out, p - out->data);
+	return 1;
+
+fail:
+	if (row != NULL)
+		enif_free(row);
+	if (out->data != NULL)
+		enif_release_binary(out);
+	return 0;
+}
+
+/*
+ * Decodes a QOI image into a new binary of cairo ARGB32 (4 channels) or
+ * RGB24 (3 channels) rows. Truncated or corrupt data is an error rather
+ * than a short image.
+ */
+int
+qoi_decode_image(ErlNifEnv *env, const unsigned char *data, size_t size,
+    int *wp, int *hp, cairo_format_t *fmtp, ErlNifBinary *out, ERL_NIF_TERM *err)
+{
+	union qoi_px index[64], px;
+	unsigned char *row = NULL, *dst;
+	const unsigned char *p, *end;
+	uint32_t w, h;
+	int x, y, stride, run = 0, b1, b2, vg;
+	cairo_format_t fmt;
+
+	memset(out, 0, sizeof(*out));
+
+	if (size < QOI_HEADER_SIZE + QOI_PADDING || memcmp(data, "qoif", 4) != 0 ||
+	    (data[12] != 3 && data[12] != 4)) {
+		*err = enif_make_atom(env, "bad_qoi_header");
+		goto fail;
+	}
+	w = get_u32be(data + 4);
+	h = get_u32be(data + 8);
+	if (w == 0 || h == 0 || w > 32768 || h > 32768) {
+		*err = enif_make_atom(env, "bad_qoi_size");
+		goto fail;
+	}
+	/* no op covers more than 62 pixels, so don't allocate for a lie */
+	if ((uint64_t)(size - QOI_HEADER_SIZE - QOI_PADDING) * 62 < (uint64_t)w * h)
+		goto truncated;
+	fmt = (data[12] == 4) ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24;
+	stride = cairo_format_stride_for_width(fmt, w);
+
+	row = enif_alloc((size_t)w * 4);
+	if (row == NULL || !enif_alloc_binary((size_t)h * stride, out)) {
+		*err = enif_make_atom(env, "no_memory");
+		goto fail;
+	}
+
+	memset(index, 0, sizeof(index));
+	px.c.r = px.c.g = px.c.b = 0;
+	px.c.a = 255;
+	p = data + QOI_HEADER_SIZE;
+	end = data + size - QOI_PADDING;
+
+	for (y = 0, dst = out->data; y < (int)h; ++y, dst += stride) {
+		for (x = 0; x < (int)w; ++x) {
+			if (run > 0) {
+				--run;
+			} else {
+				if (p >= end)
+					goto truncated;
+				b1 = *p++;
+				if (b1 == QOI_OP_RGB) {
+					if (end - p < 3)
+						goto truncated;
+					px.c.r = p[0];
+					px.c.g = p[1];
+					px.c.b = p[2];
+					p += 3;
+				} else if (b1 == QOI_OP_RGBA) {
+					if (end - p < 4)
+						goto truncated;
+					px.c.r = p[0];
+					px.c.g = p[1];
+					px.c.b = p[2];
+					px.c.a = p[3];
+					p += 4;
+				} else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+					px = index[b1];
+				} else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+					px.c.r += ((b1 >> 4) & 3) - 2;
+					px.c.g += ((b1 >> 2) & 3) - 2;
+					px.c.b += (b1 & 3) - 2;
+				} else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+					if (p >= end)
+						goto truncated;
+					b2 = *p++;
+					vg = (b1 & 0x3f) - 32;
+					px.c.r += vg - 8 + ((b2 >> 4) & 0x0f);
+					px.c.g += vg;
+					px.c.b += vg - 8 + (b2 & 0x0f);
+				} else {
+					run = b1 & 0x3f;
+				}
+				index[qoi_hash(px)] = px;
+			}
+			memcpy(row + x * 4, &px.v, 4);
+		}
+		convert_to_cairo(row, PX_RGBA, w, 1, fmt == CAIRO_FORMAT_RGB24, dst, stride);
+	}
+
+	enif_free(row);
+	*wp = w;
+	*hp = h;
+	*fmtp = fmt;
+	return 1;
+
+truncated:
+	*err = enif_make_atom(env, "truncated_qoi_data");
+fail:
+	if (row != NULL)
+		enif_free(row);
+	if (out->data != NULL)
+		enif_release_binary(out);
+	return 0;
+}
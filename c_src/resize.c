@@ -0,0 +1,478 @@
+/*
+%%
+%% cairo erlang binding
+%%
+%% Copyright (c) 2014, The University of Queensland
+%% Author: Alex Wilson <alex@uq.edu.au>
+%%
+%% Redistribution and use in source and binary forms, with or without
+%% modification, are permitted provided that the following conditions are met:
+%%
+%%  * Redistributions of source code must retain the above copyright notice,
+%%    this list of conditions and the following disclaimer.
+%%  * Redistributions in binary form must reproduce the above copyright notice,
+%%    this list of conditions and the following disclaimer in the documentation
+%%    and/or other materials provided with the distribution.
+%%
+%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+%% AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+%% IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+%% ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+%% LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+%% CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF
+%% SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR  BUSINESS
+%% INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+%% CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+%% ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+%% POSSIBILITY OF SUCH DAMAGE.
+%%
+*/
+
+
+#include <math.h>
+
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RESIZE_X86	1
+#include <immintrin.h>
+#endif
+
+/*
+ * Separable resampling of 4-byte cairo pixels (ARGB32 or RGB24) for
+ * resize/4, and the 2x2 box halving behind mipmaps/2.
+ *
+ * Filtering works on the premultiplied values as they are, which is what
+ * makes edges against transparency come out right. A resize is a
+ * horizontal pass over every source row into a float buffer, then a
+ * vertical pass from that into the output. Each output column or row has
+ * its own run of normalised weights, widened by the scale factor when
+ * shrinking, so a box filter becomes an area average. Lanczos can ring
+ * past the ends of the range, so results are clamped to 0..255 and, for
+ * ARGB32, colour to at most alpha.
+ *
+ * The kernels add the taps in the same order as the scalar code and round
+ * the same way, so every kernel set gives the same bytes.
+ */
+
+struct coeffs {
+	int *start;		/* first source pixel for each output */
+	int *n;			/* number of taps for each output */
+	float *w;		/* max_n weights for each output */
+	int max_n;
+};
+
+struct resize_kernels {
+	void (*hpass)(const unsigned char *, float *, int, const struct coeffs *);
+	void (*vpass)(const float *, size_t, const float *, int, unsigned char *, int, int);
+};
+
+static double
+filter_box(double x)
+{
+	return (x > -0.5 && x <= 0.5) ? 1.0 : 0.0;
+}
+
+static double
+filter_bilinear(double x)
+{
+	x = fabs(x);
+	return (x < 1.0) ? 1.0 - x : 0.0;
+}
+
+static double
+sinc(double x)
+{
+	if (x == 0.0)
+		return 1.0;
+	x *= M_PI;
+	return sin(x) / x;
+}
+
+static double
+filter_lanczos(double x)
+{
+	return (x > -3.0 && x < 3.0) ? sinc(x) * sinc(x / 3.0) : 0.0;
+}
+
+static const struct {
+	double (*f)(double);
+	double support;
+} filters[] = {
+	[RESIZE_BOX] = { filter_box, 0.5 },
+	[RESIZE_BILINEAR] = { filter_bilinear, 1.0 },
+	[RESIZE_LANCZOS] = { filter_lanczos, 3.0 },
+};
+
+static void
+coeffs_free(struct coeffs *c)
+{
+	if (c->start != NULL)
+		enif_free(c->start);
+	if (c->n != NULL)
+		enif_free(c->n);
+	if (c->w != NULL)
+		enif_free(c->w);
+}
+
+static int
+coeffs_init(struct coeffs *c, int in_size, int out_size, enum resize_filter filter)
+{
+	double scale, fscale, support, center, ww, *k;
+	int i, x, xmin, xmax;
+
+	memset(c, 0, sizeof(*c));
+	scale = (double)in_size / out_size;
+	fscale = (scale > 1.0) ? scale : 1.0;
+	support = filters[filter].support * fscale;
+	c->max_n = (int)ceil(support) * 2 + 1;
+
+	c->start = enif_alloc(out_size * sizeof(int));
+	c->n = enif_alloc(out_size * sizeof(int));
+	c->w = enif_alloc((size_t)out_size * c->max_n * sizeof(float));
+	k = enif_alloc(c->max_n * sizeof(double));
+	if (c->start == NULL || c->n == NULL || c->w == NULL || k == NULL) {
+		if (k != NULL)
+			enif_free(k);
+		coeffs_free(c);
+		return 0;
+	}
+
+	for (i = 0; i < out_size; ++i) {
+		center = (i + 0.5) * scale;
+		xmin = (int)(center - support + 0.5);
+		if (xmin < 0)
+			xmin = 0;
+		xmax = (int)(center + support + 0.5);
+		if (xmax > in_size)
+			xmax = in_size;
+		xmax -= xmin;
+		if (xmax > c->max_n)
+			xmax = c->max_n;
+
+		ww = 0.0;
+		for (x = 0; x < xmax; ++x) {
+			k[x] = filters[filter].f((x + xmin - center + 0.5) / fscale);
+			ww += k[x];
+		}
+		/* nothing in reach (can't happen for sane sizes): nearest pixel */
+		if (xmax < 1 || ww == 0.0) {
+			xmin = (int)center;
+			if (xmin >= in_size)
+				xmin = in_size - 1;
+			xmax = 1;
+			k[0] = ww = 1.0;
+		}
+
+		c->start[i] = xmin;
+		c->n[i] = xmax;
+		for (x = 0; x < xmax; ++x)
+			c->w[(size_t)i * c->max_n + x] = k[x] / ww;
+	}
+
+	enif_free(k);
+	return 1;
+}
+
+static inline unsigned char
+clamp_u8(float v)
+{
+	long r = lrintf(v);
+
+	return (r < 0) ? 0 : (r > 255) ? 255 : r;
+}
+
+static void
+hpass_scalar(const unsigned char *src, float *dst, int dw, const struct coeffs *c)
+{
+	const unsigned char *p;
+	const float *w;
+	float s0, s1, s2, s3;
+	int x, k;
+
+	for (x = 0; x < dw; ++x, dst += 4) {
+		p = src + (size_t)c->start[x] * 4;
+		w = c->w + (size_t)x * c->max_n;
+		s0 = s1 = s2 = s3 = 0.0f;
+		for (k = 0; k < c->n[x]; ++k, p += 4) {
+			s0 += w[k] * p[0];
+			s1 += w[k] * p[1];
+			s2 += w[k] * p[2];
+			s3 += w[k] * p[3];
+		}
+		dst[0] = s0;
+		dst[1] = s1;
+		dst[2] = s2;
+		dst[3] = s3;
+	}
+}
+
+/* keeps premultiplied colour at or under alpha in each 4-byte pixel */
+static void
+clamp_to_alpha(uint32_t *px, int n)
+{
+	uint32_t a, c, v;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		v = px[i];
+		a = v >> 24;
+		c = (v >> 16) & 0xff;
+		if (c > a)
+			v = (v & ~0x00ff0000u) | (a << 16);
+		c = (v >> 8) & 0xff;
+		if (c > a)
+			v = (v & ~0x0000ff00u) | (a << 8);
+		c = v & 0xff;
+		if (c > a)
+			v = (v & ~0x000000ffu) | a;
+		px[i] = v;
+	}
+}
+
+static void
+vpass_scalar(const float *src, size_t stride, const float *w, int n, unsigned char *dst, int len, int opaque)
+{
+	float s;
+	int i, k;
+
+	for (i = 0; i < len; ++i) {
+		s = 0.0f;
+		for (k = 0; k < n; ++k)
+			s += w[k] * src[k * stride + i];
+		dst[i] = clamp_u8(s);
+	}
+	if (!opaque)
+		clamp_to_alpha((uint32_t *)dst, len / 4);
+}
+
+static const struct resize_kernels kernels_scalar = {
+	hpass_scalar, vpass_scalar
+};
+
+#ifdef RESIZE_X86
+
+__attribute__((target("sse2")))
+static void
+hpass_sse2(const unsigned char *src, float *dst, int dw, const struct coeffs *c)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const unsigned char *p;
+	const float *w;
+	__m128 acc;
+	__m128i px;
+	int x, k;
+	uint32_t v;
+
+	for (x = 0; x < dw; ++x, dst += 4) {
+		p = src + (size_t)c->start[x] * 4;
+		w = c->w + (size_t)x * c->max_n;
+		acc = _mm_setzero_ps();
+		for (k = 0; k < c->n[x]; ++k, p += 4) {
+			memcpy(&v, p, 4);
+			px = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero), zero);
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_cvtepi32_ps(px)));
+		}
+		_mm_storeu_ps(dst, acc);
+	}
+}
+
+__attribute__((target("sse2")))
+static inline __m128i
+sse2_clamp_to_alpha(__m128i v)
+{
+	__m128i a = _mm_srli_epi32(v, 24);
+
+	a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+	a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+	return _mm_min_epu8(v, a);
+}
+
+__attribute__((target("sse2")))
+static void
+vpass_sse2(const float *src, size_t stride, const float *w, int n, unsigned char *dst, int len, int opaque)
+{
+	__m128 acc[4];
+	__m128i lo, hi, v;
+	int i, j, k;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		for (j = 0; j < 4; ++j)
+			acc[j] = _mm_setzero_ps();
+		for (k = 0; k < n; ++k) {
+			const float *row = src + k * stride + i;
+			__m128 wk = _mm_set1_ps(w[k]);
+
+			for (j = 0; j < 4; ++j)
+				acc[j] = _mm_add_ps(acc[j], _mm_mul_ps(wk, _mm_loadu_ps(row + j * 4)));
+		}
+		/* round to nearest, then saturate to 0..255 on the way down */
+		lo = _mm_packs_epi32(_mm_cvtps_epi32(acc[0]), _mm_cvtps_epi32(acc[1]));
+		hi = _mm_packs_epi32(_mm_cvtps_epi32(acc[2]), _mm_cvtps_epi32(acc[3]));
+		v = _mm_packus_epi16(lo, hi);
+		if (!opaque)
+			v = sse2_clamp_to_alpha(v);
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	}
+	vpass_scalar(src + i, stride, w, n, dst + i, len - i, opaque);
+}
+
+static const struct resize_kernels kernels_sse2 = {
+	hpass_sse2, vpass_sse2
+};
+
+__attribute__((target("avx2")))
+static void
+vpass_avx2(const float *src, size_t stride, const float *w, int n, unsigned char *dst, int len, int opaque)
+{
+	__m256 acc[4];
+	__m256i lo, hi, v, a;
+	int i, j, k;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		for (j = 0; j < 4; ++j)
+			acc[j] = _mm256_setzero_ps();
+		for (k = 0; k < n; ++k) {
+			const float *row = src + k * stride + i;
+			__m256 wk = _mm256_set1_ps(w[k]);
+
+			for (j = 0; j < 4; ++j)
+				acc[j] = _mm256_add_ps(acc[j], _mm256_mul_ps(wk, _mm256_loadu_ps(row + j * 8)));
+		}
+		lo = _mm256_packs_epi32(_mm256_cvtps_epi32(acc[0]), _mm256_cvtps_epi32(acc[1]));
+		hi = _mm256_packs_epi32(_mm256_cvtps_epi32(acc[2]), _mm256_cvtps_epi32(acc[3]));
+		/* the packs work per 128-bit lane; put the pixels back in order */
+		v = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(lo, hi),
+			_mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+		if (!opaque) {
+			a = _mm256_srli_epi32(v, 24);
+			a = _mm256_or_si256(a, _mm256_slli_epi32(a, 8));
+			a = _mm256_or_si256(a, _mm256_slli_epi32(a, 16));
+			v = _mm256_min_epu8(v, a);
+		}
+		_mm256_storeu_si256((__m256i *)(dst + i), v);
+	}
+	vpass_sse2(src + i, stride, w, n, dst + i, len - i, opaque);
+}
+
+/* 2x2 means of rows r0 and r1, four outputs at a time; returns how many */
+__attribute__((target("sse2")))
+static int
+halve_row_sse2(const unsigned char *r0, const unsigned char *r1, unsigned char *dst, int dw)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i two = _mm_set1_epi16(2);
+	__m128i a, b, lo, hi, s[2];
+	int x, j;
+
+	for (x = 0; x + 4 <= dw; x += 4) {
+		for (j = 0; j < 2; ++j) {
+			a = _mm_loadu_si128((const __m128i *)(r0 + x * 8 + j * 16));
+			b = _mm_loadu_si128((const __m128i *)(r1 + x * 8 + j * 16));
+			lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+			hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+			/* each half now holds two pixels' column sums: add the pairs */
+			lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+			hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+			s[j] = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), two), 2);
+		}
+		_mm_storeu_si128((__m128i *)(dst + x * 4), _mm_packus_epi16(s[0], s[1]));
+	}
+	return x;
+}
+
+/* the horizontal taps of neighbouring outputs don't line up, so no wider hpass */
+static const struct resize_kernels kernels_avx2 = {
+	hpass_sse2, vpass_avx2
+};
+
+#endif /* RESIZE_X86 */
+
+static const struct resize_kernels *kernels = &kernels_scalar;
+
+/* as convert_init: one atomic store, loaded once per call */
+void
+resize_init(int use_simd)
+{
+	const struct resize_kernels *k = &kernels_scalar;
+
+	if (use_simd) {
+#ifdef RESIZE_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			k = &kernels_avx2;
+		else if (__builtin_cpu_supports("sse2"))
+			k = &kernels_sse2;
+#endif
+	}
+	__atomic_store_n(&kernels, k, __ATOMIC_RELEASE);
+}
+
+int
+resize_image(const unsigned char *src, int sw, int sh, int sstride,
+    unsigned char *dst, int dw, int dh, int dstride, enum resize_filter filter, int opaque)
+{
+	const struct resize_kernels *k = __atomic_load_n(&kernels, __ATOMIC_ACQUIRE);
+	struct coeffs cx, cy;
+	float *tmp;
+	size_t tstride = (size_t)dw * 4;
+	int y;
+
+	if (!coeffs_init(&cx, sw, dw, filter))
+		return 0;
+	if (!coeffs_init(&cy, sh, dh, filter)) {
+		coeffs_free(&cx);
+		return 0;
+	}
+	if ((tmp = enif_alloc((size_t)sh * tstride * sizeof(float))) == NULL) {
+		coeffs_free(&cx);
+		coeffs_free(&cy);
+		return 0;
+	}
+
+	for (y = 0; y < sh; ++y)
+		k->hpass(src + (size_t)y * sstride, tmp + (size_t)y * tstride, dw, &cx);
+	for (y = 0; y < dh; ++y)
+		k->vpass(tmp + (size_t)cy.start[y] * tstride, tstride,
+			cy.w + (size_t)y * cy.max_n, cy.n[y],
+			dst + (size_t)y * dstride, dw * 4, opaque);
+
+	enif_free(tmp);
+	coeffs_free(&cx);
+	coeffs_free(&cy);
+	return 1;
+}
+
+/*
+ * One mipmap step: each output pixel is the rounded mean of a 2x2 block.
+ * An odd last row or column (and a side already 1 pixel long) reuses its
+ * edge pixels.
+ */
+void
+halve_image(const unsigned char *src, int sw, int sh, int sstride,
+    unsigned char *dst, int dw, int dh, int dstride)
+{
+#ifdef RESIZE_X86
+	const struct resize_kernels *k = __atomic_load_n(&kernels, __ATOMIC_ACQUIRE);
+#endif
+	const unsigned char *r0, *r1;
+	int x, y, c, x0, x1;
+
+	for (y = 0; y < dh; ++y) {
+		r0 = src + (size_t)(2 * y) * sstride;
+		r1 = (2 * y + 1 < sh) ? r0 + sstride : r0;
+		x = 0;
+#ifdef RESIZE_X86
+		if (k != &kernels_scalar && sw >= 2 * dw)
+			x = halve_row_sse2(r0, r1, dst + (size_t)y * dstride, dw);
+#endif
+		for (; x < dw; ++x) {
+			x0 = 2 * x;
+			x1 = (x0 + 1 < sw) ? x0 + 1 : x0;
+			for (c = 0; c < 4; ++c)
+				dst[(size_t)y * dstride + x * 4 + c] =
+					(r0[x0 * 4 + c] + r0[x1 * 4 + c] +
+					r1[x0 * 4 + c] + r1[x1 * 4 + c] + 2) >> 2;
+		}
+	}
+}
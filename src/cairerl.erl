@@ -40,3 +40,197 @@
 
 
 -export_type([antialias_mode/0, tag/0, value/0, op/0, image/0, pixel_format/0]).
+
+-export([encode_ops/1]).
+
+%% Packs a list of ops into the binary op stream taken by
+%% cairerl_nif:draw_binary/3 and cairerl_nif:compile/1:
+%%
+%%   <<"CROP", Version:8, NTags:16/little, Tags/binary, Ops/binary>>
+%%
+%% Each tag is <<Len:8, Name:Len/binary>>, and ops refer to tags by their
+%% index in this table. Each op is an opcode byte followed by its operands;
+%% numbers are little-endian and values are either <<0, Float:64/float>>
+%% or <<1, TagIndex:16>>. The full operand layout of every op is described
+%% in c_src/program.c.
+-define(OPS_MAGIC, "CROP").
+-define(OPS_VERSION, 1).
+
+%% Opcodes, as in enum stream_opcode in c_src/common.h. They are part of the
+%% stream format: never renumber one.
+-define(OPC_ARC, 0).
+-define(OPC_RECTANGLE, 1).
+-define(OPC_NEW_PATH, 2).
+-define(OPC_NEW_SUB_PATH, 3).
+-define(OPC_LINE_TO, 4).
+-define(OPC_MOVE_TO, 5).
+-define(OPC_CLOSE_PATH, 6).
+-define(OPC_SET_LINE_WIDTH, 7).
+-define(OPC_SET_SOURCE, 8).
+-define(OPC_SET_SOURCE_RGBA, 9).
+-define(OPC_SET_ANTIALIAS, 10).
+-define(OPC_CLIP, 11).
+-define(OPC_STROKE, 12).
+-define(OPC_FILL, 13).
+-define(OPC_PAINT, 14).
+-define(OPC_PATTERN_CREATE_FOR_SURFACE, 15).
+-define(OPC_PATTERN_TRANSLATE, 16).
+-define(OPC_IDENTITY_MATRIX, 17).
+-define(OPC_TRANSLATE, 18).
+-define(OPC_SCALE, 19).
+-define(OPC_TEXT_EXTENTS, 20).
+-define(OPC_FONT_EXTENTS, 21).
+-define(OPC_SELECT_FONT_FACE, 22).
+-define(OPC_SET_FONT_SIZE, 23).
+-define(OPC_SHOW_TEXT, 24).
+-define(OPC_SET_TAG, 25).
+-define(OPC_TAG_DEREF, 26).
+
+-spec encode_ops([op()]) -> binary().
+encode_ops(Ops) ->
+	{Encoded, {NTags, TagMap}} = lists:mapfoldl(fun encode_op/2, {0, #{}}, Ops),
+	Tags = [begin
+		Name = atom_to_binary(T, latin1),
+		<<(byte_size(Name)):8, Name/binary>>
+	end || {T, _} <- lists:keysort(2, maps:to_list(TagMap))],
+	iolist_to_binary([<<?OPS_MAGIC, ?OPS_VERSION:8, NTags:16/little>>, Tags, Encoded]).
+
+encode_op(#cairo_arc{xc = Xc, yc = Yc, radius = R, angle1 = A1, angle2 = A2}, S0) ->
+	{Vs, S1} = values([Xc, Yc, R, A1, A2], S0),
+	{[?OPC_ARC | Vs], S1};
+encode_op(#cairo_rectangle{x = X, y = Y, width = W, height = H}, S0) ->
+	{Vs, S1} = values([X, Y, W, H], S0),
+	{[?OPC_RECTANGLE | Vs], S1};
+encode_op(#cairo_new_path{}, S0) ->
+	{[?OPC_NEW_PATH], S0};
+encode_op(#cairo_new_sub_path{}, S0) ->
+	{[?OPC_NEW_SUB_PATH], S0};
+encode_op(#cairo_line_to{x = X, y = Y, flags = F}, S0) ->
+	{Vs, S1} = values([X, Y], S0),
+	{[?OPC_LINE_TO, Vs, flags(F)], S1};
+encode_op(#cairo_move_to{x = X, y = Y, flags = F}, S0) ->
+	{Vs, S1} = values([X, Y], S0),
+	{[?OPC_MOVE_TO, Vs, flags(F)], S1};
+encode_op(#cairo_close_path{}, S0) ->
+	{[?OPC_CLOSE_PATH], S0};
+encode_op(#cairo_set_line_width{width = W}, S0) ->
+	{V, S1} = value(W, S0),
+	{[?OPC_SET_LINE_WIDTH, V], S1};
+encode_op(#cairo_set_source{tag = T}, S0) ->
+	{Tb, S1} = tag(T, S0),
+	{[?OPC_SET_SOURCE, Tb], S1};
+encode_op(#cairo_set_source_rgba{r = R, g = G, b = B, a = A}, S0) ->
+	{[?OPC_SET_SOURCE_RGBA, <<R:64/little-float, G:64/little-float, B:64/little-float, A:64/little-float>>], S0};
+encode_op(#cairo_set_antialias{mode = M}, S0) ->
+	{[?OPC_SET_ANTIALIAS, aa_mode(M)], S0};
+encode_op(#cairo_clip{flags = F}, S0) ->
+	{[?OPC_CLIP, flags(F)], S0};
+encode_op(#cairo_stroke{flags = F}, S0) ->
+	{[?OPC_STROKE, flags(F)], S0};
+encode_op(#cairo_fill{flags = F}, S0) ->
+	{[?OPC_FILL, flags(F)], S0};
+encode_op(#cairo_paint{alpha = undefined}, S0) ->
+	{[?OPC_PAINT, 0], S0};
+encode_op(#cairo_paint{alpha = A}, S0) ->
+	{[?OPC_PAINT, 1, <<A:64/little-float>>], S0};
+encode_op(#cairo_pattern_create_for_surface{tag = T, image = Img}, S0) ->
+	{Tb, S1} = tag(T, S0),
+	#cairo_image{width = W, height = H, format = F, data = D} = Img,
+	{[?OPC_PATTERN_CREATE_FOR_SURFACE, Tb, <<W:32/little, H:32/little, (pixel_format(F)):8,
+		(byte_size(D)):32/little>>, D], S1};
+encode_op(#cairo_pattern_translate{tag = T, x = X, y = Y}, S0) ->
+	{Tb, S1} = tag(T, S0),
+	{Vs, S2} = values([X, Y], S1),
+	{[?OPC_PATTERN_TRANSLATE, Tb, Vs], S2};
+encode_op(#cairo_identity_matrix{}, S0) ->
+	{[?OPC_IDENTITY_MATRIX], S0};
+encode_op(#cairo_translate{x = X, y = Y}, S0) ->
+	{Vs, S1} = values([X, Y], S0),
+	{[?OPC_TRANSLATE | Vs], S1};
+encode_op(#cairo_scale{x = X, y = Y}, S0) ->
+	{Vs, S1} = values([X, Y], S0),
+	{[?OPC_SCALE | Vs], S1};
+encode_op(#cairo_text_extents{tag = T, text = Text}, S0) ->
+	{Tb, S1} = tag(T, S0),
+	{[?OPC_TEXT_EXTENTS, Tb, text(Text)], S1};
+encode_op(#cairo_font_extents{tag = T}, S0) ->
+	{Tb, S1} = tag(T, S0),
+	{[?OPC_FONT_EXTENTS, Tb], S1};
+encode_op(#cairo_select_font_face{family = Family, slant = Sl, weight = Wt}, S0) ->
+	{[?OPC_SELECT_FONT_FACE, text(Family), slant(Sl), weight(Wt)], S0};
+encode_op(#cairo_set_font_size{size = Sz}, S0) ->
+	{V, S1} = value(Sz, S0),
+	{[?OPC_SET_FONT_SIZE, V], S1};
+encode_op(#cairo_show_text{text = Text}, S0) ->
+	{[?OPC_SHOW_TEXT, text(Text)], S0};
+encode_op(#cairo_set_tag{tag = T, value = V}, S0) ->
+	{Tb, S1} = tag(T, S0),
+	{Vb, S2} = value(V, S1),
+	{[?OPC_SET_TAG, Tb, Vb], S2};
+encode_op(#cairo_tag_deref{tag = T, field = F, out_tag = Out}, S0) ->
+	{Tb, S1} = tag(T, S0),
+	{Ob, S2} = tag(Out, S1),
+	{[?OPC_TAG_DEREF, Tb, deref_field(F), Ob], S2};
+encode_op(Op, _S0) ->
+	error({unknown_op, Op}).
+
+%% The tag count is a 16-bit field, so a stream holds at most 16#ffff tags.
+-define(MAX_TAGS, 16#ffff).
+
+tag(T, {N, Map} = S0) when is_atom(T) ->
+	case Map of
+		#{T := Idx} -> {<<Idx:16/little>>, S0};
+		_ when N >= ?MAX_TAGS -> error({too_many_tags, N + 1});
+		_ -> {<<N:16/little>>, {N + 1, Map#{T => N}}}
+	end.
+
+value(V, S0) when is_number(V) ->
+	{<<0, V:64/little-float>>, S0};
+value(T, S0) when is_atom(T) ->
+	{Tb, S1} = tag(T, S0),
+	{[1, Tb], S1}.
+
+values(Vs, S0) ->
+	lists:mapfoldl(fun value/2, S0, Vs).
+
+flags(Flags) ->
+	lists:foldl(fun
+		(relative, Acc) -> Acc bor 1;
+		(preserve, Acc) -> Acc bor 2;
+		(_, Acc) -> Acc
+	end, 0, Flags).
+
+text(Text) ->
+	Bin = iolist_to_binary(Text),
+	[<<(byte_size(Bin)):32/little>>, Bin].
+
+%% The enum operands are the stream's own constants; the NIF maps them to
+%% cairo's values, so these must match c_src/program.c, not cairo.h.
+pixel_format(argb32) -> 0;
+pixel_format(rgb24) -> 1;
+pixel_format(rgb16_565) -> 4;
+pixel_format(rgb30) -> 5.
+
+aa_mode(default) -> 0;
+aa_mode(gray) -> 2;
+aa_mode(fast) -> 4;
+aa_mode(good) -> 5;
+aa_mode(best) -> 6.
+
+slant(normal) -> 0;
+slant(italic) -> 1;
+slant(oblique) -> 2.
+
+weight(normal) -> 0;
+weight(bold) -> 1.
+
+deref_field(x_bearing) -> 0;
+deref_field(y_bearing) -> 1;
+deref_field(width) -> 2;
+deref_field(height) -> 3;
+deref_field(x_advance) -> 4;
+deref_field(y_advance) -> 5;
+deref_field(ascent) -> 6;
+deref_field(descent) -> 7;
+deref_field(max_x_advance) -> 8;
+deref_field(max_y_advance) -> 9.
@@ -28,7 +28,13 @@
 
 -module(cairerl_nif).
 
--export([draw/3, png_read/1, png_write/2]).
+-export([draw/3, draw/4, draw_binary/3, compile/1, draw_compiled/3, draw_async/4, draw_many/1,
+         canvas_new/3, canvas_draw/3, canvas_draw/4, canvas_snapshot/1, canvas_map/5,
+         record/2, replay/3,
+         buffer_pool_stats/0, set_simd/1, png_read/1, png_write/2, png_encode/1, png_encode/2,
+         png_decode/1, png_write_async/3, convert/2,
+         qoi_encode/1, qoi_decode/1, resize/4, mipmaps/2,
+         image_resource/1]).
 -on_load(init/0).
 
 -include("cairerl.hrl").
@@ -42,17 +48,187 @@ init() ->
                   Path ->
                       Path
               end,
-    erlang:load_nif(filename:join(PrivDir, ?MODULE), 0).
+    LoadInfo = #{
+        scheduling => application:get_env(cairerl, scheduling, dirty),
+        async_threads => application:get_env(cairerl, async_threads, 0),
+        async_queue => application:get_env(cairerl, async_queue, 1024),
+        buffer_pool_cap => application:get_env(cairerl, buffer_pool_cap, 4),
+        buffer_pool_max_mb => application:get_env(cairerl, buffer_pool_max_mb, 64),
+        buffer_pool_sizes => application:get_env(cairerl, buffer_pool_sizes, []),
+        simd => application:get_env(cairerl, simd, true)
+    },
+    erlang:load_nif(filename:join(PrivDir, ?MODULE), LoadInfo).
 
 -type tags() :: [{atom(), float() | tags()}].
+-type rect() :: {X :: non_neg_integer(), Y :: non_neg_integer(), W :: pos_integer(), H :: pos_integer()}.
+-type draw_opt() :: {tiles, pos_integer()} | damage.
+-type png_opt() :: {level, 0..9} | {filter, none | sub | up | paeth | adaptive} | {strategy, rle | default}.
+-type px_layout() :: rgba | bgra | rgb.
+-opaque program() :: reference().
+-opaque canvas() :: reference().
+-opaque recording() :: reference().
+-opaque image_resource() :: reference().
+-type matrix() :: {XX :: float(), YX :: float(), XY :: float(), YY :: float(), X0 :: float(), Y0 :: float()}.
+-export_type([program/0, canvas/0, recording/0, image_resource/0, matrix/0, rect/0, png_opt/0, px_layout/0]).
+
 -spec draw(Pixels :: cairerl:image(), InitTags :: tags(), Ops :: [cairerl:op()]) -> {ok, tags(), cairerl:image()} | {error, term()}.
 draw(_Pixels, _InitTags, _Ops) ->
 	error(bad_nif).
 
+%% As draw/3, with options. {tiles, N} splits the image into N horizontal
+%% bands which replay the ops in parallel on the render pool. damage adds
+%% a list of pixel rects covering everything the ops drew to the result.
+-spec draw(Pixels :: cairerl:image(), InitTags :: tags(), Ops :: [cairerl:op()] | binary() | program(), Opts :: [draw_opt()]) -> {ok, tags(), cairerl:image()} | {ok, tags(), cairerl:image(), [rect()]} | {error, term()}.
+draw(_Pixels, _InitTags, _Ops, _Opts) ->
+	error(bad_nif).
+
+-spec draw_binary(Pixels :: cairerl:image(), InitTags :: tags(), Ops :: binary()) -> {ok, tags(), cairerl:image()} | {error, term()}.
+draw_binary(_Pixels, _InitTags, _Ops) ->
+	error(bad_nif).
+
+-spec compile(Ops :: [cairerl:op()] | binary()) -> {ok, program()} | {error, term()}.
+compile(_Ops) ->
+	error(bad_nif).
+
+-spec draw_compiled(Pixels :: cairerl:image(), InitTags :: tags(), Program :: program()) -> {ok, tags(), cairerl:image()} | {error, term()}.
+draw_compiled(_Pixels, _InitTags, _Program) ->
+	error(bad_nif).
+
+%% Queues the draw on the native render pool and returns at once. The
+%% result arrives later as {cairerl_done, Ref, Result}, where Result is
+%% whatever draw/3 would have returned.
+-spec draw_async(Ref :: term(), Pixels :: cairerl:image(), InitTags :: tags(), Ops :: [cairerl:op()] | binary() | program()) -> ok | {error, busy}.
+draw_async(_Ref, _Pixels, _InitTags, _Ops) ->
+	error(bad_nif).
+
+%% Renders a batch of independent draws across the render pool in one call.
+%% Results come back in the same order as the jobs.
+-spec draw_many(Jobs :: [{cairerl:image(), tags(), [cairerl:op()] | binary() | program()}]) -> [{ok, tags(), cairerl:image()} | {error, term()}].
+draw_many(_Jobs) ->
+	error(bad_nif).
+
+%% Canvases own their pixels and are drawn on in place; canvas_snapshot/1
+%% copies the current pixels out as an image.
+-spec canvas_new(W :: non_neg_integer(), H :: non_neg_integer(), Format :: cairerl:pixel_format()) -> {ok, canvas()} | {error, term()}.
+canvas_new(_W, _H, _Format) ->
+	error(bad_nif).
+
+%% A canvas whose pixels are a shared mapping of Path (a file, or one in
+%% /dev/shm), created or grown as needed. Draws show up in the file as
+%% they happen. With header, the pixels follow a 64-byte header holding
+%% the layout, a seqlock (odd while a draw is in progress) and a frame
+%% counter; see struct fb_header in c_src/cairerl_nif.c.
+-spec canvas_map(Path :: binary() | iolist(), W :: non_neg_integer(), H :: non_neg_integer(), Format :: cairerl:pixel_format(), Opts :: [header]) -> {ok, canvas()} | {error, term()}.
+canvas_map(_Path, _W, _H, _Format, _Opts) ->
+	error(bad_nif).
+
+-spec canvas_draw(Canvas :: canvas(), InitTags :: tags(), Ops :: [cairerl:op()] | binary() | program()) -> {ok, tags()} | {error, term()}.
+canvas_draw(_Canvas, _InitTags, _Ops) ->
+	error(bad_nif).
+
+-spec canvas_draw(Canvas :: canvas(), InitTags :: tags(), Ops :: [cairerl:op()] | binary() | program(), Opts :: [damage]) -> {ok, tags()} | {ok, tags(), [rect()]} | {error, term()}.
+canvas_draw(_Canvas, _InitTags, _Ops, _Opts) ->
+	error(bad_nif).
+
+-spec canvas_snapshot(Canvas :: canvas()) -> {ok, cairerl:image()} | {error, term()}.
+canvas_snapshot(_Canvas) ->
+	error(bad_nif).
+
+%% Runs the ops once into a resolution-independent recording, so the same
+%% drawing can be rasterised at several scales without decoding the ops
+%% or evaluating tags again. The tags are as draw/3 would return them.
+-spec record(InitTags :: tags(), Ops :: [cairerl:op()] | binary() | program()) -> {ok, tags(), recording()} | {error, term()}.
+record(_InitTags, _Ops) ->
+	error(bad_nif).
+
+%% Paints a recording over a copy of the image through Matrix, e.g.
+%% {2.0, 0.0, 0.0, 2.0, 0.0, 0.0} for 2x.
+-spec replay(Recording :: recording(), Pixels :: cairerl:image(), Matrix :: matrix()) -> {ok, cairerl:image()} | {error, term()}.
+replay(_Recording, _Pixels, _Matrix) ->
+	error(bad_nif).
+
+%% Hit/miss counters for the pool of draw output buffers, per size.
+-spec buffer_pool_stats() -> [{{non_neg_integer(), non_neg_integer(), cairerl:pixel_format()}, [{atom(), non_neg_integer()}]} | {unpooled, non_neg_integer()}].
+buffer_pool_stats() ->
+	error(bad_nif).
+
+%% Switches pixel conversion and resizing between the SIMD and scalar
+%% kernels at runtime and returns the previous setting. Their output is
+%% identical; this is for tests and benchmarks, not production. With the
+%% simd app env set to false, the scalar kernels stay in use.
+-spec set_simd(boolean()) -> boolean().
+set_simd(_Enabled) ->
+	error(bad_nif).
+
+%% Writes the file from a dirty IO scheduler.
 -spec png_write(Pixels :: cairerl:image(), Filename :: binary() | iolist()) -> ok | {error, term()}.
 png_write(_Pixels, _Filename) ->
 	error(bad_nif).
 
+%% Reads the file from a dirty IO scheduler.
 -spec png_read(Filename :: binary() | iolist()) -> {ok, cairerl:image()} | {error, term()}.
 png_read(_Filename) ->
 	error(bad_nif).
+
+%% Encodes an image as PNG in memory, on a dirty scheduler.
+-spec png_encode(Pixels :: cairerl:image()) -> {ok, binary()} | {error, term()}.
+png_encode(_Pixels) ->
+	error(bad_nif).
+
+%% Encodes with our own libpng setup instead of cairo's defaults: a low
+%% level for fast previews, or rle with sub/up filtering for small output
+%% on flat-colour images.
+-spec png_encode(Pixels :: cairerl:image(), Opts :: [png_opt()]) -> {ok, binary()} | {error, term()}.
+png_encode(_Pixels, _Opts) ->
+	error(bad_nif).
+
+%% Decodes a PNG held in memory, on a dirty scheduler.
+-spec png_decode(Png :: binary() | iolist()) -> {ok, cairerl:image()} | {error, term()}.
+png_decode(_Png) ->
+	error(bad_nif).
+
+%% Writes the image as PNG to a path or an open file descriptor on the
+%% native pool. Completion arrives as {cairerl_done, Ref, ok | {error, _}};
+%% a descriptor is left open for the caller to close.
+-spec png_write_async(Ref :: term(), Pixels :: cairerl:image(), Dest :: binary() | iolist() | {fd, non_neg_integer()}) -> ok | {error, term()}.
+png_write_async(_Ref, _Pixels, _Dest) ->
+	error(bad_nif).
+
+%% Converts a cairo image to straight-alpha RGBA, BGRA or RGB bytes, or
+%% ({Layout, W, H, Pixels}, argb32 | rgb24) back into a cairo image.
+-spec convert(Pixels :: cairerl:image(), Target :: px_layout()) -> {ok, binary()} | {error, term()};
+             ({px_layout(), pos_integer(), pos_integer(), binary()}, Target :: argb32 | rgb24) -> {ok, cairerl:image()} | {error, term()}.
+convert(_Pixels, _Target) ->
+	error(bad_nif).
+
+%% Encodes an argb32 or rgb24 image as QOI (straight alpha, as the format
+%% requires), on a dirty scheduler. Much cheaper than PNG, for links where
+%% bytes are cheap and latency is not.
+-spec qoi_encode(Pixels :: cairerl:image()) -> {ok, binary()} | {error, term()}.
+qoi_encode(_Pixels) ->
+	error(bad_nif).
+
+%% Decodes QOI into an argb32 (4 channels) or rgb24 (3 channels) image.
+-spec qoi_decode(Qoi :: binary() | iolist()) -> {ok, cairerl:image()} | {error, term()}.
+qoi_decode(_Qoi) ->
+	error(bad_nif).
+
+%% Resamples an argb32 or rgb24 image to W x H on a dirty scheduler. Box
+%% averages the covered area (best for big reductions), lanczos is the
+%% sharpest.
+-spec resize(Pixels :: cairerl:image(), W :: pos_integer(), H :: pos_integer(), Filter :: box | bilinear | lanczos) -> {ok, cairerl:image()} | {error, term()}.
+resize(_Pixels, _W, _H, _Filter) ->
+	error(bad_nif).
+
+%% Up to Levels successive halvings of the image (2x2 box filter), largest
+%% first, stopping at 1x1.
+-spec mipmaps(Pixels :: cairerl:image(), Levels :: non_neg_integer()) -> {ok, [cairerl:image()]} | {error, term()}.
+mipmaps(_Pixels, _Levels) ->
+	error(bad_nif).
+
+%% Copies the image's pixels once into native memory, for
+%% #cairo_pattern_create_for_resource{} ops to use in any number of later
+%% draws without decoding or wrapping the image again.
+-spec image_resource(Pixels :: cairerl:image()) -> {ok, image_resource()} | {error, term()}.
+image_resource(_Pixels) ->
+	error(bad_nif).
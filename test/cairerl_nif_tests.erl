@@ -0,0 +1,228 @@
+%%
+%% cairo erlang binding
+%%
+%% Copyright (c) 2014, The University of Queensland
+%% Author: Alex Wilson <alex@uq.edu.au>
+%%
+%% Redistribution and use in source and binary forms, with or without
+%% modification, are permitted provided that the following conditions are met:
+%%
+%%  * Redistributions of source code must retain the above copyright notice,
+%%    this list of conditions and the following disclaimer.
+%%  * Redistributions in binary form must reproduce the above copyright notice,
+%%    this list of conditions and the following disclaimer in the documentation
+%%    and/or other materials provided with the distribution.
+%%
+%% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+%% AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+%% IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+%% ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+%% LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+%% CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF
+%% SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR  BUSINESS
+%% INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+%% CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+%% ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+%% POSSIBILITY OF SUCH DAMAGE.
+%%
+
+-module(cairerl_nif_tests).
+
+-include_lib("eunit/include/eunit.hrl").
+-include("cairerl.hrl").
+
+%% Odd widths leave a tail after every SIMD block (4 px for SSE2, 8 for
+%% AVX2), so each kernel's scalar tail gets run too.
+widths() ->
+	[1, 2, 3, 5, 7, 8, 9, 15, 16, 17, 31, 33, 64, 65].
+
+%% Straight-alpha RGBA with the alphas the kernels special-case (0, 1,
+%% 254, 255) on every fifth pixel, and anything else in between.
+straight(W, H) ->
+	rand:seed(exsss, {W, H, 1}),
+	<< <<(byte()), (byte()), (byte()), (alpha(I))>> || I <- lists:seq(0, W * H - 1) >>.
+
+alpha(I) ->
+	case I rem 5 of
+		0 -> 0;
+		1 -> 1;
+		2 -> 254;
+		3 -> 255;
+		4 -> byte()
+	end.
+
+byte() ->
+	rand:uniform(256) - 1.
+
+premul(W, H, Straight) ->
+	{ok, Img} = cairerl_nif:convert({rgba, W, H, Straight}, argb32),
+	Img.
+
+with_simd(Enabled, Fun) ->
+	Prev = cairerl_nif:set_simd(Enabled),
+	try
+		Fun()
+	after
+		cairerl_nif:set_simd(Prev)
+	end.
+
+%% A premultiplied pixel survives unpremultiplying and premultiplying
+%% again exactly, in both kernel sets.
+premul_round_trip_test_() ->
+	[{lists:flatten(io_lib:format("simd=~p w=~b", [Simd, W])),
+	  fun () -> with_simd(Simd, fun () -> premul_round_trip(W, 3) end) end}
+	|| Simd <- [true, false], W <- widths()].
+
+premul_round_trip(W, H) ->
+	Img = premul(W, H, straight(W, H)),
+	[begin
+		{ok, Straight} = cairerl_nif:convert(Img, Layout),
+		{ok, Img2} = cairerl_nif:convert({Layout, W, H, Straight}, argb32),
+		?assertEqual(Img, Img2)
+	end || Layout <- [rgba, bgra]].
+
+%% Opaque pixels come back from premultiplying exactly as they went in.
+opaque_round_trip_test() ->
+	W = 17,
+	H = 3,
+	Straight = << <<R, G, B, 255>> || <<R, G, B, _>> <= straight(W, H) >>,
+	[with_simd(Simd, fun () ->
+		?assertEqual({ok, Straight}, cairerl_nif:convert(premul(W, H, Straight), rgba))
+	end) || Simd <- [true, false]].
+
+%% simd=false must give byte-identical output to the SIMD kernels.
+simd_matches_scalar_test_() ->
+	[{integer_to_list(W), fun () -> simd_matches_scalar(W, 5) end} || W <- widths()].
+
+simd_matches_scalar(W, H) ->
+	S = straight(W, H),
+	Run = fun () ->
+		Img = premul(W, H, S),
+		{ok, Rgb24} = cairerl_nif:convert({bgra, W, H, S}, rgb24),
+		[Img, Rgb24,
+		 [cairerl_nif:convert(Img, L) || L <- [rgba, bgra, rgb]],
+		 [cairerl_nif:resize(I, W * 2 + 1, H + 2, F) || I <- [Img, Rgb24], F <- [box, bilinear, lanczos]],
+		 [cairerl_nif:resize(I, max(1, W div 3), 2, F) || I <- [Img, Rgb24], F <- [box, bilinear, lanczos]],
+		 [cairerl_nif:mipmaps(I, 4) || I <- [Img, Rgb24]]]
+	end,
+	?assertEqual(with_simd(true, Run), with_simd(false, Run)).
+
+qoi_round_trip_test_() ->
+	[{"argb32 " ++ integer_to_list(W), fun () -> qoi_argb32(W, 4) end} || W <- widths()] ++
+	[{"rgb24 " ++ integer_to_list(W), fun () -> qoi_rgb24(W, 4) end} || W <- widths()] ++
+	[{"solid", fun () -> qoi_argb32_solid(100, 50) end}].
+
+qoi_argb32(W, H) ->
+	Img = premul(W, H, straight(W, H)),
+	{ok, Qoi} = cairerl_nif:qoi_encode(Img),
+	?assertEqual({ok, Img}, cairerl_nif:qoi_decode(Qoi)).
+
+%% rgb24 leaves the top byte of each pixel undefined, so compare as RGB.
+qoi_rgb24(W, H) ->
+	{ok, Img} = cairerl_nif:convert({rgba, W, H, straight(W, H)}, rgb24),
+	{ok, Qoi} = cairerl_nif:qoi_encode(Img),
+	{ok, Img2} = cairerl_nif:qoi_decode(Qoi),
+	?assertMatch(#cairo_image{width = W, height = H, format = rgb24}, Img2),
+	?assertEqual(cairerl_nif:convert(Img, rgb), cairerl_nif:convert(Img2, rgb)).
+
+%% Long runs, which QOI packs 62 pixels to a byte.
+qoi_argb32_solid(W, H) ->
+	Img = premul(W, H, binary:copy(<<10, 20, 30, 128>>, W * H)),
+	{ok, Qoi} = cairerl_nif:qoi_encode(Img),
+	?assertEqual({ok, Img}, cairerl_nif:qoi_decode(Qoi)).
+
+qoi_truncated_test() ->
+	{ok, Qoi} = cairerl_nif:qoi_encode(premul(64, 64, straight(64, 64))),
+	?assertEqual({error, truncated_qoi_data},
+		cairerl_nif:qoi_decode(binary:part(Qoi, 0, byte_size(Qoi) - 100))),
+	%% a header far bigger than its data is refused before allocating
+	Lie = <<"qoif", 32768:32, 32768:32, 4, 0, 0:56, 1>>,
+	?assertEqual({error, truncated_qoi_data}, cairerl_nif:qoi_decode(Lie)).
+
+%% set_simd/1 hands back the setting it replaced, so callers can restore it.
+set_simd_returns_previous_test() ->
+	Prev = cairerl_nif:set_simd(false),
+	?assert(is_boolean(Prev)),
+	?assertEqual(false, cairerl_nif:set_simd(Prev)),
+	?assertEqual(Prev, cairerl_nif:set_simd(Prev)).
+
+set_simd_badarg_test() ->
+	?assertError(badarg, cairerl_nif:set_simd(maybe)).
+
+%% One of every op encode_ops/1 can pack, each one's enum operands set to
+%% something other than the default, so a wrong opcode or enum constant
+%% on either side shows up as different pixels or tags.
+stream_ops() ->
+	Tile = #cairo_image{width = 4, height = 4, format = rgb24,
+		data = << <<(I * 16), 255 - I * 16, 128, 0>> || I <- lists:seq(0, 15) >>},
+	[#cairo_set_tag{tag = r, value = 4.0},
+	 #cairo_set_tag{tag = r2, value = r},
+	 #cairo_set_source_rgba{r = 1.0, g = 0.5, b = 0.25, a = 0.75},
+	 #cairo_set_antialias{mode = gray},
+	 #cairo_set_line_width{width = 2.0},
+	 #cairo_new_path{},
+	 #cairo_move_to{x = 2.0, y = 2.0},
+	 #cairo_line_to{x = 10.0, y = 4.0},
+	 #cairo_line_to{x = -3.0, y = 6.0, flags = [relative]},
+	 #cairo_close_path{},
+	 #cairo_stroke{flags = [preserve]},
+	 #cairo_fill{},
+	 #cairo_new_sub_path{},
+	 #cairo_arc{xc = 16.0, yc = 12.0, radius = r2, angle1 = 0.0, angle2 = 3.0},
+	 #cairo_rectangle{x = 20.0, y = 2.0, width = 6.0, height = 8.0},
+	 #cairo_fill{flags = [preserve]},
+	 #cairo_translate{x = 1.0, y = 1.0},
+	 #cairo_scale{x = 1.5, y = 1.0},
+	 #cairo_pattern_create_for_surface{tag = tile, image = Tile},
+	 #cairo_pattern_translate{tag = tile, x = 2.0, y = 0.0},
+	 #cairo_set_source{tag = tile},
+	 #cairo_paint{alpha = 0.5},
+	 #cairo_identity_matrix{},
+	 #cairo_set_source_rgba{r = 0.0, g = 0.0, b = 1.0},
+	 #cairo_select_font_face{family = <<"sans">>, slant = italic, weight = bold},
+	 #cairo_set_font_size{size = 8.0},
+	 #cairo_text_extents{tag = te, text = <<"Hi", 0>>},
+	 #cairo_tag_deref{tag = te, field = x_advance, out_tag = adv},
+	 #cairo_font_extents{tag = fe},
+	 #cairo_tag_deref{tag = fe, field = ascent, out_tag = asc},
+	 #cairo_move_to{x = adv, y = asc},
+	 #cairo_show_text{text = <<"Hi", 0>>},
+	 #cairo_clip{},
+	 #cairo_paint{}].
+
+%% draw_binary/3 on the encoded ops gives byte-identical output to draw/3
+%% on the list, after every op.
+draw_binary_matches_draw_test_() ->
+	Img = #cairo_image{width = 32, height = 24, format = argb32,
+		data = binary:copy(<<0, 0, 0, 0>>, 32 * 24)},
+	Ops = stream_ops(),
+	[{atom_to_list(element(1, lists:last(Prefix))), fun () ->
+		?assertMatch({ok, _, _}, cairerl_nif:draw(Img, [], Prefix)),
+		?assertEqual(cairerl_nif:draw(Img, [], Prefix),
+			cairerl_nif:draw_binary(Img, [], cairerl:encode_ops(Prefix)))
+	end} || N <- lists:seq(1, length(Ops)), Prefix <- [lists:sublist(Ops, N)]].
+
+%% Every op with a stream opcode is in stream_ops/0.
+stream_ops_cover_opcodes_test() ->
+	Kinds = lists:usort([element(1, Op) || Op <- stream_ops()]),
+	?assertEqual(27, length(Kinds)).
+
+%% The same ops give the same tags and pixels down every draw route:
+%% compiled from a list or a stream, split into bands, and batched.
+draw_routes_match_test_() ->
+	Img = #cairo_image{width = 32, height = 24, format = argb32,
+		data = binary:copy(<<0, 0, 0, 0>>, 32 * 24)},
+	Tags = [{r0, 2.0}],
+	Ops = stream_ops(),
+	Bin = cairerl:encode_ops(Ops),
+	Want = cairerl_nif:draw(Img, Tags, Ops),
+	{ok, ListProg} = cairerl_nif:compile(Ops),
+	{ok, BinProg} = cairerl_nif:compile(Bin),
+	[{"draw/3 succeeds", ?_assertMatch({ok, _, _}, Want)},
+	 {"draw_compiled list", ?_assertEqual(Want, cairerl_nif:draw_compiled(Img, Tags, ListProg))},
+	 {"draw_compiled stream", ?_assertEqual(Want, cairerl_nif:draw_compiled(Img, Tags, BinProg))}] ++
+	[{"tiles " ++ integer_to_list(N) ++ " " ++ Kind,
+	  ?_assertEqual(Want, cairerl_nif:draw(Img, Tags, In, [{tiles, N}]))}
+	 || N <- [1, 2, 5, 24], {Kind, In} <- [{"list", Ops}, {"stream", Bin}, {"program", ListProg}]] ++
+	[{"draw_many", ?_assertEqual([Want, Want, Want],
+		cairerl_nif:draw_many([{Img, Tags, Ops}, {Img, Tags, Bin}, {Img, Tags, BinProg}]))}].